@@ -0,0 +1,266 @@
+#include "corpus.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace {
+
+// Linear congruential generator, the same sequence on every platform
+class Random
+{
+public:
+	explicit Random(unsigned int seed) : m_state(seed) {}
+
+	// [ret] Number in [0, n)
+	int below(int n)
+	{
+		m_state = m_state * 1103515245u + 12345u;
+		return int((m_state >> 8) % unsigned(n));
+	}
+
+	template<int N>
+	const char* pick(const char* const (&words)[N])
+	{
+		return words[below(N)];
+	}
+
+private:
+	unsigned int m_state;
+};
+
+const char* const k_types[] = {
+	"_Tp", "_Alloc", "size_type", "difference_type", "_Iterator",
+	"_ForwardIterator", "_Compare", "value_type", "pointer", "const_reference"
+};
+
+const char* const k_names[] = {
+	"_M_impl", "_M_start", "_M_finish", "_M_end_of_storage", "__first",
+	"__last", "__result", "__comp", "__n", "__x", "__position", "__len"
+};
+
+const char* const k_words[] = {
+	"the", "tokenizer", "returns", "each", "element", "of", "range", "is",
+	"valid", "until", "container", "modified", "see", "also", "iterator",
+	"a", "copy", "given", "pointer", "behavior", "undefined", "when"
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void append_format(std::string& str, const char* format, ...)
+{
+	char buf[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	str += buf;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void append_words(Random& random, std::string& str, int count)
+{
+	for(int i = 0; i < count; ++i)
+	{
+		if( i > 0 )
+		{
+			str += ' ';
+		}
+		str += random.pick(k_words);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void make_stl_header(Random& random, int size, std::string& str)
+{
+	str += "// -*- C++ -*-\n#ifndef _GEN_STL_H\n#define _GEN_STL_H 1\n\n"
+	       "namespace std _GLIBCXX_VISIBILITY(default)\n{\n";
+	for(int n = 0; int(str.size()) < size; ++n)
+	{
+		const char* t = random.pick(k_types);
+		const char* a = random.pick(k_names);
+		const char* b = random.pick(k_names);
+		append_format(str,
+		    "  /**\n"
+		    "   *  @brief  Returns the %s of the %s.\n"
+		    "   */\n"
+		    "  template<typename %s, typename _Alloc = std::allocator<_Tp> >\n"
+		    "    class _Gen_base_%d : protected _Vector_base<_Tp, _Alloc>\n"
+		    "    {\n", random.pick(k_words), random.pick(k_words), t, n);
+		append_format(str,
+		    "      typedef typename _Alloc::template rebind<%s>::other\t_Tp_alloc;\n"
+		    "    public:\n"
+		    "      %s\n"
+		    "      size() const _GLIBCXX_NOEXCEPT\n"
+		    "      { return %s(this->%s._M_finish - this->_M_impl._M_start); }\n\n",
+		    t, t, t, a);
+		append_format(str,
+		    "      void\n"
+		    "      _M_fill(%s __pos, const_reference __val, size_type __n = %d)\n"
+		    "      {\n"
+		    "\tif (__n != 0 && %s >= %s)\n"
+		    "\t  for (; __n > 0; --__n, ++__pos)\n"
+		    "\t    *__pos = __val;\n"
+		    "\telse\n"
+		    "\t  std::__throw_length_error(__N(\"_M_fill\"));\n"
+		    "      }\n"
+		    "    };\n\n", t, n % 64, a, b);
+	}
+	str += "} // namespace std\n\n#endif\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void make_macro_heavy(Random& random, int size, std::string& str)
+{
+	for(int n = 0; int(str.size()) < size; ++n)
+	{
+		const char* t = random.pick(k_types);
+		append_format(str,
+		    "#define GEN_FIELD_%d(type, name) \\\n"
+		    "\ttype m_##name; \\\n"
+		    "\ttype get_##name() const { return m_##name; } \\\n"
+		    "\tvoid set_##name(type v) { m_##name = v; }\n"
+		    "#if defined(GEN_FEATURE_%d) && GEN_FEATURE_%d > 2\n",
+		    n, n, n);
+		append_format(str,
+		    "#  include \"gen_feature_%s.h\"\n"
+		    "#elif !defined(%s) /* disabled */\n"
+		    "GEN_FIELD_%d(int, value)\n"
+		    "#  define GEN_CALL(x) gen_call_##x(__FILE__, __LINE__)\n"
+		    "#else\n"
+		    "#  error \"unsupported configuration\"\n"
+		    "#endif\n"
+		    "#undef GEN_CALL\n\n", random.pick(k_words), t, n);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void make_comment_heavy(Random& random, int size, std::string& str)
+{
+	for(int n = 0; int(str.size()) < size; ++n)
+	{
+		str += "/*\n";
+		int lines = 3 + random.below(6);
+		for(int i = 0; i < lines; ++i)
+		{
+			str += " * ";
+			append_words(random, str, 6 + random.below(8));
+			str += "\n";
+		}
+		str += " */\n";
+		append_format(str, "int gen_function_%s_%s_%d(int value); // ",
+		    random.pick(k_words), random.pick(k_words), n);
+		append_words(random, str, 5);
+		str += "\n\n// ";
+		append_words(random, str, 10);
+		str += "\n// ";
+		append_words(random, str, 8);
+		str += "\n\n";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void make_literal_heavy(Random& random, int size, std::string& str)
+{
+	static const char* const k_chars[] = {
+		"'a'", "'\\n'", "'\\''", "'\\\\'", "'\\x7f'", "'0'", "' '"
+	};
+	static const char* const k_strings[] = {
+		"\"\"", "\"word\"", "\"tab\\there\"", "\"quote \\\"q\\\"\"",
+		"L\"wide\"", "\"line\\n\"", "\"\\0\\1\\2\""
+	};
+	char buf[32];
+	for(int n = 0; int(str.size()) < size; ++n)
+	{
+		snprintf(buf, sizeof(buf), "%d", n);
+		str += "static const unsigned int gen_table_";
+		str += buf;
+		str += "[] = {\n";
+		for(int line = 0; line < 8; ++line)
+		{
+			str += "\t";
+			for(int i = 0; i < 6; ++i)
+			{
+				int value = random.below(0x7fffffff);
+				switch( random.below(4) )
+				{
+				case 0: snprintf(buf, sizeof(buf), "0x%08x, ", value); break;
+				case 1: snprintf(buf, sizeof(buf), "%du, ", value % 100000); break;
+				case 2: snprintf(buf, sizeof(buf), "0%o, ", value % 4096); break;
+				default: snprintf(buf, sizeof(buf), "%dUL, ", value % 1000); break;
+				}
+				str += buf;
+			}
+			str += "\n";
+		}
+		snprintf(buf, sizeof(buf), "%d", n);
+		str += "};\nstatic const char* const gen_names_";
+		str += buf;
+		str += "[] = { ";
+		for(int i = 0; i < 8; ++i)
+		{
+			str += random.pick(k_strings);
+			str += ", ";
+		}
+		str += "};\nstatic const char gen_chars_";
+		str += buf;
+		str += "[] = { ";
+		for(int i = 0; i < 12; ++i)
+		{
+			str += random.pick(k_chars);
+			str += ", ";
+		}
+		str += "};\n\n";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void to_crlf(std::string& str)
+{
+	std::string crlf;
+	crlf.reserve(str.size() + str.size() / 16);
+	for(size_t i = 0; i < str.size(); ++i)
+	{
+		if( str[i] == '\n' )
+		{
+			crlf += '\r';
+		}
+		crlf += str[i];
+	}
+	str.swap(crlf);
+}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void make_corpus_file(CorpusKind kind, int size, CorpusFile& file)
+{
+	Random random(0x5eed + unsigned(kind));
+	file.content.clear();
+	file.content.reserve(size + 2048);
+	switch( kind )
+	{
+	case CK_StlHeader:
+		file.name = "stl_header";
+		make_stl_header(random, size, file.content);
+		break;
+	case CK_MacroHeavy:
+		file.name = "macro_heavy";
+		make_macro_heavy(random, size, file.content);
+		break;
+	case CK_CommentHeavy:
+		file.name = "comment_heavy";
+		make_comment_heavy(random, size, file.content);
+		break;
+	case CK_LiteralHeavy:
+		file.name = "literal_heavy";
+		make_literal_heavy(random, size, file.content);
+		break;
+	case CK_CrLf:
+	default:
+		file.name = "crlf";
+		// Same bytes as the STL header but the newlines
+		random = Random(0x5eed + unsigned(CK_StlHeader));
+		make_stl_header(random, size, file.content);
+		to_crlf(file.content);
+		break;
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_CORPUS_H
+#define BENCH_CORPUS_H
+
+#include <string>
+
+// A file of the built-in corpus. The contents are generated with a fixed seed
+// so every machine benchmarks exactly the same bytes.
+struct CorpusFile
+{
+	const char* name;
+	std::string content;
+};
+
+// Kinds of content the corpus covers, see make_corpus_file()
+enum CorpusKind
+{
+	CK_StlHeader,     // Templates and long identifiers, like libstdc++
+	CK_MacroHeavy,    // Directives and multi-line macros
+	CK_CommentHeavy,  // Documentation blocks and line comments
+	CK_LiteralHeavy,  // Tables of numbers, strings and characters
+	CK_CrLf,          // Same as CK_StlHeader with Windows newlines
+	CK_Count
+};
+
+// [in] size  Approximate size in bytes of the generated content
+void make_corpus_file(CorpusKind kind, int size, CorpusFile& file);
+
+#endif
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+
+#include "../../src/cppnom.h"
+#include "corpus.h"
+
+// Default number of times each file is tokenized, the best run is kept
+static const int k_runCount = 10;
+
+// Default size of each generated corpus file
+static const int k_corpusFileSize = 4 * 1024 * 1024;
+
+// Size of the chunks given to Tokenizer::feed()
+static const int k_streamChunkSize = 64 * 1024;
+
+// The heap allocations are counted by replacing malloc() and friends, which
+// glibc allows. Elsewhere the allocation columns are not available.
+#if defined(__GLIBC__)
+#define BENCH_COUNT_ALLOCS
+#include <malloc.h>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void  __libc_free(void* p);
+
+static volatile long g_alloc_count = 0;
+static volatile long g_live_bytes = 0;
+static volatile long g_peak_bytes = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread safe, tokenize_parallel() allocates from several threads
+static void add_live_bytes(long delta)
+{
+	long live = __sync_add_and_fetch(&g_live_bytes, delta);
+	long peak = g_peak_bytes;
+	while( live > peak && !__sync_bool_compare_and_swap(&g_peak_bytes, peak, live) )
+	{
+		peak = g_peak_bytes;
+	}
+}
+
+extern "C" void* malloc(size_t size)
+{
+	void* p = __libc_malloc(size);
+	if( p )
+	{
+		__sync_add_and_fetch(&g_alloc_count, 1);
+		add_live_bytes(long(malloc_usable_size(p)));
+	}
+	return p;
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	void* p = __libc_calloc(count, size);
+	if( p )
+	{
+		__sync_add_and_fetch(&g_alloc_count, 1);
+		add_live_bytes(long(malloc_usable_size(p)));
+	}
+	return p;
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+	long old_size = p ? long(malloc_usable_size(p)) : 0;
+	void* p2 = __libc_realloc(p, size);
+	if( p2 )
+	{
+		__sync_add_and_fetch(&g_alloc_count, 1);
+		add_live_bytes(long(malloc_usable_size(p2)) - old_size);
+	}
+	else if( size == 0 )
+	{
+		add_live_bytes(-old_size);
+	}
+	return p2;
+}
+
+extern "C" void free(void* p)
+{
+	if( p )
+	{
+		add_live_bytes(-long(malloc_usable_size(p)));
+	}
+	__libc_free(p);
+}
+#endif
+
+// How the content is given to cppnom
+enum Mode
+{
+	Mode_Tokenize,  // tokenize(), a new token pool for each run
+	Mode_Arena,     // tokenize() with an Arena, the pool is reused
+	Mode_Compact,   // tokenize_compact()
+	Mode_Stream,    // Tokenizer fed with chunks, a small pool
+	Mode_Parallel,  // tokenize_parallel() with one thread per processor
+	Mode_Load,      // load_cache() of a cache saved before the runs
+	Mode_Open,      // open_cache() of a cache saved before the runs
+	Mode_Count
+};
+
+static const char* const k_modeNames[Mode_Count] = {
+	"tokenize", "arena", "compact", "stream", "parallel", "load", "open"
+};
+
+struct OptionSet
+{
+	const char* name;
+	int         options;
+};
+
+static const OptionSet k_optionSets[] = {
+	{ "none",  0 },
+	{ "kinds", cppnom::OPT_Kinds },
+	{ "skip",  cppnom::OPT_SkipSpace | cppnom::OPT_SkipComments }
+};
+static const int k_optionSetCount = sizeof(k_optionSets) / sizeof(k_optionSets[0]);
+
+// Cache of a content for the cache modes, in words to be aligned
+struct Cache
+{
+	std::vector<unsigned int> words;
+	size_t                    size; // In bytes
+};
+
+// Numbers of one mode and option set on one content
+struct Measure
+{
+	double seconds;   // Best run
+	int    tokens;    // Tokens given
+	long   allocs;    // Heap allocations of one run
+	long   peak;      // Peak heap bytes allocated during one run
+};
+
+///////////////////////////////////////////////////////////////////////////////
+bool read_file(const char* file_path, std::string& str)
+{
+	FILE* pf = fopen(file_path, "rb");
+	if( !pf )
+	{
+		return false;
+	}
+	fseek(pf, 0, SEEK_END);
+	size_t size = ftell(pf);
+	fseek(pf, 0, SEEK_SET);
+	if( size > 0x7fffffffu)
+	{
+		fclose(pf);
+		return false;
+	}
+	str.resize(size);
+	if( size > 0 && fread(&str[0], 1, size, pf) != size )
+	{
+		fclose(pf);
+		return false;
+	}
+	fclose(pf);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool write_file(const std::string& file_path, const std::string& str)
+{
+	FILE* pf = fopen(file_path.c_str(), "wb");
+	if( !pf )
+	{
+		return false;
+	}
+	bool ok = fwrite(str.data(), 1, str.size(), pf) == str.size();
+	return fclose(pf) == 0 && ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double now_seconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tokenizes the content once
+// [in]  cache  With the cache modes, the cache of the content
+// [ret] false if cppnom failed
+bool run_once(Mode mode, int options, const std::string& content,
+              cppnom::Arena& arena, const Cache& cache, int& token_count)
+{
+	const char* p = content.data();
+	int len = (int)content.size();
+	bool ok = false;
+	token_count = 0;
+	switch( mode )
+	{
+	case Mode_Tokenize:
+	case Mode_Arena:
+	case Mode_Parallel:
+	{
+		cppnom::Result result;
+		if( mode == Mode_Tokenize )
+		{
+			ok = cppnom::tokenize(p, len, options, result);
+		}
+		else if( mode == Mode_Arena )
+		{
+			ok = cppnom::tokenize(p, len, options, arena, result);
+		}
+		else
+		{
+			ok = cppnom::tokenize_parallel(p, len, options, result, 0);
+		}
+		token_count = result.count;
+		cppnom::free_result(result);
+		break;
+	}
+	case Mode_Compact:
+	{
+		cppnom::CompactResult result;
+		ok = cppnom::tokenize_compact(p, len, options, result);
+		token_count = result.count;
+		cppnom::free_compact_result(result);
+		break;
+	}
+	case Mode_Load:
+	{
+		cppnom::Result result;
+		ok = cppnom::load_cache(&cache.words[0], cache.size, p, content.size(),
+		                        options, result);
+		token_count = result.count;
+		cppnom::free_result(result);
+		break;
+	}
+	case Mode_Open:
+	{
+		cppnom::CompactResult result;
+		ok = cppnom::open_cache(&cache.words[0], cache.size, p, content.size(),
+		                        options, result);
+		token_count = result.count;
+		cppnom::free_compact_result(result);
+		break;
+	}
+	case Mode_Stream:
+	default:
+	{
+		cppnom::Tokenizer tokenizer(options);
+		cppnom::Token token;
+		ok = true;
+		for(int pos = 0; ok && pos < len; pos += k_streamChunkSize)
+		{
+			int chunk_len = len - pos < k_streamChunkSize ? len - pos
+			                                              : k_streamChunkSize;
+			ok = tokenizer.feed(p + pos, chunk_len);
+			while( tokenizer.next(token) )
+			{
+				token_count++;
+			}
+		}
+		ok = ok && tokenizer.finish();
+		while( tokenizer.next(token) )
+		{
+			token_count++;
+		}
+		break;
+	}
+	}
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tokenizes the content several times.
+// [ret] false if cppnom failed
+bool bench_content(Mode mode, int options, const std::string& content,
+                   int run_count, Measure& measure)
+{
+	cppnom::Arena arena;
+	measure.seconds = -1;
+	measure.tokens = 0;
+	measure.allocs = 0;
+	measure.peak = 0;
+
+	// The cache is saved once, the runs only read it
+	Cache cache;
+	cache.size = 0;
+	if( mode == Mode_Load || mode == Mode_Open )
+	{
+		cppnom::Result result;
+		bool ok = cppnom::tokenize(content.data(), (int)content.size(), options,
+		                           result);
+		cache.size = cppnom::save_cache(result, content.data(), content.size(),
+		                                options, NULL, 0);
+		cache.words.resize(cache.size / sizeof(unsigned int) + 1);
+		ok = ok && cache.size > 0
+		  && cppnom::save_cache(result, content.data(), content.size(), options,
+		                        &cache.words[0], cache.size) == cache.size;
+		cppnom::free_result(result);
+		if( !ok )
+		{
+			return false;
+		}
+	}
+
+	for(int i = 0; i < run_count; ++i)
+	{
+#if defined(BENCH_COUNT_ALLOCS)
+		long allocs_before = g_alloc_count;
+		long live_before = g_live_bytes;
+		g_peak_bytes = live_before;
+#endif
+		double start = now_seconds();
+		bool ok = run_once(mode, options, content, arena, cache,
+		                   measure.tokens);
+		double duration = now_seconds() - start;
+		if( !ok )
+		{
+			return false;
+		}
+#if defined(BENCH_COUNT_ALLOCS)
+		// The last run, with a warm arena
+		measure.allocs = g_alloc_count - allocs_before;
+		measure.peak = g_peak_bytes - live_before;
+#endif
+		if( measure.seconds < 0 || duration < measure.seconds )
+		{
+			measure.seconds = duration;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void print_header()
+{
+	printf("%-24s %-8s %-5s %8s %7s %8s %7s %8s\n", "file", "mode", "opt",
+	       "MB/s", "ns/byte", "Mtok/s", "allocs", "peak MB");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void print_measure(const char* name, Mode mode, const OptionSet& option_set,
+                   double bytes, double tokens, double seconds, long allocs,
+                   long peak)
+{
+	if( seconds <= 0 )
+	{
+		seconds = 1e-9;
+	}
+	printf("%-24s %-8s %-5s %8.1f %7.2f %8.2f", name, k_modeNames[mode],
+	       option_set.name, bytes / seconds / 1e6, seconds * 1e9 / bytes,
+	       tokens / seconds / 1e6);
+#if defined(BENCH_COUNT_ALLOCS)
+	printf(" %7ld %8.1f\n", allocs, peak / 1e6);
+#else
+	(void)allocs;
+	(void)peak;
+	printf(" %7s %8s\n", "n/a", "n/a");
+#endif
+}
+
+#if defined(CPPNOM_STATS)
+///////////////////////////////////////////////////////////////////////////////
+// Prints where the parsing time goes for the content
+void print_stats(const std::string& content)
+{
+	static const char* const type_names[] = {
+		"none", "space", "empty line", "comment line", "comment block",
+		"identifier", "keyword", "operator or punctuator", "macro",
+		"backslash newline", "string literal", "character literal",
+		"integer literal", "floating literal"
+	};
+	static const int type_name_count = sizeof(type_names) / sizeof(type_names[0]);
+
+	cppnom::Result result;
+	cppnom::Stats stats;
+	cppnom::tokenize_with_stats(content.data(), (int)content.size(), 0, result,
+	                            stats);
+	cppnom::free_result(result);
+
+	long long total_ticks = 0;
+	for(int i = 0; i < stats.state_count; ++i)
+	{
+		total_ticks += stats.state_ticks[i];
+	}
+	if( total_ticks <= 0 )
+	{
+		total_ticks = 1;
+	}
+	printf("  %-34s %6s %12s %12s\n", "state", "time", "runs", "bytes");
+	for(int i = 0; i < stats.state_count; ++i)
+	{
+		if( stats.state_calls[i] == 0 )
+		{
+			continue;
+		}
+		printf("  %-34s %5.1f%% %12lld %12lld\n", stats.state_names[i],
+		       100.0 * stats.state_ticks[i] / total_ticks,
+		       stats.state_calls[i], stats.state_bytes[i]);
+	}
+	printf("  %-34s %12s\n", "token type", "count");
+	for(int i = 0; i < type_name_count; ++i)
+	{
+		if( stats.type_counts[i] != 0 )
+		{
+			printf("  %-34s %12d\n", type_names[i], stats.type_counts[i]);
+		}
+	}
+	printf("  ML_First tokens %d, pool initial %d peak %d grown %d times\n\n",
+	       stats.first_count, stats.pool_initial_size, stats.pool_peak_size,
+	       stats.pool_grow_count);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Peak resident memory of the process in MB
+double peak_rss_mb()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+	return usage.ru_maxrss / 1e6; // In bytes
+#else
+	return usage.ru_maxrss / 1e3; // In KB
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void print_usage()
+{
+	printf("usage: bench [--runs N] [--size MB] [--write DIR] [FILE...]\n"
+	       "Without FILE, the built-in corpus is generated and benchmarked.\n"
+	       "  --runs N     tokenize each file N times, the best run is kept\n"
+	       "  --size MB    size of each generated corpus file\n"
+	       "  --write DIR  save the generated corpus files in DIR and exit\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+	int run_count = k_runCount;
+	int corpus_file_size = k_corpusFileSize;
+	const char* write_dir = NULL;
+	std::vector<const char*> paths;
+	for(int i = 1; i < argc; ++i)
+	{
+		bool has_value = i + 1 < argc;
+		if( strcmp(argv[i], "--runs") == 0 && has_value )
+		{
+			run_count = atoi(argv[++i]);
+		}
+		else if( strcmp(argv[i], "--size") == 0 && has_value )
+		{
+			corpus_file_size = atoi(argv[++i]) * 1024 * 1024;
+		}
+		else if( strcmp(argv[i], "--write") == 0 && has_value )
+		{
+			write_dir = argv[++i];
+		}
+		else if( argv[i][0] == '-' )
+		{
+			print_usage();
+			return 1;
+		}
+		else
+		{
+			paths.push_back(argv[i]);
+		}
+	}
+	if( run_count <= 0 || corpus_file_size <= 0 )
+	{
+		print_usage();
+		return 1;
+	}
+
+	std::vector<CorpusFile> files;
+	if( paths.empty() )
+	{
+		files.resize(CK_Count);
+		for(int i = 0; i < CK_Count; ++i)
+		{
+			make_corpus_file(CorpusKind(i), corpus_file_size, files[i]);
+		}
+	}
+	else
+	{
+		files.resize(paths.size());
+		for(size_t i = 0; i < paths.size(); ++i)
+		{
+			files[i].name = paths[i];
+			if( !read_file(paths[i], files[i].content) )
+			{
+				printf("%s: read failed\n", paths[i]);
+				return 1;
+			}
+		}
+	}
+
+	if( write_dir )
+	{
+		for(size_t i = 0; i < files.size(); ++i)
+		{
+			std::string path = std::string(write_dir) + "/" + files[i].name + ".cpp";
+			if( !write_file(path, files[i].content) )
+			{
+				printf("%s: write failed\n", path.c_str());
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	// Totals of each mode and option set over all the files
+	double total_bytes = 0;
+	double total_tokens[Mode_Count][k_optionSetCount] = {};
+	double total_seconds[Mode_Count][k_optionSetCount] = {};
+	long total_allocs[Mode_Count][k_optionSetCount] = {};
+	long max_peak[Mode_Count][k_optionSetCount] = {};
+
+	print_header();
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		const std::string& content = files[i].content;
+		if( content.empty() )
+		{
+			continue;
+		}
+		total_bytes += content.size();
+		for(int m = 0; m < Mode_Count; ++m)
+		{
+			for(int o = 0; o < k_optionSetCount; ++o)
+			{
+				Measure measure;
+				if( !bench_content(Mode(m), k_optionSets[o].options, content,
+				                   run_count, measure) )
+				{
+					printf("%s: %s failed\n", files[i].name, k_modeNames[m]);
+					return 1;
+				}
+				print_measure(files[i].name, Mode(m), k_optionSets[o],
+				              content.size(), measure.tokens, measure.seconds,
+				              measure.allocs, measure.peak);
+				total_tokens[m][o] += measure.tokens;
+				total_seconds[m][o] += measure.seconds;
+				total_allocs[m][o] += measure.allocs;
+				if( measure.peak > max_peak[m][o] )
+				{
+					max_peak[m][o] = measure.peak;
+				}
+			}
+		}
+#if defined(CPPNOM_STATS)
+		print_stats(content);
+#endif
+	}
+	if( files.size() > 1 && total_bytes > 0 )
+	{
+		printf("\n");
+		print_header();
+		for(int m = 0; m < Mode_Count; ++m)
+		{
+			for(int o = 0; o < k_optionSetCount; ++o)
+			{
+				print_measure("total", Mode(m), k_optionSets[o], total_bytes,
+				              total_tokens[m][o], total_seconds[m][o],
+				              total_allocs[m][o], max_peak[m][o]);
+			}
+		}
+	}
+	printf("\npeak RSS %.1f MB, %d runs per measure\n", peak_rss_mb(), run_count);
+	return 0;
+}
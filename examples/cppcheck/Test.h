@@ -18,6 +18,10 @@ here **/
 #define POWER_MACRO(x) if( (!x) ) { \
 	do_something(x); \
 	and_then(x)
+#define COMMENTED_MACRO(x) \
+	bar(x) // note
+#define COMMENTED_MACRO2(x) \
+	bar(x) /* note */
 
 namespace hop {\
 
@@ -38,10 +42,15 @@ public:
 		int L = 0;
 		int Lx = 0x02;
 		int R = L&4;
+		int S = L-\
+!R;
 		int o = 022;
 		int vals = { 1u, 1l, 1ul, 1ll, 1ull };
 		int VALS = { 1U, 1L, 1UL, 1LL, 1ULL };
 		int z = 0Ull;
+		double ds = { 1.5, .5f, 1e10, 2.5E-3L, 0x1.8p3 };
+		int big = 1'000'000;
+		int bits = 0b1010;
 		bool bs = { true, false };
 		void* p = nullptr;
 		
@@ -64,6 +73,9 @@ public:
 		// compiler extensions for backslash
 		if (ch < '\2' || ch > '\4') {}
 		const char* other = "\123";
+		const char* u8s = u8"\u00e9t\u00e9";
+		const char* raw = R"xy(a "quoted" \d)
+		  line)xy";
 		char* pc = new char[42];
 		  
 	}
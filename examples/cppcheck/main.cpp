@@ -43,88 +43,6 @@ void println(const char* format, ...)
 	va_end(args);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool read_file(const std::string& file_path, std::string& str)
-{
-	FILE* pf = fopen(file_path.c_str(), "rb");
-	if( !pf )
-	{
-		return false;
-	}
-	fseek(pf, 0, SEEK_END); // seek to end of file
-	size_t size = ftell(pf); // get current file pointer
-	fseek(pf, 0, SEEK_SET); // seek back to beginning of file
-	if( size > 0x7fffffffu)
-	{
-		fclose(pf);
-		return false;
-	}
-	str.resize(size);
-	char* buf = &str[0];
-	if( fread(buf, 1, size, pf) != size )
-	{
-		fclose(pf);
-		return false;
-	}
-	fclose(pf);
-	return true;
-}
-
-///////////////////////////////////////////////////////////////////////////////
-// Helper class to rebuild the input C++ file from the cppnom tokens.
-class RebuiltFile
-{
-public:
-	RebuiltFile()
-	{
-		m_pf = nullptr;
-		m_dos_style = false;
-	}
-	
-	~RebuiltFile()
-	{
-		if( m_pf )
-		{
-			fclose(m_pf);
-		}
-	}
-	
-	bool create(const char* file_path, bool dos_style)
-	{
-		m_pf = fopen(file_path, "wb");
-		m_dos_style = dos_style;
-		return !!m_pf;
-	}
-	
-	void newline()
-	{
-		
-		if( m_dos_style )
-		{
-			fwrite("\r\n", 1, 2, m_pf);
-		}
-		else
-		{
-			fwrite("\n", 1, 1, m_pf);
-		}
-	}
-	
-	void write(const char* str, int len)
-	{
-		fwrite(str, 1, len, m_pf);
-	}
-	
-	void write_utf8_bom()
-	{
-		static const unsigned char bom[] = { 0xef, 0xbb, 0xbf };
-		fwrite(bom, 1, 3, m_pf);
-	}
-
-private:
-	FILE* m_pf;
-	bool m_dos_style;
-};
-
 struct Color { int r, g, b; };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -152,6 +70,7 @@ void print_tokens(const cppnom::Token* tokens, int token_count, bool debug_info)
 		{ 200,  90,  90 }, // TT_StringLiteral
 		{ 200, 150,  90 }, // TT_CharacterLiteral
 		{ 100, 100,  50 }, // TT_IntegerLiteral
+		{ 100, 100,  50 }, // TT_FloatingLiteral
 	};
 	
 	int line = 1;
@@ -191,43 +110,6 @@ void print_tokens(const cppnom::Token* tokens, int token_count, bool debug_info)
 	println("");
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Rebuilds the C++ file from cppnom tokens.
-std::string rebuild(const cppnom::Result& result, const char* ori_file_path)
-{
-	using namespace cppnom;
-	
-	std::string ret = ori_file_path;
-	ret += ".rebuilt";
-	
-	RebuiltFile rf;
-	if( !rf.create(ret.c_str(), result.dos_nl_count > result.unix_nl_count) )
-	{
-		println("file create failed");
-		return ret;
-	}
-	
-	if( result.has_utf8_bom )
-	{
-		rf.write_utf8_bom();
-	}
-
-	int line = 1;
-	for(int i = 0; i < result.count; ++i)
-	{
-		const Token& tok = result.tokens[i];
-		for(; line <= tok.line; ++line)
-		{
-			if( line != 1 )
-			{
-				rf.newline();
-			}
-		}
-		rf.write(tok.str, tok.len);
-	}
-	return ret;
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 bool get_line(const char* buf, int& len1, int& len2)
 {
@@ -331,6 +213,253 @@ CCRet compare_contents(const std::string& content, const std::string& content2)
 	return ret;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Checks that the tokens of a directive, split by backslash-newlines or
+// comments, all begin with a TT_Macro token
+bool check_macro_heads(const cppnom::Result& result)
+{
+	using namespace cppnom;
+
+	int head = -1;
+	for(int i = 0; i < result.count; ++i)
+	{
+		const Token& tok = result.tokens[i];
+		if( tok.multi != ML_Next )
+		{
+			head = i;
+		}
+		else if( tok.type == TT_Macro && head >= 0
+		      && result.tokens[head].type != TT_Macro )
+		{
+			print_rgb(255,0,0, true, "macro without head at line %d",
+			          tok.line);
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks that an operator cut by a backslash-newline does not leave an empty
+// part before the operator or directive that follows
+bool check_operator_parts(const cppnom::Result& result)
+{
+	using namespace cppnom;
+
+	for(int i = 0; i + 1 < result.count; ++i)
+	{
+		const Token& tok = result.tokens[i];
+		const Token& next = result.tokens[i+1];
+		if( tok.type == TT_OperatorOrPunctuator && tok.len == 0
+		 && tok.multi == ML_Next && next.multi != ML_Next
+		 && (next.type == TT_OperatorOrPunctuator || next.type == TT_Macro) )
+		{
+			print_rgb(255,0,0, true, "empty operator part at line %d",
+			          tok.line);
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks that the directives are the same when found while parsing and when
+// found in the tokens of a cache
+bool check_directives(const char* content, size_t len)
+{
+	using namespace cppnom;
+
+	const int options = OPT_Directives | OPT_SkipComments;
+	Result result;
+	if( !tokenize_large(content, len, options, result) )
+	{
+		cppnom::free_result(result);
+		return true; // Already reported
+	}
+	// malloc() for the alignment of the cache
+	size_t size = save_cache(result, content, len, options, nullptr, 0);
+	void* cache = malloc(size > 0 ? size : 1);
+	save_cache(result, content, len, options, cache, size);
+	Result loaded;
+	bool ok = size > 0 && load_cache(cache, size, content, len, options,
+	                                 loaded)
+	  && loaded.directive_count == result.directive_count;
+	free(cache);
+	for(int i = 0; ok && i < result.directive_count; ++i)
+	{
+		const Directive& a = result.directives[i];
+		const Directive& b = loaded.directives[i];
+		ok = a.kind == b.kind && a.token == b.token && a.name == b.name
+		  && a.name_len == b.name_len && a.arg == b.arg
+		  && a.arg_len == b.arg_len && a.params == b.params
+		  && a.params_len == b.params_len;
+		if( !ok )
+		{
+			print_rgb(255,0,0, true, "different directive at line %d",
+			          result.tokens[a.token].line);
+		}
+	}
+	if( !ok )
+	{
+		print_rgb(255,0,0, true, "bad directives from the cache");
+	}
+	cppnom::free_result(loaded);
+	cppnom::free_result(result);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks that the skip options remove the tokens of the skipped types only,
+// the other ones are the tokens of the full tokenization
+bool check_skip(const char* content, size_t len, const cppnom::Result& full)
+{
+	using namespace cppnom;
+
+	Result result;
+	if( !tokenize_large(content, len, OPT_SkipSpace | OPT_SkipComments,
+	                    result) )
+	{
+		cppnom::free_result(result);
+		return true; // Already reported
+	}
+	bool ok = true;
+	int j = 0;
+	for(int i = 0; ok && i < full.count; ++i)
+	{
+		const Token& tok = full.tokens[i];
+		if( tok.type == TT_CommentLine || tok.type == TT_CommentBlock )
+		{
+			// The skipped comment must be one. A // or /* may be split by
+			// a backslash-newline, and the part of a line that is only a
+			// backslash-newline is empty.
+			if( tok.multi != ML_Next && tok.len > 0 && tok.str[0] != '/' )
+			{
+				print_rgb(255,0,0, true, "not a comment at line %d",
+				          tok.line);
+				ok = false;
+			}
+			continue;
+		}
+		if( tok.type == TT_Space || tok.type == TT_EmptyLine
+		 || tok.type == TT_BackslashNewline )
+		{
+			continue;
+		}
+		const Token* kept = j < result.count ? &result.tokens[j] : nullptr;
+		ok = kept && kept->type == tok.type && kept->str == tok.str
+		  && kept->len == tok.len && kept->line == tok.line
+		  && kept->multi == tok.multi;
+		if( !ok )
+		{
+			print_rgb(255,0,0, true, "token lost by the skip options at "
+			          "line %d", tok.line);
+		}
+		j++;
+	}
+	if( ok && j != result.count )
+	{
+		print_rgb(255,0,0, true, "tokens added by the skip options");
+		ok = false;
+	}
+	cppnom::free_result(result);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks that retokenize() gives the tokens of tokenize() after a space is
+// inserted at the beginning of the content and in the middle. When the first
+// line is not empty and none of its tokens continues after it, the first edit
+// must not tokenize the whole content again.
+bool check_retokenize(const std::string& content)
+{
+	using namespace cppnom;
+
+	Result old;
+	if( !tokenize(content.data(), int(content.size()), 0, old) )
+	{
+		cppnom::free_result(old);
+		return true; // Already reported
+	}
+	bool isFirstLineAlone = old.count > 0 && old.tokens[0].type != TT_EmptyLine
+	  && old.tokens[old.count - 1].line > 3;
+	for(int i = 0; i < old.count && old.tokens[i].line == 1; ++i)
+	{
+		if( old.tokens[i].multi != ML_Single )
+		{
+			isFirstLineAlone = false;
+		}
+	}
+	bool ok = true;
+	int offsets[] = { old.has_utf8_bom ? 3 : 0, int(content.size() / 2) };
+	for(int i = 0; ok && i < 2; ++i)
+	{
+		std::string edited(content);
+		edited.insert(size_t(offsets[i]), 1, ' ');
+		Edit edit = { offsets[i], 0, 1 };
+		Patch patch;
+		retokenize(content.data(), old, edited.data(), int(edited.size()), edit,
+		           patch);
+		Result result;
+		bool patched = apply_patch(content.data(), old, edited.data(), edit,
+		                           patch, result);
+		Result full;
+		bool tokenized = tokenize(edited.data(), int(edited.size()), 0, full);
+		ok = patched == tokenized;
+		if( ok && tokenized )
+		{
+			ok = result.count == full.count
+			  && result.unix_nl_count == full.unix_nl_count
+			  && result.dos_nl_count == full.dos_nl_count
+			  && result.mac_nl_count == full.mac_nl_count;
+			for(int j = 0; ok && j < full.count; ++j)
+			{
+				const Token& a = result.tokens[j];
+				const Token& b = full.tokens[j];
+				ok = a.type == b.type && a.str == b.str && a.len == b.len
+				  && a.line == b.line && a.multi == b.multi;
+				if( !ok )
+				{
+					print_rgb(255,0,0, true, "different token at line %d",
+					          b.line);
+				}
+			}
+		}
+		if( ok && i == 0 && isFirstLineAlone
+		 && patch.removed_count == old.count )
+		{
+			print_rgb(255,0,0, true, "all the tokens replaced");
+			ok = false;
+		}
+		if( !ok )
+		{
+			print_rgb(255,0,0, true, "bad patch after an edit at %d",
+			          offsets[i]);
+		}
+		cppnom::free_result(patch.result);
+		cppnom::free_result(result);
+		cppnom::free_result(full);
+	}
+	cppnom::free_result(old);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Replaces the newlines by the old Mac ones, a single '\r'
+std::string to_mac_newlines(const char* content, size_t len)
+{
+	std::string mac;
+	mac.reserve(len);
+	for(size_t i = 0; i < len; ++i)
+	{
+		if( content[i] == '\r' && i + 1 < len && content[i + 1] == '\n' )
+		{
+			i++;
+		}
+		mac += content[i] == '\n' ? '\r' : content[i];
+	}
+	return mac;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int main(int argc, char** argv)
 {
@@ -343,20 +472,16 @@ int main(int argc, char** argv)
 	}
 	println("=========================== %s", file_path);
 	
-	std::string content;
-	if( !read_file(file_path, content) )
-	{
-		print_rgb(255,0,0, true, "Cannot load file %s", file_path);
-		return 1;
-	}
-	
 	cppnom::Result result;
-	if( !cppnom::tokenize(content.c_str(), content.length(), 0, result) )
+	if( !cppnom::tokenize_file(file_path, 0, result) )
 	{
 		print_rgb(255,0,0, true, "[error]");
 		print_rgb(255,0,0, true, "%s", file_path);
 		print_rgb(255,0,0, true, "line %d", result.error_line);
-		print_rgb(255,0,0, false, "%s", result.error);
+		int len = cppnom::format_error(result, nullptr, 0);
+		std::string message(len + 1, '\0');
+		cppnom::format_error(result, &message[0], len + 1);
+		print_rgb(255,0,0, false, "%s", message.c_str());
 		cppnom::free_result(result);
 		return 1;
 	}
@@ -366,15 +491,59 @@ int main(int argc, char** argv)
 		print_tokens(result.tokens, result.count, false);
 	}
 	
-	std::string new_file_path = rebuild(result, file_path);
-	cppnom::free_result(result);
+	// Checks that no character was lost, directly on the file content
+	cppnom::Divergence divergence;
+	if( !cppnom::verify_roundtrip(result.file_content, result.file_len, result,
+	                              &divergence) )
+	{
+		print_rgb(255,0,0, true, "Bad rebuild of %s", file_path);
+		print_rgb(255,0,0, true, "line %d: %s", divergence.line,
+		          divergence.reason);
+		cppnom::free_result(result);
+		return 1;
+	}
 
-	std::string content2;
-	if( !read_file(new_file_path, content2) )
+	// Checks the directives found with OPT_Directives
+	if( !check_macro_heads(result)
+	 || !check_directives(result.file_content, result.file_len) )
+	{
+		print_rgb(255,0,0, true, "Bad directives in %s", file_path);
+		cppnom::free_result(result);
+		return 1;
+	}
+	if( !check_operator_parts(result) )
 	{
-		print_rgb(255,0,0, true, "Cannot load file rebuilt");
+		print_rgb(255,0,0, true, "Bad operators in %s", file_path);
+		cppnom::free_result(result);
 		return 1;
 	}
+	if( !check_skip(result.file_content, result.file_len, result) )
+	{
+		print_rgb(255,0,0, true, "Bad skip options for %s", file_path);
+		cppnom::free_result(result);
+		return 1;
+	}
+
+	// Checks the tokens after an edit, also with the old Mac newlines
+	if( !check_retokenize(std::string(result.file_content, result.file_len))
+	 || !check_retokenize(to_mac_newlines(result.file_content,
+	                                      result.file_len)) )
+	{
+		print_rgb(255,0,0, true, "Bad retokenize for %s", file_path);
+		cppnom::free_result(result);
+		return 1;
+	}
+
+	// Rebuilds the C++ file in memory from the tokens, the newlines get
+	// a single style
+	std::string content(result.file_content, result.file_len);
+	std::string content2(cppnom::rebuild(result, nullptr, 0), '\0');
+	if( !content2.empty() )
+	{
+		cppnom::rebuild(result, &content2[0], content2.size());
+	}
+	cppnom::free_result(result);
+
 	CCRet ccr = compare_contents(content, content2);
 	if( ccr == CCR_Different )
 	{
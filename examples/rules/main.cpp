@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "../../src/cppnom.h"
+
+// Make the source compatible with old compiler but keep nullptr
+#if __cplusplus < 201103L
+#define nullptr 0
+#endif
+
+#define ARRAY_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+using cppnom::Result;
+using cppnom::Token;
+
+// Parameters and findings of one rule
+struct Check
+{
+	const char* name;  // Printed with the findings
+	const char* word;  // Identifier or comment word the rule looks for
+	int         kind;  // Keyword the rule looks for
+	int         count; // Number of findings
+};
+
+// Prints each finding when true, counts them only otherwise
+bool g_print_findings = false;
+
+///////////////////////////////////////////////////////////////////////////////
+void report(void* param, const Result& result, int index)
+{
+	Check& check = *static_cast<Check*>(param);
+	check.count++;
+	if( g_print_findings )
+	{
+		const Token& tok = result.tokens[index];
+		printf("line %d: %s: %.*s\n", tok.line, check.name,
+		       tok.len > 40 ? 40 : tok.len, tok.str);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool token_equals(const Token& tok, const char* word)
+{
+	return int(strlen(word)) == tok.len && memcmp(tok.str, word, tok.len) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool token_contains(const Token& tok, const char* word)
+{
+	int len = int(strlen(word));
+	for(int i = 0; i + len <= tok.len; ++i)
+	{
+		if( memcmp(tok.str + i, word, len) == 0 )
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The rules, each one gets a Check as parameter
+
+void check_banned_identifier(void* param, const Result& result, int index)
+{
+	if( token_equals(result.tokens[index], static_cast<Check*>(param)->word) )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_banned_keyword(void* param, const Result& result, int index)
+{
+	if( result.kinds[index] == static_cast<Check*>(param)->kind )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_comment_word(void* param, const Result& result, int index)
+{
+	if( token_contains(result.tokens[index], static_cast<Check*>(param)->word) )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_long_identifier(void* param, const Result& result, int index)
+{
+	if( result.tokens[index].len > 31 )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_reserved_underscores(void* param, const Result& result, int index)
+{
+	if( token_contains(result.tokens[index], "__") )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_reserved_uppercase(void* param, const Result& result, int index)
+{
+	const Token& tok = result.tokens[index];
+	if( tok.len >= 2 && tok.str[0] == '_' && tok.str[1] >= 'A'
+	 && tok.str[1] <= 'Z' )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_ambiguous_name(void* param, const Result& result, int index)
+{
+	const Token& tok = result.tokens[index];
+	if( token_equals(tok, "l") || token_equals(tok, "O")
+	 || token_equals(tok, "I") )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_octal_literal(void* param, const Result& result, int index)
+{
+	const Token& tok = result.tokens[index];
+	if( tok.len >= 2 && tok.str[0] == '0' && tok.str[1] >= '0'
+	 && tok.str[1] <= '7' )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_lowercase_l_suffix(void* param, const Result& result, int index)
+{
+	const Token& tok = result.tokens[index];
+	if( tok.len >= 2 && tok.str[tok.len - 1] == 'l' )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_long_string(void* param, const Result& result, int index)
+{
+	if( result.tokens[index].len > 120 )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_multichar_literal(void* param, const Result& result, int index)
+{
+	const Token& tok = result.tokens[index];
+	if( tok.len > 3 && tok.str[0] == '\'' && tok.str[1] != '\\' )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_space_before_tab(void* param, const Result& result, int index)
+{
+	if( token_contains(result.tokens[index], " \t") )
+	{
+		report(param, result, index);
+	}
+}
+
+void check_long_comment(void* param, const Result& result, int index)
+{
+	if( result.tokens[index].len > 100 )
+	{
+		report(param, result, index);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void add_rule(std::vector<cppnom::Rule>& rules, std::vector<Check>& checks,
+              unsigned int types, cppnom::RuleFunc func, const char* name,
+              const char* word = nullptr, int kind = cppnom::KD_None)
+{
+	Check check = { name, word, kind, 0 };
+	checks.push_back(check);
+	cppnom::Rule rule = { types, func, nullptr };
+	rules.push_back(rule);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Registers the 50 rules. The parameters are set once all the checks are
+// added, as the vector may move them.
+void make_rules(std::vector<cppnom::Rule>& rules, std::vector<Check>& checks)
+{
+	using namespace cppnom;
+
+	static const char* const banned_functions[] = {
+		"strcpy", "strcat", "sprintf", "vsprintf", "gets", "scanf", "sscanf",
+		"strtok", "atoi", "atol", "atof", "rand", "srand", "alloca", "setjmp",
+		"longjmp", "tmpnam", "mktemp", "asctime", "ctime", "gmtime",
+		"localtime", "strncpy", "system"
+	};
+	for(size_t i = 0; i < ARRAY_COUNT(banned_functions); ++i)
+	{
+		add_rule(rules, checks, type_bit(TT_Identifier),
+		         check_banned_identifier, "banned function",
+		         banned_functions[i]);
+	}
+
+	static const struct { Kind kind; const char* name; } banned_keywords[] = {
+		{ KW_goto, "goto" }, { KW_register, "register" },
+		{ KW_throw, "throw" }, { KW_try, "try" }, { KW_catch, "catch" },
+		{ KW_typeid, "typeid" }, { KW_dynamic_cast, "dynamic_cast" },
+		{ KW_reinterpret_cast, "reinterpret_cast" },
+		{ KW_const_cast, "const_cast" }, { KW_asm, "asm" }
+	};
+	for(size_t i = 0; i < ARRAY_COUNT(banned_keywords); ++i)
+	{
+		add_rule(rules, checks, type_bit(TT_Keyword), check_banned_keyword,
+		         "banned keyword", banned_keywords[i].name,
+		         banned_keywords[i].kind);
+	}
+
+	static const char* const comment_words[] = {
+		"TODO", "FIXME", "XXX", "HACK", "NOLINT", "@deprecated"
+	};
+	const unsigned int comments = type_bit(TT_CommentLine)
+	  | type_bit(TT_CommentBlock);
+	for(size_t i = 0; i < ARRAY_COUNT(comment_words); ++i)
+	{
+		add_rule(rules, checks, comments, check_comment_word,
+		         "comment marker", comment_words[i]);
+	}
+
+	unsigned int identifiers = type_bit(TT_Identifier);
+	add_rule(rules, checks, identifiers, check_long_identifier,
+	         "identifier longer than 31 characters");
+	add_rule(rules, checks, identifiers, check_reserved_underscores,
+	         "reserved identifier with __");
+	add_rule(rules, checks, identifiers, check_reserved_uppercase,
+	         "reserved identifier with _ and uppercase");
+	add_rule(rules, checks, identifiers, check_ambiguous_name,
+	         "name looking like a digit");
+
+	add_rule(rules, checks, type_bit(TT_IntegerLiteral), check_octal_literal,
+	         "octal literal");
+	add_rule(rules, checks, type_bit(TT_IntegerLiteral)
+	         | type_bit(TT_FloatingLiteral), check_lowercase_l_suffix,
+	         "lowercase l suffix");
+	add_rule(rules, checks, type_bit(TT_StringLiteral), check_long_string,
+	         "string literal longer than 120 characters");
+	add_rule(rules, checks, type_bit(TT_CharacterLiteral),
+	         check_multichar_literal, "multicharacter literal");
+	add_rule(rules, checks, type_bit(TT_Space), check_space_before_tab,
+	         "space before tab");
+	add_rule(rules, checks, type_bit(TT_CommentLine), check_long_comment,
+	         "comment longer than 100 characters");
+
+	for(size_t i = 0; i < rules.size(); ++i)
+	{
+		rules[i].param = &checks[i];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double now_seconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void reset_counts(std::vector<Check>& checks)
+{
+	for(size_t i = 0; i < checks.size(); ++i)
+	{
+		checks[i].count = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The ways to run the rules, see main()
+
+// One scan of all the tokens for each rule
+void run_scans(const Result& result, const std::vector<cppnom::Rule>& rules)
+{
+	for(size_t r = 0; r < rules.size(); ++r)
+	{
+		for(int i = 0; i < result.count; ++i)
+		{
+			if( rules[r].types & cppnom::type_bit(result.tokens[i].type) )
+			{
+				rules[r].func(rules[r].param, result, i);
+			}
+		}
+	}
+}
+
+// One pass, each token is given to its rules
+void run_visit(const Result& result, const std::vector<cppnom::Rule>& rules)
+{
+	cppnom::visit_tokens(result, &rules[0], int(rules.size()));
+}
+
+// For each rule, only the tokens of its types
+void run_index(const Result& result, const std::vector<cppnom::Rule>& rules,
+               const cppnom::TypeIndex& index)
+{
+	for(size_t r = 0; r < rules.size(); ++r)
+	{
+		for(int t = 0; t < cppnom::TypeIndex::k_maxTypes; ++t)
+		{
+			cppnom::TokenType type = cppnom::TokenType(t);
+			if( !(rules[r].types & cppnom::type_bit(type)) )
+			{
+				continue;
+			}
+			const int* positions = cppnom::type_positions(index, type);
+			int count = cppnom::type_count(index, type);
+			for(int i = 0; i < count; ++i)
+			{
+				rules[r].func(rules[r].param, result, positions[i]);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Total number of findings
+int sum_counts(const std::vector<Check>& checks)
+{
+	int sum = 0;
+	for(size_t i = 0; i < checks.size(); ++i)
+	{
+		sum += checks[i].count;
+	}
+	return sum;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+	int runs = 100;
+	std::vector<const char*> paths;
+	for(int i = 1; i < argc; ++i)
+	{
+		if( strcmp(argv[i], "-v") == 0 )
+		{
+			g_print_findings = true;
+		}
+		else if( strcmp(argv[i], "--runs") == 0 && i + 1 < argc )
+		{
+			runs = atoi(argv[++i]);
+		}
+		else
+		{
+			paths.push_back(argv[i]);
+		}
+	}
+	if( paths.empty() )
+	{
+		paths.push_back("../../src/cppnom.cpp");
+	}
+	if( runs < 1 )
+	{
+		runs = 1;
+	}
+
+	std::vector<cppnom::Rule> rules;
+	std::vector<Check> checks;
+	make_rules(rules, checks);
+
+	int ret = 0;
+	for(size_t p = 0; p < paths.size(); ++p)
+	{
+		printf("=========================== %s\n", paths[p]);
+		Result result;
+		if( !cppnom::tokenize_file(paths[p], cppnom::OPT_Kinds, result) )
+		{
+			printf("line %d: %s\n", result.error_line,
+			       result.error ? result.error : "cannot read the file");
+			cppnom::free_result(result);
+			ret = 1;
+			continue;
+		}
+
+		// The findings, in token order
+		reset_counts(checks);
+		run_visit(result, rules);
+		for(size_t i = 0; i < checks.size(); ++i)
+		{
+			if( checks[i].count > 0 )
+			{
+				printf("%6d  %s%s%s\n", checks[i].count, checks[i].name,
+				       checks[i].word ? " " : "",
+				       checks[i].word ? checks[i].word : "");
+			}
+		}
+		int findings = sum_counts(checks);
+
+		// The same findings with the three ways, timed without printing
+		bool print = g_print_findings;
+		g_print_findings = false;
+		double best[3] = { 1e9, 1e9, 1e9 };
+		int sums[3] = { 0, 0, 0 };
+		double index_time = 1e9;
+		for(int run = 0; run < runs; ++run)
+		{
+			for(int way = 0; way < 3; ++way)
+			{
+				reset_counts(checks);
+				double start = now_seconds();
+				if( way == 0 )
+				{
+					run_scans(result, rules);
+				}
+				else if( way == 1 )
+				{
+					run_visit(result, rules);
+				}
+				else
+				{
+					double index_start = now_seconds();
+					cppnom::TypeIndex index;
+					cppnom::build_type_index(result, index);
+					double built = now_seconds();
+					if( built - index_start < index_time )
+					{
+						index_time = built - index_start;
+					}
+					run_index(result, rules, index);
+					cppnom::free_type_index(index);
+				}
+				double duration = now_seconds() - start;
+				if( duration < best[way] )
+				{
+					best[way] = duration;
+				}
+				sums[way] = sum_counts(checks);
+			}
+		}
+		g_print_findings = print;
+
+		printf("%d rules, %d tokens, %d findings\n", int(rules.size()),
+		       result.count, findings);
+		printf("one scan per rule   %8.3f ms\n", best[0] * 1e3);
+		printf("visit_tokens()      %8.3f ms\n", best[1] * 1e3);
+		printf("type index          %8.3f ms, %.3f ms to build it\n",
+		       best[2] * 1e3, index_time * 1e3);
+		if( sums[0] != findings || sums[1] != findings || sums[2] != findings )
+		{
+			printf("different findings: %d %d %d\n", sums[0], sums[1], sums[2]);
+			ret = 1;
+		}
+		cppnom::free_result(result);
+	}
+	return ret;
+}
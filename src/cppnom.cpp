@@ -25,10 +25,73 @@ SOFTWARE.
 #include "cppnom.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <new>
+
+// Vector instructions used to skip the boring parts of the input
+#if defined(__AVX2__)
+#define CPPNOM_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPPNOM_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CPPNOM_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Threads used by tokenize_batch(), define CPPNOM_NO_THREADS to do without
+#if defined(CPPNOM_NO_THREADS)
+#elif defined(_WIN32)
+#define CPPNOM_WIN32_THREADS
+#include <windows.h>
+#else
+#define CPPNOM_POSIX_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Memory mapped files for tokenize_file(), define CPPNOM_NO_MMAP to read
+// the files in allocated memory instead
+#if defined(CPPNOM_NO_MMAP)
+#elif defined(_WIN32)
+#define CPPNOM_WIN32_MMAP
+#include <windows.h>
+#else
+#define CPPNOM_POSIX_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Process id in the names of the temporary files of tokenize_cached()
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Instrumentation for tokenize_with_stats(), define CPPNOM_STATS to enable
+#if !defined(CPPNOM_STATS)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CPPNOM_RDTSC_TICKS
+#elif defined(__x86_64__) || defined(__i386__)
+#define CPPNOM_RDTSC_TICKS
+#include <x86intrin.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 // A better version is possible but it will be enough here
 #define ARRAY_COUNT(x) (int(sizeof(x) / sizeof(x[0])))
@@ -45,21 +108,59 @@ namespace cppnom {
 // interface uses snake_case for variables and functions.
 namespace {
 
+// Position in a content. 64-bit on 64-bit platforms, for contents of 2 GB
+// and more. The token lengths and counts remain int.
+typedef ptrdiff_t Pos;
+
+// Maximum number of tokens of a pool, the count is an int
+const int k_maxPoolSize = 0x7fffffff;
+
+#if defined(CPPNOM_STATS)
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Time counter, see Stats::state_ticks
+long long readTicks()
+{
+#if defined(CPPNOM_RDTSC_TICKS)
+	return (long long)__rdtsc();
+#elif defined(_WIN32)
+	LARGE_INTEGER ticks;
+	QueryPerformanceCounter(&ticks);
+	return ticks.QuadPart;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // A stack like allocator that does not free() for maximum performances.
+// Optionally maintains a kind array parallel to the token array.
 class TokenAllocator
 {
 public:
 	TokenAllocator()
 	{
 		m_pool = nullptr;
+		m_kinds = nullptr;
 		m_size = 0;
 		m_index = 0;
+#if defined(CPPNOM_STATS)
+		m_initialSize = 0;
+		m_peakSize = 0;
+		m_growCount = 0;
+#endif
 	}
 	
 	// [in] initialPoolSize    In number of tokens
-	bool init(int initialPoolSize)
+	// [in] withKinds          true to allocate the kind array
+	bool init(int initialPoolSize, bool withKinds)
 	{
+		if( size_t(initialPoolSize) > size_t(-1) / sizeof(Token) )
+		{
+			return false;
+		}
 		size_t byteSize = sizeof(Token) * initialPoolSize;
 		m_pool = reinterpret_cast<Token*>(malloc(byteSize));
 		if( !m_pool )
@@ -68,6 +169,64 @@ public:
 		}
 		m_size = initialPoolSize;
 		m_index = 0;
+#if defined(CPPNOM_STATS)
+		m_initialSize = m_size;
+		m_peakSize = m_size;
+#endif
+		if( withKinds )
+		{
+			m_kinds = reinterpret_cast<unsigned char*>(malloc(m_size));
+			if( !m_kinds )
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Same as init() but starts with an existing pool if there is one
+	// [in] pool             Pool given back by lend(), may be null
+	// [in] kinds            Kind array given back by lend(), may be null
+	// [in] poolSize         In number of tokens
+	// [in] initialPoolSize  Minimum size of the pool
+	// [in] withKinds        true to use a kind array
+	// [ret] false upon allocation failure. lend() must be called anyway
+	//       to give back the memory to its owner.
+	bool init(Token* pool, unsigned char* kinds, int poolSize,
+	          int initialPoolSize, bool withKinds)
+	{
+		if( !pool )
+		{
+			free(kinds);
+			return init(initialPoolSize, withKinds);
+		}
+		m_pool = pool;
+		m_size = poolSize;
+		m_index = 0;
+#if defined(CPPNOM_STATS)
+		m_initialSize = m_size;
+		m_peakSize = m_size;
+#endif
+		if( !withKinds )
+		{
+			// Not worth keeping in sync with the pool
+			free(kinds);
+			kinds = nullptr;
+		}
+		else if( !kinds )
+		{
+			kinds = reinterpret_cast<unsigned char*>(malloc(poolSize));
+			if( !kinds )
+			{
+				return false;
+			}
+		}
+		m_kinds = kinds;
+		if( poolSize < initialPoolSize )
+		{
+			// Grow once now rather than several times during the parsing
+			resize(initialPoolSize);
+		}
 		return true;
 	}
 	
@@ -77,33 +236,167 @@ public:
 	{
 		if( m_pool )
 		{
-			if( m_index < m_size )
+			if( m_index >= m_size )
 			{
-				return m_pool + m_index++;
+				if( m_size == k_maxPoolSize )
+				{
+					return nullptr;
+				}
+				int newSize = m_size < k_maxPoolSize / 2 ? m_size * 2
+				                                         : k_maxPoolSize;
+				if( !resize(newSize) )
+				{
+					return nullptr;
+				}
 			}
-			size_t byteSize = sizeof(Token) * m_size * 2;
-			Token* pool2 = reinterpret_cast<Token*>(realloc(m_pool, byteSize));
-			if( !pool2 )
+			if( m_kinds )
 			{
-				return nullptr;
+				m_kinds[m_index] = KD_None;
 			}
-			m_pool = pool2;
-			m_size *= 2;
 			return m_pool + m_index++;
 		}
 		return nullptr;
 	}
+
+	bool hasKinds() const
+	{
+		return m_kinds != nullptr;
+	}
+
+	// Sets the kind of an allocated token. Does nothing without kind array.
+	void setKind(const Token* pTok, int kind)
+	{
+		if( m_kinds )
+		{
+			m_kinds[pTok - m_pool] = (unsigned char)kind;
+		}
+	}
 	
 	// Gives ownership of the pool. It is used to give the token array
 	// to the outside world through the public interface of cppnom
-	void detach(const Token*& tokens, int& count)
+	// The unused part of the pool is given back to the heap.
+	void detach(const Token*& tokens, const unsigned char*& kinds, int& count)
+	{
+		if( m_pool && 0 < m_index && m_index < m_size )
+		{
+			resize(m_index);
+		}
+		tokens = m_pool;
+		kinds = m_kinds;
+		count = m_index;
+		m_pool = nullptr;
+		m_kinds = nullptr;
+		m_index = 0;
+	}
+
+	// Gives the token array to the outside world but returns the pool to
+	// its owner so it can be used again by a later parsing
+	void lend(const Token*& tokens, const unsigned char*& kinds, int& count,
+	          Token*& pool, unsigned char*& poolKinds, int& poolSize)
 	{
 		tokens = m_pool;
+		kinds = m_kinds;
 		count = m_index;
+		pool = m_pool;
+		poolKinds = m_kinds;
+		poolSize = m_size;
 		m_pool = nullptr;
+		m_kinds = nullptr;
+		m_size = 0;
 		m_index = 0;
 	}
 	
+	int count() const
+	{
+		return m_index;
+	}
+
+	Token* get(int index) const
+	{
+		return m_pool + index;
+	}
+
+	int getKind(int index) const
+	{
+		if( !m_kinds )
+		{
+			return KD_None;
+		}
+		return m_kinds[index];
+	}
+
+	// Appends copies of the tokens of another allocator
+	// [in] lineOffset  Added to the line of the copies
+	// [ret] false upon allocation failure
+	bool append(const TokenAllocator& other, int lineOffset)
+	{
+		if( other.m_index > k_maxPoolSize - m_index )
+		{
+			return false;
+		}
+		int count = m_index + other.m_index;
+		if( count > m_size && !resize(count) )
+		{
+			return false;
+		}
+		if( other.m_index == 0 )
+		{
+			return true;
+		}
+		Token* pTok = m_pool + m_index;
+		memcpy(pTok, other.m_pool, sizeof(Token) * other.m_index);
+		for(int i = 0; i < other.m_index; ++i)
+		{
+			pTok[i].line += lineOffset;
+		}
+		if( m_kinds )
+		{
+			memcpy(m_kinds + m_index, other.m_kinds, other.m_index);
+		}
+		m_index = count;
+		return true;
+	}
+
+	// Frees the first tokens, the next ones move to the beginning of the pool
+	void discard(int count)
+	{
+		if( count <= 0 )
+		{
+			return;
+		}
+		int rest = m_index - count;
+		memmove(m_pool, m_pool + count, sizeof(Token) * rest);
+		if( m_kinds )
+		{
+			memmove(m_kinds, m_kinds + count, rest);
+		}
+		m_index = rest;
+	}
+
+	// Removes the tokens from 'from' whose type is in the mask
+	// [in] typeMask  Bit (1 << type) set for each type to remove
+	void removeTypes(int from, int typeMask)
+	{
+		int out = from;
+		for(int i = from; i < m_index; ++i)
+		{
+			if( (typeMask >> m_pool[i].type) & 1 )
+			{
+				continue;
+			}
+			if( out != i )
+			{
+				m_pool[out] = m_pool[i];
+				if( m_kinds )
+				{
+					m_kinds[out] = m_kinds[i];
+				}
+			}
+			out++;
+		}
+		m_index = out;
+	}
+
 	// Tokens are allocated in the order of the parsing. Sometimes we
 	// want to go back to check what was the kind of token previously
 	// allocated.
@@ -121,1535 +414,6104 @@ public:
 		return pTok;
 	}
 
+#if defined(CPPNOM_STATS)
+	void getStats(Stats& stats) const
+	{
+		stats.pool_initial_size = m_initialSize;
+		stats.pool_peak_size = m_peakSize;
+		stats.pool_grow_count = m_growCount;
+	}
+#endif
+
 private:
-	Token* m_pool;
-	int    m_size;
-	int    m_index;
+	// Changes the pool size, and the kind array size along
+	// [ret] false if the memory could not be reallocated, the size is
+	//       then unchanged
+	bool resize(int newSize)
+	{
+		if( size_t(newSize) > size_t(-1) / sizeof(Token) )
+		{
+			return false;
+		}
+		size_t byteSize = sizeof(Token) * newSize;
+		Token* pool2 = reinterpret_cast<Token*>(realloc(m_pool, byteSize));
+		if( !pool2 )
+		{
+			return false;
+		}
+		m_pool = pool2;
+		if( m_kinds )
+		{
+			unsigned char* kinds2;
+			kinds2 = reinterpret_cast<unsigned char*>(realloc(m_kinds, newSize));
+			if( !kinds2 )
+			{
+				return false;
+			}
+			m_kinds = kinds2;
+		}
+#if defined(CPPNOM_STATS)
+		if( newSize > m_size )
+		{
+			m_growCount++;
+		}
+		if( newSize > m_peakSize )
+		{
+			m_peakSize = newSize;
+		}
+#endif
+		m_size = newSize;
+		return true;
+	}
+
+	Token*         m_pool;
+	unsigned char* m_kinds;
+	int            m_size;
+	int            m_index;
+#if defined(CPPNOM_STATS)
+	int            m_initialSize;
+	int            m_peakSize;
+	int            m_growCount;
+#endif
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-// To give a nice error description.
-class Error
+// Grows a malloc() array
+// [ret] false upon allocation failure, the array is then unchanged
+template<typename T>
+bool resizeArray(T*& p, int newSize)
+{
+	T* p2 = reinterpret_cast<T*>(realloc(p, sizeof(T) * newSize));
+	if( !p2 )
+	{
+		return false;
+	}
+	p = p2;
+	return true;
+}
+
+// Fills the arrays of a CompactResult from the tokens of the parsing
+class CompactBuilder
 {
 public:
-	Error()
+	CompactBuilder()
 	{
-		int size = 512; // Default size
-		m_buf = reinterpret_cast<char*>(malloc(size));
-		if( !m_buf )
-		{
-			m_len = 0;
-			m_maxLen = 0;
-			return;
-		}
-		m_len = 0;
-		m_maxLen = size-1;
-		m_buf[m_len] = 0;
+		m_types = nullptr;
+		m_multis = nullptr;
+		m_offsets = nullptr;
+		m_lens = nullptr;
+		m_kinds = nullptr;
+		m_lineFirsts = nullptr;
+		m_count = 0;
+		m_size = 0;
+		m_lineCount = 0;
+		m_lineSize = 0;
+		m_withKinds = false;
 	}
-	
-	Error& operator+=(const char* arg)
+
+	~CompactBuilder()
 	{
-		append(arg, strlen(arg));
-		return *this;
+		free(m_types);
+		free(m_multis);
+		free(m_offsets);
+		free(m_lens);
+		free(m_kinds);
+		free(m_lineFirsts);
 	}
-	
-	void append(const char* arg, int argLen)
+
+	// [in] tokenCount  Initial size, in number of tokens
+	// [in] lineCount   Initial size, in number of lines
+	bool init(int tokenCount, int lineCount, bool withKinds)
+	{
+		m_withKinds = withKinds;
+		if( !resize(tokenCount) || !resizeArray(m_lineFirsts, lineCount) )
+		{
+			return false;
+		}
+		m_lineSize = lineCount;
+		return true;
+	}
+
+	// Converts the first tokens of the allocator
+	// [in] content  Start of the content, including the UTF-8 BOM
+	// [ret] false upon allocation failure
+	bool add(const TokenAllocator& tokens, int count, const char* content)
 	{
-		if( m_len + argLen > m_maxLen )
+		if( m_count + count > m_size )
 		{
-			int newSize = (m_maxLen+1) * 2;
-			char* buf2 = reinterpret_cast<char*>(realloc(m_buf, newSize));
-			if( !buf2 )
+			int newSize = m_size * 2;
+			if( newSize < m_count + count )
 			{
-				// The user will get a truncated string
-				return;
+				newSize = m_count + count;
+			}
+			if( !resize(newSize) )
+			{
+				return false;
+			}
+		}
+		for(int i = 0; i < count; ++i)
+		{
+			const Token* pTok = tokens.get(i);
+			while( m_lineCount < pTok->line )
+			{
+				if( m_lineCount == m_lineSize )
+				{
+					int newLineSize = m_lineSize * 2 + 16;
+					if( !resizeArray(m_lineFirsts, newLineSize) )
+					{
+						return false;
+					}
+					m_lineSize = newLineSize;
+				}
+				m_lineFirsts[m_lineCount++] = m_count;
 			}
+			m_types[m_count] = (unsigned char)pTok->type;
+			m_multis[m_count] = (unsigned char)pTok->multi;
+			m_offsets[m_count] = (unsigned int)(pTok->str - content);
+			m_lens[m_count] = (unsigned int)pTok->len;
+			if( m_kinds )
+			{
+				m_kinds[m_count] = (unsigned char)tokens.getKind(i);
+			}
+			m_count++;
 		}
-		memcpy(m_buf+m_len, arg, argLen);
-		m_len += argLen;
-		m_buf[m_len] = 0;
+		return true;
 	}
-	
-	void detach(const char*& err)
+
+	// Gives ownership of the arrays, the unused parts go back to the heap
+	void detach(CompactResult& result)
 	{
-		err = m_buf;
-		m_buf = nullptr;
-		m_len = 0;
-		m_maxLen = 0;
+		if( 0 < m_count && m_count < m_size )
+		{
+			resize(m_count);
+		}
+		if( 0 < m_lineCount && m_lineCount < m_lineSize )
+		{
+			resizeArray(m_lineFirsts, m_lineCount);
+		}
+		result.types = m_types;
+		result.multis = m_multis;
+		result.offsets = m_offsets;
+		result.lens = m_lens;
+		result.kinds = m_kinds;
+		result.count = m_count;
+		result.line_firsts = m_lineFirsts;
+		result.line_count = m_lineCount;
+		m_types = nullptr;
+		m_multis = nullptr;
+		m_offsets = nullptr;
+		m_lens = nullptr;
+		m_kinds = nullptr;
+		m_lineFirsts = nullptr;
+		m_count = 0;
+		m_size = 0;
+		m_lineCount = 0;
+		m_lineSize = 0;
 	}
 
 private:
-	char* m_buf;
-	int   m_len;
-	int   m_maxLen;
-};
+	CompactBuilder(const CompactBuilder&);            // Not copyable
+	CompactBuilder& operator=(const CompactBuilder&); // Not copyable
 
-///////////////////////////////////////////////////////////////////////////////
-bool isKeyword(const char* p, int len)
-{
-	static const char* const kws[] = {
-		"alignof"     , "asm"             , "auto"      , "bool"         ,
-		"break"       , "case"            , "catch"     , "char"         ,
-		"char16_t"    , "char32_t"        , "class"     , "const"        ,
-		"constexpr"   , "const_cast"      , "continue"  , "decltype"     ,
-		"default"     , "delete"          , "do"        , "double"       ,
-		"dynamic_cast", "else"            , "enum"      , "explicit"     ,
-		"export"      , "extern"          , "false"     , "float"        ,
-		"for"         , "friend"          , "goto"      , "if"           ,
-		"inline"      , "int"             , "long"      , "mutable"      ,
-		"namespace"   , "new"             , "noexcept"  , "nullptr"      ,
-		"operator"    , "private"         , "protected" , "public"       ,
-		"register"    , "reinterpret_cast", "return"    , "short"        ,
-		"signed"      , "sizeof"          , "static"    , "static_assert",
-		"static_cast" , "struct"          , "switch"    , "template"     ,
-		"this"        , "thread_local"    , "throw"     , "true"         ,
-		"try"         , "typedef"         , "typeid"    , "typename"     ,
-	    "union"       , "unsigned"        , "using"     , "virtual"      ,
-		"void"        , "volatile"        , "wchar_t"   , "while"
-	};
-	for(int i = 0; i < ARRAY_COUNT(kws); ++i )
-	{
-		int len2 = strlen(kws[i]);
-		if( len2 == len )
-		{
-			if( memcmp(kws[i], p, len2) == 0 )
-			{
-				return true;
-			}
+	bool resize(int newSize)
+	{
+		if( !resizeArray(m_types, newSize) || !resizeArray(m_multis, newSize)
+		  || !resizeArray(m_offsets, newSize) || !resizeArray(m_lens, newSize)
+		  || (m_withKinds && !resizeArray(m_kinds, newSize)) )
+		{
+			return false;
 		}
+		m_size = newSize;
+		return true;
 	}
-	return false;
-}
+
+	unsigned char* m_types;
+	unsigned char* m_multis;
+	unsigned int*  m_offsets;
+	unsigned int*  m_lens;
+	unsigned char* m_kinds;
+	int*           m_lineFirsts;
+	int            m_count;
+	int            m_size;
+	int            m_lineCount;
+	int            m_lineSize;
+	bool           m_withKinds;
+};
 
 ///////////////////////////////////////////////////////////////////////////////
-void trimTokenRight(const char* tokStr, int& tokLen)
+// [ret] 1, 2 or 3 for (, [ and {, the negated value for the closing
+//       brackets, 0 if the token is not a bracket
+inline int getBracket(const Token& tok)
 {
-	while(tokLen > 0 )
+	if( tok.type != TT_OperatorOrPunctuator || tok.multi != ML_Single )
 	{
-		if( tokStr[tokLen-1] == '\n' || tokStr[tokLen-1] == '\r' )
+		return 0;
+	}
+	if( tok.len == 1 )
+	{
+		switch( tok.str[0] )
 		{
-			tokLen--;
+		case '(': return 1;
+		case ')': return -1;
+		case '[': return 2;
+		case ']': return -2;
+		case '{': return 3;
+		case '}': return -3;
+		default: return 0;
 		}
-		else
+	}
+	if( tok.len == 2 )
+	{
+		char c0 = tok.str[0];
+		char c1 = tok.str[1];
+		if( c0 == '<' )
 		{
-			break;
+			return c1 == ':' ? 2 : c1 == '%' ? 3 : 0;
+		}
+		if( c1 == '>' )
+		{
+			return c0 == ':' ? -2 : c0 == '%' ? -3 : 0;
 		}
 	}
+	return 0;
 }
 
-void trimTokenLeft(const char*& tokStr, int& tokLen)
+// Pairs the brackets of the tokens as they become final, see
+// OPT_MatchBrackets. The brackets not paired yet form a stack linked
+// through the match array itself, so nothing else is allocated.
+class BracketMatcher
 {
-	while(tokLen > 0 )
+public:
+	BracketMatcher()
 	{
-		if( tokStr[0] == '\n' || tokStr[0] == '\r' )
+		m_matches = nullptr;
+		m_size = 0;
+		m_openTop = -1;
+		m_failed = false;
+	}
+
+	~BracketMatcher()
+	{
+		free(m_matches);
+	}
+
+	// Pairs the tokens [from, to), the ones before are already added
+	// [in] tokens  All the tokens, they may have moved since the last call
+	void add(const Token* tokens, int from, int to)
+	{
+		if( to > m_size )
 		{
-			tokStr++;
-			tokLen--;
+			int newSize = m_size * 2 < to ? to : m_size * 2;
+			if( m_failed || !resizeArray(m_matches, newSize) )
+			{
+				m_failed = true;
+				return;
+			}
+			m_size = newSize;
 		}
-		else
+		for(int i = from; i < to; ++i)
 		{
-			break;
+			m_matches[i] = -1;
+			int bracket = getBracket(tokens[i]);
+			if( bracket > 0 )
+			{
+				// Pushed, linked to the previous opening bracket
+				m_matches[i] = m_openTop;
+				m_openTop = i;
+			}
+			else if( bracket < 0 && m_openTop >= 0
+			  && getBracket(tokens[m_openTop]) == -bracket )
+			{
+				int open = m_openTop;
+				m_openTop = m_matches[open];
+				m_matches[open] = i;
+				m_matches[i] = open;
+			}
 		}
 	}
-}
 
-bool isPrintableChar(char c)
+	// Ends the pairing, the brackets still open get no match
+	// [ret] false upon allocation failure
+	bool finish()
+	{
+		while( m_openTop >= 0 )
+		{
+			int next = m_matches[m_openTop];
+			m_matches[m_openTop] = -1;
+			m_openTop = next;
+		}
+		if( !m_matches && !m_failed )
+		{
+			// Also for no token, so the array tells the option was given
+			m_failed = !resizeArray(m_matches, 1);
+		}
+		return !m_failed;
+	}
+
+	// Gives ownership of the match array
+	const int* detach()
+	{
+		int* matches = m_matches;
+		m_matches = nullptr;
+		m_size = 0;
+		return matches;
+	}
+
+private:
+	BracketMatcher(const BracketMatcher&);            // Not copyable
+	BracketMatcher& operator=(const BracketMatcher&); // Not copyable
+
+	int* m_matches;
+	int  m_size;
+	int  m_openTop; // Last opening bracket not paired yet, -1 if none
+	bool m_failed;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void clearErrorRecord(ErrorRecord& record)
 {
-	return (32 <= c && c <= 126);
+	record.state = nullptr;
+	record.c = 0;
+	record.line = nullptr;
+	record.line_len = 0;
+	record.column = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-enum State
+// Writes a message in a fixed size buffer like snprintf(): the text that does
+// not fit is dropped but still counted.
+class MessageWriter
 {
-	State_Idle,
-	State_Space,
-	State_Identifier,
-	State_IdentifierOrLiteral,
-	State_Macro,
-	State_CommentOrOperator,
-	State_CommentLine,
-	State_CommentBlock,
-	State_CommentBlockEnd,
-	State_OperatorOrPunctuator,
-	State_StringLiteral,
-	State_StringLiteralEsc,
-	State_CharacterLiteral,
-	State_CharacterLiteralEsc,
-	State_OctOrHexLiteral,
-	State_DecLiteral,
-	State_OctLiteral,
-	State_HexLiteralX,
-	State_HexLiteral,
-	State_IntegerSuffix,
-	State_IntegerSuffix2,
-	State_NewLine,
-	State_Error = 100
+public:
+	MessageWriter(char* buf, int size)
+	{
+		m_buf = buf;
+		m_size = size;
+		m_len = 0;
+	}
+
+	void add(const char* str)
+	{
+		add(str, int(strlen(str)));
+	}
+
+	void add(const char* str, int len)
+	{
+		for(int i = 0; i < len; ++i)
+		{
+			add(str[i]);
+		}
+	}
+
+	void add(char c)
+	{
+		if( m_len < m_size - 1 )
+		{
+			m_buf[m_len] = c;
+		}
+		m_len++;
+	}
+
+	// Adds the 0 terminating character
+	// [ret] Length of the whole message
+	int finish()
+	{
+		if( m_size > 0 )
+		{
+			m_buf[m_len < m_size ? m_len : m_size - 1] = 0;
+		}
+		return m_len;
+	}
+
+private:
+	char* m_buf;
+	int   m_size;
+	int   m_len;
 };
 
-const char* StringFromState(State state)
+///////////////////////////////////////////////////////////////////////////////
+struct Keyword
 {
-	switch(state)
+	const char* str;
+	int         len;
+};
+
+#define KW(x) { #x, int(sizeof(#x)) - 1 }
+static const Keyword k_kws[] = {
+	KW(alignof),           KW(asm),               KW(auto),              KW(bool),
+	KW(break),             KW(case),              KW(catch),             KW(char),
+	KW(char16_t),          KW(char32_t),          KW(class),             KW(const),
+	KW(constexpr),         KW(const_cast),        KW(continue),          KW(decltype),
+	KW(default),           KW(delete),            KW(do),                KW(double),
+	KW(dynamic_cast),      KW(else),              KW(enum),              KW(explicit),
+	KW(export),            KW(extern),            KW(false),             KW(float),
+	KW(for),               KW(friend),            KW(goto),              KW(if),
+	KW(inline),            KW(int),               KW(long),              KW(mutable),
+	KW(namespace),         KW(new),               KW(noexcept),          KW(nullptr),
+	KW(operator),          KW(private),           KW(protected),         KW(public),
+	KW(register),          KW(reinterpret_cast),  KW(return),            KW(short),
+	KW(signed),            KW(sizeof),            KW(static),            KW(static_assert),
+	KW(static_cast),       KW(struct),            KW(switch),            KW(template),
+	KW(this),              KW(thread_local),      KW(throw),             KW(true),
+	KW(try),               KW(typedef),           KW(typeid),            KW(typename),
+	KW(union),             KW(unsigned),          KW(using),             KW(virtual),
+	KW(void),              KW(volatile),          KW(wchar_t),           KW(while)
+};
+#undef KW
+
+const int k_kwMinLen = 2;
+const int k_kwMaxLen = 16;
+
+// Perfect hash of the keywords: each one has its own slot in k_kwSlots.
+// The hash combines the length with the first, middle and last characters.
+// The multiplier was found by trying random odd values until all keywords
+// land in different slots, it must be searched again if k_kws changes.
+inline int keywordSlot(const char* p, int len)
+{
+	unsigned int x = (unsigned char)p[0]
+	    | ((unsigned char)p[len/2] << 8)
+	    | ((unsigned char)p[len-1] << 16)
+	    | ((unsigned int)len << 24);
+	return int((x * 0x967ce639u) >> 24);
+}
+
+// Index of the keyword in k_kws, -1 for an empty slot
+static const signed char k_kwSlots[256] = {
+	-1, -1, -1, -1, -1, -1,  5, -1, -1, 14, -1, 64, 42, -1, 10, 54,
+	38, -1, -1, 20, -1, -1, -1, 13, -1, -1, -1, -1, -1, -1, 32, 71,
+	-1, -1, -1, -1, -1, -1, -1, -1, 70, -1, 51, -1, -1,  9, 24, -1,
+	47, -1, -1, 21,  8, 18, -1, -1, -1,  4, 17, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 60, 11, 28, -1, -1,
+	-1, 12, -1, -1,  2, -1, 57, 53, -1, -1, -1, 46, -1, -1, 22, -1,
+	33, -1, -1, -1, -1, -1, -1, -1, -1, -1, 68, -1, 44, -1,  6, 39,
+	-1, -1, -1, -1, -1, -1, -1, -1, 63, -1, -1, -1, -1, -1, 55, -1,
+	29, -1, -1, 45, -1, -1, -1, -1, -1, 48, -1, -1, 27, -1, -1,  0,
+	50, -1, 69, -1, -1, -1, -1, -1, 26, -1, 36, -1, -1, -1, -1, 37,
+	-1, -1, -1, -1, 67, -1, -1, -1, -1, 31, -1, 52, 34, -1, -1, -1,
+	-1, -1, -1, 23, -1, -1, -1, -1, -1, -1, 56, 62, -1, 65, -1, 66,
+	-1, 61, -1, 19, -1, -1, -1,  3, -1, 35, -1, -1, 41, -1, -1, -1,
+	-1, -1,  1, -1, -1, -1, -1, -1, -1, -1, -1, 30, -1, -1, -1, -1,
+	40, -1, -1, -1, -1, 43, -1, -1, 25, -1, -1, -1, -1, -1,  7, -1,
+	58, 49, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 16, 15, 59, -1
+};
+
+// [ret] Index of the keyword in k_kws, -1 if not a keyword
+int findKeyword(const char* p, int len)
+{
+	if( len < k_kwMinLen || len > k_kwMaxLen )
 	{
-	case State_Idle:                return "idle";
-	case State_Space:               return "space";
-	case State_Identifier:          return "identifier";
-	case State_IdentifierOrLiteral: return "identifier or literal";
-	case State_Macro:               return "macro";
-	case State_CommentOrOperator:   return "comment or /";
-	case State_CommentLine:         return "comment line";
-	case State_CommentBlock:        return "comment block";
-	case State_CommentBlockEnd:     return "comment block end";
-	case State_OperatorOrPunctuator:return "operator or punctuator";
-	case State_StringLiteral:       return "string literal";
-	case State_StringLiteralEsc:    return "string literal escape sequence";
-	case State_CharacterLiteral:    return "character literal";
-	case State_CharacterLiteralEsc: return "character literal escape sequence";
-	case State_OctOrHexLiteral:     return "octal or hexadecimal literal";
-	case State_DecLiteral:          return "decimal literal";
-	case State_OctLiteral:          return "octal literal";
-	case State_HexLiteralX:         return "hexadecimal literal x";
-	case State_HexLiteral:          return "hexadecimal literal";
-	case State_IntegerSuffix:       return "integer suffix";
-	case State_IntegerSuffix2:      return "integer suffix 2";
-	case State_NewLine:             return "new line";
-	case State_Error:               return "error";
-	default: break;
+		return -1;
 	}
-	return "";
+	int i = k_kwSlots[keywordSlot(p, len)];
+	if( i < 0 || k_kws[i].len != len || memcmp(k_kws[i].str, p, len) != 0 )
+	{
+		return -1;
+	}
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void trimTokenRight(const char* tokStr, Pos& tokLen)
+{
+	while(tokLen > 0 )
+	{
+		if( tokStr[tokLen-1] == '\n' || tokStr[tokLen-1] == '\r' )
+		{
+			tokLen--;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+void trimTokenLeft(const char*& tokStr, Pos& tokLen)
+{
+	while(tokLen > 0 )
+	{
+		if( tokStr[0] == '\n' || tokStr[0] == '\r' )
+		{
+			tokStr++;
+			tokLen--;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+bool isPrintableChar(char c)
+{
+	return (32 <= c && c <= 126);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Character classes, a character can be in several classes
+enum CharClass
+{
+	CC_Digit              = 0x01, // 0-9
+	CC_OctDigit           = 0x02, // 0-7
+	CC_HexDigit           = 0x04, // 0-9 a-f A-F
+	CC_IdentifierNonDigit = 0x08, // a-z A-Z _
+	CC_Space              = 0x10, // Space, tab, form feed
+	CC_SimpleEscape       = 0x20, // Follows \ in a simple escape sequence
+	CC_Identifier         = CC_Digit | CC_IdentifierNonDigit
+};
+
+// Classes of each character. Non ASCII characters are in no class.
+static const unsigned char k_charClass[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, // 00 .. 0f
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 10 .. 1f
+	0x10, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // sp .. /
+	0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x05, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, // 0 .. ?
+	0x00, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, // @ .. O
+	0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x00, 0x20, 0x00, 0x00, 0x08, // P .. _
+	0x00, 0x2c, 0x2c, 0x0c, 0x0c, 0x2c, 0x2c, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x28, 0x08, // ` .. o
+	0x08, 0x08, 0x28, 0x08, 0x28, 0x08, 0x28, 0x08, 0x08, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00  // p .. 7f
 };
 
+inline bool isInClass(char c, int classes)
+{
+	return (k_charClass[(unsigned char)c] & classes) != 0;
+}
+
+inline bool isDigit(char c)
+{
+	return isInClass(c, CC_Digit);
+}
+
+inline bool isOctDigit(char c)
+{
+	return isInClass(c, CC_OctDigit);
+}
+
+inline bool isHexDigit(char c)
+{
+	return isInClass(c, CC_HexDigit);
+}
+
+inline bool isIdentifierCharNonDigit(char c)
+{
+	return isInClass(c, CC_IdentifierNonDigit);
+}
+
+inline bool isIdentifierChar(char c)
+{
+	return isInClass(c, CC_Identifier);
+}
+
+inline bool isSpace(char c)
+{
+	return isInClass(c, CC_Space);
+}
+
+inline bool isSimpleEscapeSequence(char c)
+{
+	return isInClass(c, CC_SimpleEscape); // \e is GCC specific
+}
+
+// \x, \u, \U, \N{...} and \o{...}, the characters after are not checked
+inline bool isLongEscapeSequence(char c)
+{
+	return c == 'x' || c == 'u' || c == 'U' || c == 'N' || c == 'o';
+}
+
+inline bool isBinDigit(char c)
+{
+	return c == '0' || c == '1';
+}
+
+// Characters of the delimiter of a raw string literal
+inline bool isRawStringDelimiterChar(char c)
+{
+	return isPrintableChar(c) && c != ' ' && c != '(' && c != ')' && c != '\\';
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-struct Context
+// Skip-ahead kernels. Comments, string literals and spaces are long runs of
+// characters that the state machine consumes one by one without doing anything.
+// These functions find the end of such a run at once, 16 or 32 bytes at a time
+// when vector instructions are available.
+
+// [ret] Index of the lowest bit set, mask must not be 0
+inline int lowestBit(unsigned int mask)
 {
-	char c;
-	char prevC;
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return int(index);
+#elif defined(__GNUC__)
+	return __builtin_ctz(mask);
+#else
+	int index = 0;
+	while( !(mask & 1) )
+	{
+		mask >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
 
-	TokenAllocator m_tokens;
-	Error          m_error;
+#if defined(CPPNOM_NEON)
+// NEON has no movemask: narrow each byte of the comparison result to 4 bits
+// [ret] 4 bits per byte, 0 if no byte matched
+inline unsigned long long neonMask(uint8x16_t eq)
+{
+	uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
 
-	// Statistics
-	int m_unixNlCount;
-	int m_dosNlCount;
-	int m_macNlCount;
-	
-	bool m_hasUtf8Bom;
+inline int neonFirstByte(unsigned long long mask)
+{
+	int index = 0;
+	while( !(mask & 0xf) )
+	{
+		mask >>= 4;
+		index++;
+	}
+	return index;
+}
+#endif
+
+// [ret] Position of the first character in [pos, end) that is one of a, b,
+//       c or d, 'end' if none
+Pos findAnyOf4(const char* p, Pos pos, Pos end, char a, char b, char c, char d)
+{
+#if defined(CPPNOM_AVX2)
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	const __m256i vc = _mm256_set1_epi8(c);
+	const __m256i vd = _mm256_set1_epi8(d);
+	for(; pos + 32 <= end; pos += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + pos));
+		__m256i eq = _mm256_or_si256(
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd)));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(eq);
+		if( mask )
+		{
+			return pos + lowestBit(mask);
+		}
+	}
+#elif defined(CPPNOM_SSE2)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	const __m128i vc = _mm_set1_epi8(c);
+	const __m128i vd = _mm_set1_epi8(d);
+	for(; pos + 16 <= end; pos += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos));
+		__m128i eq = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(eq);
+		if( mask )
+		{
+			return pos + lowestBit(mask);
+		}
+	}
+#elif defined(CPPNOM_NEON)
+	const uint8x16_t va = vdupq_n_u8((unsigned char)a);
+	const uint8x16_t vb = vdupq_n_u8((unsigned char)b);
+	const uint8x16_t vc = vdupq_n_u8((unsigned char)c);
+	const uint8x16_t vd = vdupq_n_u8((unsigned char)d);
+	for(; pos + 16 <= end; pos += 16)
+	{
+		uint8x16_t v = vld1q_u8(reinterpret_cast<const unsigned char*>(p + pos));
+		uint8x16_t eq = vorrq_u8(
+		    vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)),
+		    vorrq_u8(vceqq_u8(v, vc), vceqq_u8(v, vd)));
+		unsigned long long mask = neonMask(eq);
+		if( mask )
+		{
+			return pos + neonFirstByte(mask);
+		}
+	}
+#endif
+	for(; pos < end; ++pos)
+	{
+		char x = p[pos];
+		if( x == a || x == b || x == c || x == d )
+		{
+			return pos;
+		}
+	}
+	return end;
+}
+
+// [ret] Position of the first character in [pos, end) that is not a
+//       space, a tab or a form feed, 'end' if none
+Pos findNonSpace(const char* p, Pos pos, Pos end)
+{
+	// Most spaces are only one or two characters long
+	for(int i = 0; i < 2; ++i, ++pos)
+	{
+		if( pos >= end )
+		{
+			return end;
+		}
+		char x = p[pos];
+		if( !isSpace(x) )
+		{
+			return pos;
+		}
+	}
+#if defined(CPPNOM_AVX2)
+	const __m256i vs = _mm256_set1_epi8(' ');
+	const __m256i vt = _mm256_set1_epi8('\t');
+	const __m256i vf = _mm256_set1_epi8('\f');
+	for(; pos + 32 <= end; pos += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + pos));
+		__m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, vs),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, vt), _mm256_cmpeq_epi8(v, vf)));
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(eq);
+		if( mask )
+		{
+			return pos + lowestBit(mask);
+		}
+	}
+#elif defined(CPPNOM_SSE2)
+	const __m128i vs = _mm_set1_epi8(' ');
+	const __m128i vt = _mm_set1_epi8('\t');
+	const __m128i vf = _mm_set1_epi8('\f');
+	for(; pos + 16 <= end; pos += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + pos));
+		__m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, vs),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, vt), _mm_cmpeq_epi8(v, vf)));
+		unsigned int mask = ~(unsigned int)_mm_movemask_epi8(eq) & 0xffff;
+		if( mask )
+		{
+			return pos + lowestBit(mask);
+		}
+	}
+#elif defined(CPPNOM_NEON)
+	const uint8x16_t vs = vdupq_n_u8(' ');
+	const uint8x16_t vt = vdupq_n_u8('\t');
+	const uint8x16_t vf = vdupq_n_u8('\f');
+	for(; pos + 16 <= end; pos += 16)
+	{
+		uint8x16_t v = vld1q_u8(reinterpret_cast<const unsigned char*>(p + pos));
+		uint8x16_t eq = vorrq_u8(vceqq_u8(v, vs),
+		    vorrq_u8(vceqq_u8(v, vt), vceqq_u8(v, vf)));
+		unsigned long long mask = ~neonMask(eq);
+		if( mask )
+		{
+			return pos + neonFirstByte(mask);
+		}
+	}
+#endif
+	for(; pos < end; ++pos)
+	{
+		char x = p[pos];
+		if( !isSpace(x) )
+		{
+			return pos;
+		}
+	}
+	return end;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Directive scanning for OPT_Directives. Only the start of a directive is
+// read again, its end is known from its tokens.
+
+struct DirectiveName
+{
+	const char*   str;
+	int           len;
+	DirectiveKind kind;
+};
+
+const DirectiveName k_directiveNames[] = {
+	{ "include",      7, DK_Include },
+	{ "define",       6, DK_Define },
+	{ "if",           2, DK_If },
+	{ "ifdef",        5, DK_Ifdef },
+	{ "ifndef",       6, DK_Ifndef },
+	{ "endif",        5, DK_Endif },
+	{ "else",         4, DK_Else },
+	{ "elif",         4, DK_Elif },
+	{ "undef",        5, DK_Undef },
+	{ "pragma",       6, DK_Pragma },
+	{ "error",        5, DK_Error },
+	{ "line",         4, DK_Line },
+	{ "include_next", 12, DK_Include },
+	{ "import",       6, DK_Include },
+	{ "elifdef",      7, DK_Elif },
+	{ "elifndef",     8, DK_Elif },
+	{ "warning",      7, DK_Error }
+};
+
+DirectiveKind findDirectiveKind(const char* p, int len)
+{
+	for(int i = 0; i < ARRAY_COUNT(k_directiveNames); ++i)
+	{
+		const DirectiveName& name = k_directiveNames[i];
+		if( name.len == len && memcmp(name.str, p, len) == 0 )
+		{
+			return name.kind;
+		}
+	}
+	return DK_Other;
+}
+
+// [ret] Position of the first character that is not a space, a
+//       backslash-newline or in a comment block, 'end' if none
+Pos skipDirectiveBlanks(const char* p, Pos pos, Pos end)
+{
+	while( pos < end )
+	{
+		char c = p[pos];
+		char next = pos + 1 < end ? p[pos + 1] : 0;
+		if( isSpace(c) )
+		{
+			pos++;
+		}
+		else if( c == '\\' && (next == '\n' || next == '\r') )
+		{
+			pos += 2;
+			if( next == '\r' && pos < end && p[pos] == '\n' )
+			{
+				pos++;
+			}
+		}
+		else if( c == '/' && next == '*' )
+		{
+			pos += 2;
+			while( pos < end && !(p[pos] == '*' && pos + 1 < end
+			  && p[pos + 1] == '/') )
+			{
+				pos++;
+			}
+			pos += 2;
+		}
+		else
+		{
+			return pos;
+		}
+	}
+	return end;
+}
+
+// [ret] Position after the identifier at 'pos', 'pos' if none
+Pos skipDirectiveIdentifier(const char* p, Pos pos, Pos end)
+{
+	while( pos < end && isIdentifierChar(p[pos]) )
+	{
+		pos++;
+	}
+	return pos;
+}
+
+// [ret] Position after the first 'c' from 'pos', 'end' if none
+Pos skipDirectivePast(const char* p, Pos pos, Pos end, char c)
+{
+	while( pos < end )
+	{
+		if( p[pos++] == c )
+		{
+			return pos;
+		}
+	}
+	return end;
+}
+
+// Fills a Directive from its tokens
+// [in] first  Index of the first token, it starts with the #
+// [in] last   Index of the last TT_Macro token of the directive
+void scanDirective(const Token* tokens, int first, int last, Directive& dir)
+{
+	const char* p = tokens[first].str;
+	Pos end = (tokens[last].str + tokens[last].len) - p;
+	while( end > 1 && isSpace(p[end - 1]) )
+	{
+		end--;
+	}
+
+	dir.token = first;
+	Pos pos = skipDirectiveBlanks(p, 1, end);
+	Pos nameEnd = pos;
+	if( pos < end && isIdentifierCharNonDigit(p[pos]) )
+	{
+		nameEnd = skipDirectiveIdentifier(p, pos, end);
+	}
+	dir.name = p + pos;
+	dir.name_len = int(nameEnd - pos);
+	dir.params = dir.name + dir.name_len;
+	dir.params_len = 0;
+	pos = skipDirectiveBlanks(p, nameEnd, end);
+	if( dir.name_len > 0 )
+	{
+		dir.kind = findDirectiveKind(dir.name, dir.name_len);
+	}
+	else
+	{
+		dir.kind = pos < end ? DK_Other : DK_Null;
+	}
+
+	Pos argEnd = end; // The rest of the directive by default
+	switch( dir.kind )
+	{
+	case DK_Include:
+		if( pos < end && (p[pos] == '<' || p[pos] == '"') )
+		{
+			argEnd = skipDirectivePast(p, pos + 1, end,
+			                           p[pos] == '<' ? '>' : '"');
+		}
+		break;
+	case DK_Define:
+		argEnd = skipDirectiveIdentifier(p, pos, end);
+		if( argEnd < end && p[argEnd] == '(' )
+		{
+			// Function-like macro, no space before the parenthesis
+			Pos paramsEnd = skipDirectivePast(p, argEnd + 1, end, ')');
+			dir.params = p + argEnd;
+			dir.params_len = int(paramsEnd - argEnd);
+		}
+		break;
+	case DK_Undef:
+	case DK_Ifdef:
+	case DK_Ifndef:
+		argEnd = skipDirectiveIdentifier(p, pos, end);
+		break;
+	default:
+		break;
+	}
+	dir.arg = p + pos;
+	dir.arg_len = int(argEnd - pos);
+}
+
+// Lists the directives of the tokens as they become final, see
+// OPT_Directives
+class DirectiveList
+{
+public:
+	DirectiveList()
+	{
+		m_items = nullptr;
+		m_count = 0;
+		m_size = 0;
+		m_failed = false;
+	}
+
+	~DirectiveList()
+	{
+		free(m_items);
+	}
+
+	// Adds the directives of the tokens [from, to). A directive is not split
+	// by 'to': its next tokens become final together.
+	void add(const Token* tokens, int from, int to)
+	{
+		for(int i = from; i < to; ++i)
+		{
+			const Token& tok = tokens[i];
+			if( tok.type != TT_Macro || tok.multi == ML_Next )
+			{
+				continue;
+			}
+			int last = i;
+			while( i + 1 < to && tokens[i + 1].multi == ML_Next )
+			{
+				i++;
+				if( tokens[i].type == TT_Macro )
+				{
+					last = i;
+				}
+			}
+			if( m_count == m_size )
+			{
+				int newSize = m_size > 0 ? m_size * 2 : 64;
+				if( m_failed || !resizeArray(m_items, newSize) )
+				{
+					m_failed = true;
+					return;
+				}
+				m_size = newSize;
+			}
+			scanDirective(tokens, int(&tok - tokens), last, m_items[m_count]);
+			m_count++;
+		}
+	}
+
+	// [ret] false upon allocation failure
+	bool finish()
+	{
+		if( !m_items && !m_failed )
+		{
+			// Also for no directive, so the array tells the option was given
+			m_failed = !resizeArray(m_items, 1);
+		}
+		return !m_failed;
+	}
+
+	// Gives ownership of the directive array
+	void detach(const Directive*& items, int& count)
+	{
+		items = m_items;
+		count = m_count;
+		m_items = nullptr;
+		m_count = 0;
+		m_size = 0;
+	}
+
+private:
+	DirectiveList(const DirectiveList&);            // Not copyable
+	DirectiveList& operator=(const DirectiveList&); // Not copyable
+
+	Directive* m_items;
+	int        m_count;
+	int        m_size;
+	bool       m_failed;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+enum State
+{
+	State_Idle,
+	State_Space,
+	State_Identifier,
+	State_IdentifierOrLiteral,
+	State_Macro,
+	State_CommentOrOperator,
+	State_CommentLine,
+	State_CommentBlock,
+	State_CommentBlockEnd,
+	State_OperatorOrPunctuator,
+	State_StringLiteral,
+	State_StringLiteralEsc,
+	State_CharacterLiteral,
+	State_CharacterLiteralEsc,
+	State_OctOrHexLiteral,
+	State_DecLiteral,
+	State_OctLiteral,
+	State_HexLiteralX,
+	State_HexLiteral,
+	State_BinLiteralB,
+	State_BinLiteral,
+	State_IntegerSuffix,
+	State_FloatingLiteral,
+	State_HexFloatingLiteral,
+	State_FloatingExponent,
+	State_FloatingExponentDigits,
+	State_FloatingSuffix,
+	State_RawStringDelimiter,
+	State_RawString,
+	State_RawStringClose,
+	State_NewLine,
+	State_Error = 100
+};
+
+const char* StringFromState(State state)
+{
+	switch(state)
+	{
+	case State_Idle:                return "idle";
+	case State_Space:               return "space";
+	case State_Identifier:          return "identifier";
+	case State_IdentifierOrLiteral: return "identifier or literal";
+	case State_Macro:               return "macro";
+	case State_CommentOrOperator:   return "comment or /";
+	case State_CommentLine:         return "comment line";
+	case State_CommentBlock:        return "comment block";
+	case State_CommentBlockEnd:     return "comment block end";
+	case State_OperatorOrPunctuator:return "operator or punctuator";
+	case State_StringLiteral:       return "string literal";
+	case State_StringLiteralEsc:    return "string literal escape sequence";
+	case State_CharacterLiteral:    return "character literal";
+	case State_CharacterLiteralEsc: return "character literal escape sequence";
+	case State_OctOrHexLiteral:     return "octal or hexadecimal literal";
+	case State_DecLiteral:          return "decimal literal";
+	case State_OctLiteral:          return "octal literal";
+	case State_HexLiteralX:         return "hexadecimal literal x";
+	case State_HexLiteral:          return "hexadecimal literal";
+	case State_BinLiteralB:         return "binary literal b";
+	case State_BinLiteral:          return "binary literal";
+	case State_IntegerSuffix:       return "integer suffix";
+	case State_FloatingLiteral:     return "floating literal";
+	case State_HexFloatingLiteral:  return "hexadecimal floating literal";
+	case State_FloatingExponent:    return "floating exponent";
+	case State_FloatingExponentDigits: return "floating exponent digits";
+	case State_FloatingSuffix:      return "floating suffix";
+	case State_RawStringDelimiter:  return "raw string literal delimiter";
+	case State_RawString:           return "raw string literal";
+	case State_RawStringClose:      return "raw string literal end";
+	case State_NewLine:             return "new line";
+	case State_Error:               return "error";
+	default: break;
+	}
+	return "";
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Kind of the operator or punctuator, KD_None if unknown
+int findOperator(const char* p, int len);
+
+// [ret] true if the content starts with the UTF-8 BOM sequence
+bool startsWithUtf8Bom(const char* p, Pos len)
+{
+	return len >= 3
+	  && (p[0] & 0x00ff) == 0xef
+	  && (p[1] & 0x00ff) == 0xbb
+	  && (p[2] & 0x00ff) == 0xbf;
+}
+
+// When dropping consumed content, up to that many characters of the current
+// line are kept anyway to display the line upon error
+const int k_maxErrorLineKeep = 1024;
+
+// Maximum number of characters of the line shown in an error message
+const int k_maxErrorLineShown = 1024 * 1024;
+
+// Maximum length of the delimiter of a raw string literal, as in the standard
+const int k_maxRawDelimLen = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+// Features of the parsing that cost something for each token. The parser is
+// instantiated for each set of features, see parse(), so a parsing pays only
+// for the features it uses. An instance may also run with fewer features
+// than its set, they are still checked at runtime.
+enum Feature
+{
+	FT_Kinds      = 0x01, // OPT_Kinds
+	FT_Skip       = 0x02, // OPT_SkipSpace, OPT_SkipComments
+	FT_Brackets   = 0x04, // OPT_MatchBrackets
+	FT_Directives = 0x08, // OPT_Directives
+	FT_All        = 0x0f
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct Context
+{
+	char c;
+	char prevC;
+
+	TokenAllocator m_tokens;
+	const char*    m_error;  // Static message, null unless the parsing failed
+	int            m_opNode; // Operator trie node, see opNext()
+	char m_rawDelim[k_maxRawDelimLen]; // Delimiter of the raw string literal
+	int  m_rawDelimLen;
+	int  m_rawMatched; // Delimiter characters found after the )
+
+	// Statistics
+	int m_unixNlCount;
+	int m_dosNlCount;
+	int m_macNlCount;
+	
+	bool m_hasUtf8Bom;
+
+	bool m_final;      // false while more content may be appended
+	int  m_finalCount; // Number of tokens that cannot change anymore
+	int  m_stopCount;  // parse() returns when m_finalCount reaches it
+	int  m_skipTypes;  // Bit (1 << type) set for each type not to give
+
+	bool           m_matchBrackets; // OPT_MatchBrackets
+	BracketMatcher m_brackets;
+	bool           m_findDirectives; // OPT_Directives
+	DirectiveList  m_directives;
+#if defined(CPPNOM_STATS)
+	Stats* m_stats;    // Null when not measuring
+#endif
+
+	Context(const char* content, Pos len)
+	{
+		c = 0;
+		prevC = 0;
+		m_opNode = 0;
+		m_rawDelimLen = 0;
+		m_rawMatched = 0;
+		m_tokenStartAt = -1;
+
+		m_p = content;
+		m_len = len;
+		
+		// Skip utf-8 bom
+		if( startsWithUtf8Bom(m_p, m_len) )
+		{
+			m_len -= 3;
+			m_p += 3;
+			m_hasUtf8Bom = true;
+		}
+		else
+		{
+			m_hasUtf8Bom = false;
+		}
+
+		m_index = -1;
+		m_tokenStartAt = 0;
+		m_tokenLineNum = 0;
+		m_lineStartAt = 0;
+		m_lineCounter = 1;
+		m_multi = ML_Single;
+
+		m_unixNlCount = 0;
+		m_dosNlCount = 0;
+		m_macNlCount = 0;
+
+		m_state = State_NewLine;
+		m_tokenStartAt = 0;
+		m_tokenLineNum = 1;
+		m_insideMacro = false;
+		m_error = nullptr;
+		m_errorLine = 0;
+		m_hasErrorRecord = false;
+		m_errorState = State_Idle;
+		m_errorChar = 0;
+		m_errorLineStartAt = 0;
+		m_errorLineLen = 0;
+		m_errorColumn = 0;
+		m_final = true;
+		m_finalCount = 0;
+		m_stopCount = 0x7fffffff;
+		m_skipTypes = 0;
+		m_matchBrackets = false;
+		m_findDirectives = false;
+		m_isTokenTooLong = false;
+		m_isPoolFull = false;
+#if defined(CPPNOM_STATS)
+		m_stats = nullptr;
+		m_statsIndex = 0;
+		m_statsTicks = 0;
+#endif
+	}
+
+#if defined(CPPNOM_STATS)
+	// Starts measuring the state given by next()
+	void beginState()
+	{
+		if( m_stats )
+		{
+			m_statsIndex = m_index;
+			m_statsTicks = readTicks();
+		}
+	}
+
+	// Adds the run of the state since beginState() to the statistics
+	void endState(State state)
+	{
+		if( m_stats && int(state) < int(Stats::k_maxStates) )
+		{
+			m_stats->state_ticks[state] += readTicks() - m_statsTicks;
+			m_stats->state_calls[state]++;
+			m_stats->state_bytes[state] += m_index - m_statsIndex + 1;
+		}
+	}
+#endif
+
+	// Fetch next char
+	// Here we also do the work of the preprocessor regarding backslash-newlines
+	template<int F>
+	bool next(State& state)
+	{
+		m_index++;
+		prevC = c;
+		
+		// Loop until we found a satisfying character
+		for(;;)
+		{
+			if( !m_final && m_index + 2 >= m_len )
+			{
+				// Wait for more content, nextLegitChar() looks up to two
+				// characters ahead
+				m_index--;
+				return false;
+			}
+			if( m_index >= m_len )
+			{
+				if( m_index > m_len )
+				{
+					return false;
+				}
+				// Use 0 to push the last token
+				c = 0;
+				break;
+			}
+			
+			if( !nextLegitChar<F>() )
+			{
+				break;
+			}
+		}
+		
+		state = m_state;
+		return true;
+	}
+
+	// Declares the context as error and records where the error happened.
+	// The detailed message is only built by format_error().
+	void error(const char* message = "unexpected character")
+	{
+		int lineNum = m_lineCounter;
+		if( c == '\n' )
+		{
+			m_lineCounter--;
+		}
+		m_errorLine = lineNum;
+		m_error = message;
+
+		Pos i = m_index;
+		for(; i < m_len; ++i)
+		{
+			if( m_p[i] == '\n' )
+			{
+				break;
+			}
+		}
+		Pos lineLen = i - m_lineStartAt;
+		Pos column = m_index - m_lineStartAt;
+		m_hasErrorRecord = true;
+		m_errorState = m_state;
+		m_errorChar = c;
+		m_errorLineStartAt = m_lineStartAt;
+		m_errorLineLen = lineLen < k_maxErrorLineShown ? int(lineLen)
+		                                               : k_maxErrorLineShown;
+		m_errorColumn = column < k_maxErrorLineShown ? int(column)
+		                                             : k_maxErrorLineShown - 1;
+	}
+
+	// Declares the context as error for a reason unrelated to the content
+	void fail(const char* message)
+	{
+		if( !m_error )
+		{
+			m_error = message;
+		}
+	}
+
+	// [out] record  Points on the content, cleared without error location
+	void getErrorRecord(ErrorRecord& record) const
+	{
+		if( !m_hasErrorRecord )
+		{
+			clearErrorRecord(record);
+			return;
+		}
+		record.state = StringFromState(m_errorState);
+		record.c = (unsigned char)m_errorChar;
+		record.line = m_p + m_errorLineStartAt;
+		record.line_len = m_errorLineLen;
+		record.column = m_errorColumn;
+	}
+
+	void newState(State newState)
+	{
+		if( m_state == State_Idle || m_state == State_NewLine )
+		{
+			newToken();
+		}
+		if( newState == State_Macro )
+		{
+			m_insideMacro = true;
+		}
+		m_state = newState;
+	}
+
+	void convertTokenMacro(TokenType& type)
+	{
+		if( m_insideMacro )
+		{
+			// Macros are hard to deal with.
+			// Do not parse macro except comments.
+			// Divide symbol is ambiguous and may lead to the identification
+			// of a symbol inside the macro. Cancel that.
+			if( !(type == TT_CommentLine || type == TT_CommentBlock) )
+			{
+				if( type == TT_Macro )
+				{
+					// End of macro
+					m_insideMacro = false;
+				}
+				else
+				{
+					// Other type of token, make it a dependent macro token
+					type = TT_Macro;
+				}
+			}
+		}
+	}
+	
+	// Called by the parsing function to notify the end of one C++ token
+	// [ret] State to do immediately
+	template<int F>
+	State pushToken(TokenType type, bool wantsCurrentChar = false)
+	{
+		convertTokenMacro(type);
+
+		// Update types in case previous tokens are linked with the one we are
+		// going to push after parsing
+		if( m_multi != ML_Single )
+		{
+			fixPrevTokenTypes(type);
+		}
+		
+		pushTokenNoStateChange<F>(type, wantsCurrentChar);
+		m_tokenStartAt = -1;
+
+		if( !m_insideMacro )
+		{
+			m_state = State_Idle;
+			m_multi = ML_Single;
+			fixMacroTokenMulti();
+			setAllFinal<F>();
+		}
+		else
+		{
+			if( type == TT_CommentBlock || type == TT_Macro )
+			{
+				// Continue macro parsing
+				m_state = State_Macro;
+				m_multi = ML_Next;
+				m_tokenStartAt = m_index;
+				m_tokenLineNum = m_lineCounter;
+				
+				// The current char was consumed, next token begins after
+				if( wantsCurrentChar )
+				{
+					m_tokenStartAt++;
+				}
+			}
+			else if( type == TT_CommentLine )
+			{
+				m_insideMacro = false;
+				m_state = State_Idle;
+				m_multi = ML_Single;
+				fixMacroTokenMulti();
+				setAllFinal<F>();
+			}
+			else
+			{
+				m_state = State_Idle;
+			}
+		}
+		return m_state;
+	}
+
+	// Declares all the allocated tokens as final. The final tokens of the
+	// skipped types are removed: they are not referenced anymore by the
+	// parsing, which may look at the previous tokens until then.
+	template<int F>
+	void setAllFinal()
+	{
+		if( (F & FT_Skip) && m_skipTypes != 0 )
+		{
+			m_tokens.removeTypes(m_finalCount, m_skipTypes);
+		}
+		int count = m_tokens.count();
+		if( (F & FT_Brackets) && m_matchBrackets && count > m_finalCount )
+		{
+			m_brackets.add(m_tokens.get(0), m_finalCount, count);
+		}
+		if( (F & FT_Directives) && m_findDirectives && count > m_finalCount )
+		{
+			m_directives.add(m_tokens.get(0), m_finalCount, count);
+		}
+		m_finalCount = count;
+	}
+
+	// Initialy done for /* */ comments on multiple lines.
+	// If the token type is none it will be set when the final token is pushed
+	template<int F>
+	void pushTokenMultiline(TokenType type = TT_None)
+	{
+		// Push current token though it is uncomplete
+		if( m_multi == ML_Single )
+		{
+			m_multi = ML_First;
+		}
+		else if( m_multi == ML_First )
+		{
+			m_multi = ML_Next;
+		}
+		pushTokenNoStateChange<F>(type, false);
+
+		// continue parsing the current C++ token
+		newToken();
+
+		// New tokens will be linked
+		if( m_multi == ML_First )
+		{
+			m_multi = ML_Next;
+		}
+	}
+	
+	// For operators and punctuators
+	const char* getTokenStr() const
+	{
+		if( m_tokenStartAt < 0 )
+		{
+			return nullptr;
+		}
+		return m_p + m_tokenStartAt;
+	}
+
+	// For operators and punctuators
+	int getTokenLen() const
+	{
+		if( m_tokenStartAt < 0 )
+		{
+			return 0;
+		}
+		return int(m_index - m_tokenStartAt) + 1;
+	}
+	
+	// [ret] Character after the current one as is, 0 at the end. Only for
+	//       decisions that can ignore a backslash-newline there.
+	char peekNext() const
+	{
+		return peek(1);
+	}
+
+	int getErrorLine() const
+	{
+		return m_errorLine;
+	}
+
+	bool isTokenTooLong() const
+	{
+		return m_isTokenTooLong;
+	}
+
+	bool isPoolFull() const
+	{
+		return m_isPoolFull;
+	}
+
+	// [ret] The Feature flags the parsing needs
+	int getFeatures() const
+	{
+		return (m_tokens.hasKinds() ? FT_Kinds : 0)
+		  | (m_skipTypes != 0 ? FT_Skip : 0)
+		  | (m_matchBrackets ? FT_Brackets : 0)
+		  | (m_findDirectives ? FT_Directives : 0);
+	}
+
+	// Skips the characters until the next one equal to a, b, c2 or d.
+	// The skipped characters are part of the current token: call this only
+	// from states that would consume them without doing anything.
+	// The stop characters must include the newline and the backslash, so
+	// line counting and backslash-newlines are still done by next().
+	void skipToAnyOf(char a, char b, char c2, char d)
+	{
+		skipTo(findAnyOf4(m_p, m_index + 1, m_len, a, b, c2, d));
+	}
+
+	// Skips the spaces that follow the current character
+	void skipSpaces()
+	{
+		skipTo(findNonSpace(m_p, m_index + 1, m_len));
+	}
+
+	// Skips the characters of the given classes that follow the current
+	// character, so a whole identifier or number is consumed in one loop.
+	// The classes must not include the newline and the backslash.
+	void skipWhileInClass(int classes)
+	{
+		const char* p = m_p + m_index + 1;
+		const char* end = m_p + m_len;
+		while( p < end && isInClass(*p, classes) )
+		{
+			++p;
+		}
+		skipTo(Pos(p - m_p));
+	}
+
+	// Makes the parsing start at 'pos', as if a newline that ends all the
+	// C++ tokens was just parsed. The line numbers restart at 'line'.
+	void startAfterNewLine(Pos pos, int line = 1)
+	{
+		c = '\n';
+		m_index = pos - 1;
+		m_state = State_NewLine;
+		m_tokenStartAt = pos - 1;
+		m_tokenLineNum = line;
+		m_lineStartAt = pos - 1;
+		m_lineCounter = line;
+	}
+
+	// Limits the parsing to the characters before 'end'. Unless 'end' is the
+	// end of the content, the two characters after are still read by next()
+	void setParseEnd(Pos end, bool isContentEnd)
+	{
+		m_len = isContentEnd ? end : end + 2;
+		m_final = isContentEnd;
+	}
+
+	// [ret] true if the parsing stopped at 'end' in the state that
+	//       startAfterNewLine(end) gives
+	bool isAfterNewLine(Pos end) const
+	{
+		return m_index == end - 1 && c == '\n' && m_state == State_NewLine
+		  && m_tokenStartAt == m_index && m_multi == ML_Single
+		  && !m_insideMacro;
+	}
+
+	// [ret] true once the whole content was parsed
+	bool isAtEnd() const
+	{
+		return m_index > m_len;
+	}
+
+	// [ret] Position of the first character still referenced by the parsing
+	//       or by an allocated token. The characters before can be dropped.
+	Pos getFirstNeededPos() const
+	{
+		Pos pos = m_index < 0 ? 0 : m_index;
+		if( pos - m_lineStartAt <= k_maxErrorLineKeep )
+		{
+			// Keep the current line for error reporting
+			pos = m_lineStartAt;
+		}
+		if( m_tokenStartAt >= 0 && m_tokenStartAt < pos )
+		{
+			pos = m_tokenStartAt;
+		}
+		if( m_tokens.count() > 0 )
+		{
+			Pos tokPos = m_tokens.get(0)->str - m_p;
+			if( tokPos < pos )
+			{
+				pos = tokPos;
+			}
+		}
+		return pos;
+	}
+
+	// Updates the positions and the allocated tokens after the content moved
+	// [in] p      New content buffer
+	// [in] len    New content length
+	// [in] shift  Number of characters dropped at the beginning
+	void rebase(const char* p, Pos len, Pos shift)
+	{
+		for(int i = 0; i < m_tokens.count(); ++i)
+		{
+			Token* pTok = m_tokens.get(i);
+			pTok->str = p + ((pTok->str - m_p) - shift);
+		}
+		m_p = p;
+		m_len = len;
+		m_index -= shift;
+		if( m_tokenStartAt >= 0 )
+		{
+			m_tokenStartAt -= shift;
+		}
+		// The beginning of a long line may be lost for error reporting
+		m_lineStartAt -= shift;
+		if( m_lineStartAt < 0 )
+		{
+			m_lineStartAt = 0;
+		}
+	}
+
+private:
+	State m_state;
+
+	const char* m_p;         // File content buffer
+	Pos   m_len;             // File length
+	Pos   m_index;           // Position of the current char
+	
+	Pos   m_tokenStartAt;    // Position of the first char of the token
+	int   m_tokenLineNum;    // Line index when the token was started
+	Pos   m_lineStartAt;     // Position of the current line, for error reporting
+	int   m_lineCounter;     // Current line number, 1-based
+	Multi m_multi;           // C++ token split?
+	bool  m_insideMacro;     // Macro contains tokens too
+	int   m_errorLine;       // Filled on error()
+	bool  m_hasErrorRecord;  // The members below are filled by error()
+	State m_errorState;
+	char  m_errorChar;
+	Pos   m_errorLineStartAt;
+	int   m_errorLineLen;
+	int   m_errorColumn;
+	bool  m_isTokenTooLong;  // See pushTokenNoStateChange()
+	bool  m_isPoolFull;      // The token pool could not grow
+#if defined(CPPNOM_STATS)
+	Pos       m_statsIndex;  // See beginState()
+	long long m_statsTicks;
+#endif
+
+private:
+	// Try to merge the new token with the previous token if they are both
+	// of macro type
+	// [ret] true if merge done
+	bool tryToMergeMacro(int tokLen)
+	{
+		Token* pPrev = m_tokens.getPrev(nullptr);
+		if( !(pPrev && pPrev->type == TT_Macro) )
+		{
+			return false;
+		}
+
+		if( (pPrev->multi == ML_First || pPrev->multi == ML_Next)
+		        && m_multi == ML_Next )
+		{
+			pPrev->len += tokLen;
+			return true;
+		}
+		return false;
+	}
+	
+	// Maybe after merging we do not need a multi token anymore
+	// Call this function when the C++ macro ends
+	void fixMacroTokenMulti()
+	{
+		Token* pPrev = m_tokens.getPrev(nullptr);
+		if( !(pPrev && pPrev->type == TT_Macro) )
+		{
+			return;
+		}
+
+		if( pPrev->multi == ML_First )
+		{
+			// Indeed
+			pPrev->multi = ML_Single;
+		}
+	}
+
+	void fixPrevTokenTypes(TokenType type)
+	{
+		Token* pTok = nullptr;
+		for(;;)
+		{
+			pTok = m_tokens.getPrev(pTok);
+			if( !pTok )
+			{
+				break;
+			}
+			if( pTok->multi == ML_Single )
+			{
+				break;
+			}
+			if( pTok->type == TT_None )
+			{
+				pTok->type = type;
+			}
+			else if( pTok->type == TT_Macro )
+			{
+				// The parts before are the beginning of the macro, not of
+				// the comment that ends it
+				type = TT_Macro;
+			}
+		}
+	}
+
+	// Helper function for next()
+	// [ret] true to continue looping
+	// [ret] Character 'offset' characters after the current one, 0 past the
+	//       end so the content is never read beyond 'len'
+	char peek(Pos offset) const
+	{
+		Pos pos = m_index + offset;
+		return pos < m_len ? m_p[pos] : 0;
+	}
+
+	template<int F>
+	bool nextLegitChar()
+	{
+		if( c == '\n' )
+		{
+			m_lineStartAt = m_index;
+		}
+		c = m_p[m_index];
+		
+		// We do not expose \r, only return \n to make things simplier
+		if( c == '\n' )
+		{
+			m_lineCounter++;
+			m_unixNlCount++;
+		}
+		else if( c == '\r' )
+		{
+			if( peek(1) == '\n' )
+			{
+				// Yes, DOS newline
+				m_index++;
+				
+				c = '\n';
+				m_lineCounter++;
+				m_dosNlCount++;
+			}
+			else
+			{
+				// Old Mac style newline
+				c = '\n';
+				m_lineCounter++;
+				m_macNlCount++;
+			}
+		}
+		else if( c == '\\' )
+		{
+			// We do not expose backslash+newline neither
+			char nextC = peek(1);
+			if( nextC == '\r' || nextC == '\n' )
+			{
+				// If the statement is split across multiple lines, it means
+				// we have several tokens for one statement.
+				// The first token will have its linked member set to false,
+				// and the following ones will have their linked member set to true.
+				
+				// Push current token though it is uncomplete
+				// If the state is Idle, it means no token parsing was occurring
+				if( m_state == State_Macro )
+				{
+					// Typed now, the token that ends the macro may be a
+					// comment and must not give its type to this part.
+					// Not merged with the previous part, as before.
+					int count = m_tokens.count();
+					pushTokenMultiline<F>();
+					if( m_tokens.count() > count )
+					{
+						m_tokens.getPrev(nullptr)->type = TT_Macro;
+					}
+				}
+				else if( m_state != State_Idle )
+				{
+					pushTokenMultiline<F>();
+
+					// The operator restarts after the backslash, it is matched
+					// from its first character again
+					m_opNode = 0;
+				}
+				else
+				{
+					m_state = State_NewLine;
+				}
+
+				// Push a new token for the backslash
+				Token* pTok = m_tokens.alloc();
+				if( pTok == nullptr )
+				{
+					// Make parse() stop with an error
+					m_isPoolFull = true;
+					m_stopCount = 0;
+				}
+				else
+				{
+					pTok->type = TT_BackslashNewline;
+					pTok->line = m_lineCounter;
+					pTok->str = m_p+m_index;
+					pTok->len = 1;
+					pTok->multi = m_multi;
+				}
+				
+				char nextNextC = peek(2);
+				if( nextC == '\r' )
+				{
+					if( nextNextC == '\n' )
+					{
+						// Skip 3 characters
+						m_dosNlCount++;
+						m_index += 3;
+					}
+					else
+					{
+						// Skip 2 only
+						m_macNlCount++;
+						m_index += 2;
+					}
+				}
+				else
+				{
+					// Skip just 2
+					m_unixNlCount++;
+					m_index += 2;
+				}
+				
+				m_lineStartAt = m_index;
+				m_lineCounter++;
+	
+				// continue parsing
+				newToken();
+				return true;
+			}
+		}
+		return false;
+	}
+	
+	void newToken()
+	{
+		m_tokenStartAt = m_index;
+		m_tokenLineNum = m_lineCounter;
+	}
+
+	// Moves forward so that next() fetches the character at pos
+	void skipTo(Pos pos)
+	{
+		if( pos <= m_index + 1 )
+		{
+			return;
+		}
+		if( c == '\n' )
+		{
+			// Done by nextLegitChar() when no character is skipped
+			m_lineStartAt = m_index + 1;
+		}
+		m_index = pos - 1;
+		c = m_p[m_index];
+	}
+
+	// Push current token without changing m_state
+	template<int F>
+	void pushTokenNoStateChange(TokenType type, bool wantsCurrentChar)
+	{
+		assert(m_tokenStartAt >= 0);
+		const char* tokStr = m_p + m_tokenStartAt;
+		Pos len = (m_index - m_tokenStartAt) + 1;
+		
+		// Include current character for tokens that have an end tag
+		// TT_CommentBlock
+		// TT_StringLiteral
+		// TT_CharacterLiteral
+		// Unambigous TT_Operator
+		// Unambigous TT_Integer
+
+		if( !wantsCurrentChar )
+		{
+			len--;
+		};
+		
+		trimTokenRight(tokStr, len);
+		trimTokenLeft(tokStr, len);
+		if( len > 0x7fffffff )
+		{
+			// Token::len is an int, make parse() stop with an error
+			m_isTokenTooLong = true;
+			m_stopCount = 0;
+			return;
+		}
+		int tokLen = int(len);
+		
+		if( type == TT_Macro )
+		{
+			if( tokLen == 0 )
+			{
+				// In case of comment inside a macro and a macro parsing
+				// restart, an empty token may be generated.
+				// We do not want to store that empty token.
+				return;
+			}
+			if( tryToMergeMacro(tokLen) )
+			{
+				return;
+			}
+		}
+		
+		int kind = KD_None;
+		if( type == TT_Identifier )
+		{
+			int kw = findKeyword(tokStr, tokLen);
+			if( kw >= 0 )
+			{
+				type = TT_Keyword;
+				kind = KW_alignof + kw;
+			}
+		}
+		else if( (F & FT_Kinds) && type == TT_OperatorOrPunctuator
+		  && m_tokens.hasKinds() )
+		{
+			kind = findOperator(tokStr, tokLen);
+		}
+
+		Token* pTok = m_tokens.alloc();
+		if( pTok == nullptr )
+		{
+			// Make parse() stop with an error
+			m_isPoolFull = true;
+			m_stopCount = 0;
+			return;
+		}
+		pTok->type = type;
+		pTok->str = tokStr;
+		pTok->len = tokLen;
+		pTok->line = m_tokenLineNum;
+		pTok->multi = m_multi;
+		if( F & FT_Kinds )
+		{
+			// Otherwise alloc() already set KD_None
+			m_tokens.setKind(pTok, kind);
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Operators and punctuators are recognized with a trie that has one node per
+// operator prefix. The parsing moves from node to node as characters come, so
+// the token is never compared against the operator list.
+struct OpNode
+{
+	char          c;     // Last character of the prefix
+	unsigned char kind;  // Kind if the prefix is an operator, KD_None if not
+	unsigned char child; // Index of the first child node
+	unsigned char count; // Number of child nodes, 0 if the operator is complete
+};
+
+static const OpNode k_opNodes[] = {
+	{ 0  , KD_None, 0, 0 }, // Root, see k_opFirst
+	{ '{', OP_LeftBrace,             0, 0 }, // {
+	{ '}', OP_RightBrace,            0, 0 }, // }
+	{ '[', OP_LeftBracket,           0, 0 }, // [
+	{ ']', OP_RightBracket,          0, 0 }, // ]
+	{ '#', OP_Hash,                 26, 1 }, // #
+	{ '(', OP_LeftParen,             0, 0 }, // (
+	{ ')', OP_RightParen,            0, 0 }, // )
+	{ '<', OP_Less,                 27, 4 }, // <
+	{ ':', OP_Colon,                31, 2 }, // :
+	{ '%', OP_Percent,              33, 3 }, // %
+	{ ';', OP_Semicolon,             0, 0 }, // ;
+	{ '.', OP_Dot,                  36, 2 }, // .
+	{ '?', OP_Question,              0, 0 }, // ?
+	{ '+', OP_Plus,                 38, 2 }, // +
+	{ '-', OP_Minus,                40, 3 }, // -
+	{ '*', OP_Star,                 43, 1 }, // *
+	{ '/', OP_Slash,                44, 1 }, // /
+	{ '^', OP_Caret,                45, 1 }, // ^
+	{ '&', OP_Amp,                  46, 2 }, // &
+	{ '|', OP_Pipe,                 48, 2 }, // |
+	{ '~', OP_Tilde,                 0, 0 }, // ~
+	{ '!', OP_Exclaim,              50, 1 }, // !
+	{ '=', OP_Equal,                51, 1 }, // =
+	{ '>', OP_Greater,              52, 2 }, // >
+	{ ',', OP_Comma,                 0, 0 }, // ,
+	{ '#', OP_HashHash,              0, 0 }, // ##
+	{ ':', OP_DigraphLeftBracket,    0, 0 }, // <:
+	{ '%', OP_DigraphLeftBrace,      0, 0 }, // <%
+	{ '<', OP_LessLess,             54, 1 }, // <<
+	{ '=', OP_LessEqual,             0, 0 }, // <=
+	{ '>', OP_DigraphRightBracket,   0, 0 }, // :>
+	{ ':', OP_ColonColon,            0, 0 }, // ::
+	{ '>', OP_DigraphRightBrace,     0, 0 }, // %>
+	{ ':', OP_DigraphHash,          55, 1 }, // %:
+	{ '=', OP_PercentEqual,          0, 0 }, // %=
+	{ '.', KD_None,                 56, 1 }, // ..
+	{ '*', OP_DotStar,               0, 0 }, // .*
+	{ '=', OP_PlusEqual,             0, 0 }, // +=
+	{ '+', OP_PlusPlus,              0, 0 }, // ++
+	{ '=', OP_MinusEqual,            0, 0 }, // -=
+	{ '-', OP_MinusMinus,            0, 0 }, // --
+	{ '>', OP_Arrow,                57, 1 }, // ->
+	{ '=', OP_StarEqual,             0, 0 }, // *=
+	{ '=', OP_SlashEqual,            0, 0 }, // /=
+	{ '=', OP_CaretEqual,            0, 0 }, // ^=
+	{ '=', OP_AmpEqual,              0, 0 }, // &=
+	{ '&', OP_AmpAmp,                0, 0 }, // &&
+	{ '=', OP_PipeEqual,             0, 0 }, // |=
+	{ '|', OP_PipePipe,              0, 0 }, // ||
+	{ '=', OP_ExclaimEqual,          0, 0 }, // !=
+	{ '=', OP_EqualEqual,            0, 0 }, // ==
+	{ '>', OP_GreaterGreater,       58, 1 }, // >>
+	{ '=', OP_GreaterEqual,          0, 0 }, // >=
+	{ '=', OP_LessLessEqual,         0, 0 }, // <<=
+	{ '%', KD_None,                 59, 1 }, // %:%
+	{ '.', OP_Ellipsis,              0, 0 }, // ...
+	{ '*', OP_ArrowStar,             0, 0 }, // ->*
+	{ '=', OP_GreaterGreaterEqual,   0, 0 }, // >>=
+	{ ':', OP_DigraphHashHash,       0, 0 }  // %:%:
+};
+
+// Node of each first character of the operators, 0 if none
+static const unsigned char k_opFirst[128] = {
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0, 22,  0,  5,  0, 10, 19,  0,  6,  7, 16, 14, 25, 15, 12, 17,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  9, 11,  8, 23, 24, 13,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  3,  0,  4, 18,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1, 20,  2, 21,  0
+};
+
+// [in] node  Current node, 0 for the root
+// [ret] Node reached with the character c, 0 if none
+inline int opNext(int node, char c)
+{
+	if( node == 0 )
+	{
+		return (c & 0x80) ? 0 : k_opFirst[int(c)];
+	}
+	const OpNode& n = k_opNodes[node];
+	for(int i = n.child; i < n.child + n.count; ++i)
+	{
+		if( k_opNodes[i].c == c )
+		{
+			return i;
+		}
+	}
+	return 0;
+}
+
+// [ret] true if longer operators begin with the node prefix
+inline bool opHasNext(int node)
+{
+	return k_opNodes[node].count > 0;
+}
+
+int findOperator(const char* p, int len)
+{
+	int node = 0;
+	for(int i = 0; i < len; ++i)
+	{
+		node = opNext(node, p[i]);
+		if( node == 0 )
+		{
+			return KD_None;
+		}
+	}
+	return k_opNodes[node].kind;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_NoSpace(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == 'L' || c == 'u' || c == 'U' || c == 'R' )
+	{
+		ctx.newState(State_IdentifierOrLiteral);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_Identifier);
+		ctx.skipWhileInClass(CC_Identifier);
+	}
+	else if( c == '"' )
+	{
+		ctx.newState(State_StringLiteral);
+	}
+	else if( c == '#' )
+	{
+		ctx.newState(State_Macro);
+	}
+	else if( c == '/' )
+	{
+		ctx.newState(State_CommentOrOperator);
+	}
+	else if( c == '\'' )
+	{
+		ctx.newState(State_CharacterLiteral);
+	}
+	else if( c == '0' )
+	{
+		ctx.newState(State_OctOrHexLiteral);
+	}
+	else if( isDigit(c) )
+	{
+		ctx.newState(State_DecLiteral);
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '.' && isDigit(ctx.peekNext()) )
+	{
+		ctx.newState(State_FloatingLiteral);
+	}
+	else if( c == '\n' )
+	{
+		ctx.newState(State_NewLine);
+	}
+	else if( c == 0 )
+	{
+		// End of file
+	}
+	else
+	{
+		// Special case for operators because they can be one char long only
+		int node = opNext(0, c);
+		if( node == 0 )
+		{
+			ctx.error();
+			return false;
+		}
+		ctx.newState(State_OperatorOrPunctuator);
+		if( opHasNext(node) )
+		{
+			ctx.m_opNode = node;
+		}
+		else
+		{
+			ctx.pushToken<F>(TT_OperatorOrPunctuator, true);
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_Idle(Context& ctx)
+{
+	char c = ctx.c;
+	if( isSpace(c) )
+	{
+		ctx.newState(State_Space);
+		ctx.skipSpaces();
+	}
+	else
+	{
+		// A new token begins
+		return doState_NoSpace<F>(ctx);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_Space(Context& ctx)
+{
+	char c = ctx.c;
+	if( isSpace(c) )
+	{
+		// Continue
+		ctx.skipSpaces();
+	}
+	else
+	{
+		// Push token
+		ctx.pushToken<F>(TT_Space);
+		return doState_NoSpace<F>(ctx);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_NewLine(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '\n' || c == 0 )
+	{
+		ctx.pushToken<F>(TT_EmptyLine);
+	}
+	return doState_Idle<F>(ctx);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_Identifier(Context& ctx)
+{
+	char c = ctx.c;
+	if( isIdentifierChar(c) )
+	{
+		ctx.skipWhileInClass(CC_Identifier);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_Identifier);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_IdentifierOrLiteral(Context& ctx)
+{
+	// The token so far is one of the prefixes L, u, U, u8, R, LR, uR, UR, u8R
+	char c = ctx.c;
+	const char* prefix = ctx.getTokenStr();
+	int prefixLen = ctx.getTokenLen() - 1;
+	bool isRaw = prefixLen > 0 && prefix[prefixLen - 1] == 'R';
+	if( c == '"' )
+	{
+		if( isRaw )
+		{
+			// Actually a raw string literal
+			ctx.newState(State_RawStringDelimiter);
+			ctx.m_rawDelimLen = 0;
+		}
+		else
+		{
+			// Actually a string literal
+			ctx.newState(State_StringLiteral);
+		}
+		return true;
+	}
+	else if( c == '\'' && !isRaw )
+	{
+		// Actually a character literal
+		ctx.newState(State_CharacterLiteral);
+		return true;
+	}
+	else if( (c == 'R' && !isRaw)
+	  || (c == '8' && prefixLen == 1 && prefix[0] == 'u') )
+	{
+		// Still a prefix
+		return true;
+	}
+	else
+	{
+		// It was an identifier
+		ctx.newState(State_Identifier);
+		return doState_Identifier<F>(ctx);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_Macro(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '\n' || c == 0 )
+	{
+		ctx.pushToken<F>(TT_Macro);
+		return doState_Idle<F>(ctx);
+	}
+	else
+	{
+		// Check comment block that can act like a backslah-newline
+		if( c == '/' )
+		{
+			ctx.pushTokenMultiline<F>(TT_Macro);
+			ctx.newState(State_CommentOrOperator);
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CommentLine(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '\n' || c == 0 )
+	{
+		ctx.pushToken<F>(TT_CommentLine);
+		return doState_Idle<F>(ctx);
+	}
+	ctx.skipToAnyOf('\n', '\r', '\\', 0);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CommentOrOperator(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '/' )
+	{
+		// Actually a comment line
+		ctx.newState(State_CommentLine);
+	}
+	else if( c == '*' )
+	{
+		// Actually a comment block
+		ctx.newState(State_CommentBlock);
+	}
+	else if( c == '=' )
+	{
+		// Actually the /= operator
+		ctx.pushToken<F>(TT_OperatorOrPunctuator, true);
+	}
+	else
+	{
+		// It was actually an operator
+		State doNow = ctx.pushToken<F>(TT_OperatorOrPunctuator);
+		if( doNow == State_Idle )
+		{
+			return doState_Idle<F>(ctx);
+		}
+		else if( doNow == State_Macro )
+		{
+			return doState_Macro<F>(ctx);
+		}
+		else
+		{
+			ctx.error();
+		}
+	}
+	return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CommentBlock(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '*' )
+	{
+		ctx.newState(State_CommentBlockEnd);
+		return true;
+	}
+	else if( c == '\n' )
+	{
+		ctx.pushTokenMultiline<F>();
+	}
+	ctx.skipToAnyOf('*', '\n', '\r', '\\');
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CommentBlockEnd(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '*' )
+	{
+		// Continue
+	}
+	else if( c == '\n' )
+	{
+		ctx.pushTokenMultiline<F>();
+	}
+	else if( c == '/' )
+	{
+		ctx.pushToken<F>(TT_CommentBlock, true);
+		// We can return immediately because this token has a end tag
+		return true;
+	}
+	else
+	{
+		ctx.newState(State_CommentBlock); // Back to previous state
+		ctx.skipToAnyOf('*', '\n', '\r', '\\');
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_OperatorOrPunctuator(Context& ctx)
+{
+	int node = opNext(ctx.m_opNode, ctx.c);
+	if( node == 0 )
+	{
+		// Operator end reached
+		ctx.pushToken<F>(TT_OperatorOrPunctuator);
+		return doState_Idle<F>(ctx);
+	}
+	else if( opHasNext(node) )
+	{
+		// Continue
+		ctx.m_opNode = node;
+	}
+	else
+	{
+		// Done with end tag
+		// We can return immediately because this token has a end tag
+		ctx.pushToken<F>(TT_OperatorOrPunctuator, true);
+		return true;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_StringLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '\\' )
+	{
+		ctx.newState(State_StringLiteralEsc);
+		return true;
+	}
+	else if( c == '\n' )
+	{
+		ctx.pushTokenMultiline<F>();
+	}
+	else if( c == '"' )
+	{
+		ctx.pushToken<F>(TT_StringLiteral, true);
+		// We can return immediately because this token has a end tag
+		return true;
+	}
+	ctx.skipToAnyOf('"', '\\', '\n', '\r');
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_StringLiteralEsc(Context& ctx)
+{
+	char c = ctx.c;
+	
+	if( isSimpleEscapeSequence(c) )
+	{
+		ctx.newState(State_StringLiteral);
+	}
+	else if( isLongEscapeSequence(c) )
+	{
+		ctx.newState(State_StringLiteral);
+	}
+	else if( isOctDigit(c) )
+	{
+		// The test should be c == '0' but some compilers accepts
+		// expressions like \4
+		ctx.newState(State_StringLiteral);
+	}
+	else if( c == '\n' )
+	{
+		// Not an escape sequence, but a backslash
+		// Keep it in the string
+		ctx.newState(State_StringLiteral);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CharacterLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '\\' )
+	{
+		ctx.newState(State_CharacterLiteralEsc);
+	}
+	else if( c == '\n' )
+	{
+		ctx.error();
+		return false;
+	}
+	else if( c == '\'' )
+	{
+		ctx.pushToken<F>(TT_CharacterLiteral, true);
+		// We can return immediately because this token has a end tag
+		return true;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<int F>
+bool doState_CharacterLiteralEsc(Context& ctx)
+{
+	char c = ctx.c;
+	
+	if( isSimpleEscapeSequence(c) )
+	{
+		ctx.newState(State_CharacterLiteral);
+	}
+	else if( isLongEscapeSequence(c) )
+	{
+		ctx.newState(State_CharacterLiteral);
+	}
+	else if( isOctDigit(c) )
+	{
+		// The test should be c=='0' but some compilers accepts
+		// expressions like \4
+		ctx.newState(State_CharacterLiteral);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Number literals. As in the preprocessor, the letters that follow a number
+// are its suffix, the standard ones like 10ULL or 1.5f and the user defined
+// ones like 10_km. A ' between two digits is a digit separator.
+
+template<int F>
+bool doState_OctOrHexLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == 'x' || c == 'X' )
+	{
+		ctx.newState(State_HexLiteralX);
+	}
+	else if( c == 'b' || c == 'B' )
+	{
+		ctx.newState(State_BinLiteralB);
+	}
+	else if( isOctDigit(c) || (c == '\'' && isOctDigit(ctx.peekNext())) )
+	{
+		ctx.newState(State_OctLiteral);
+		ctx.skipWhileInClass(CC_OctDigit);
+	}
+	else if( isDigit(c) )
+	{
+		// Only valid as the start of a floating literal like 09.5
+		ctx.newState(State_DecLiteral);
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '.' )
+	{
+		ctx.newState(State_FloatingLiteral);
+	}
+	else if( c == 'e' || c == 'E' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_IntegerSuffix);
+	}
+	else
+	{
+		// A decimal 0
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_HexLiteralX(Context& ctx)
+{
+	char c = ctx.c;
+	if( isHexDigit(c) )
+	{
+		ctx.newState(State_HexLiteral);
+		ctx.skipWhileInClass(CC_HexDigit);
+	}
+	else if( c == '.' )
+	{
+		ctx.newState(State_HexFloatingLiteral);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+template<int F>
+bool doState_HexLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isHexDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_HexDigit);
+	}
+	else if( c == '\'' && isHexDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( c == '.' )
+	{
+		ctx.newState(State_HexFloatingLiteral);
+	}
+	else if( c == 'p' || c == 'P' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_IntegerSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_BinLiteralB(Context& ctx)
+{
+	char c = ctx.c;
+	if( isBinDigit(c) )
+	{
+		ctx.newState(State_BinLiteral);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+template<int F>
+bool doState_BinLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isBinDigit(c) || (c == '\'' && isBinDigit(ctx.peekNext())) )
+	{
+		// Continue
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_IntegerSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_OctLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isOctDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_OctDigit);
+	}
+	else if( c == '\'' && isDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( isDigit(c) )
+	{
+		// Only valid as the start of a floating literal like 019.5
+		ctx.newState(State_DecLiteral);
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '.' )
+	{
+		ctx.newState(State_FloatingLiteral);
+	}
+	else if( c == 'e' || c == 'E' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_IntegerSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_DecLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '\'' && isDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( c == '.' )
+	{
+		ctx.newState(State_FloatingLiteral);
+	}
+	else if( c == 'e' || c == 'E' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_IntegerSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_IntegerSuffix(Context& ctx)
+{
+	char c = ctx.c;
+	if( isIdentifierChar(c) )
+	{
+		ctx.skipWhileInClass(CC_Identifier);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_IntegerLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+// After the . of a decimal floating literal
+template<int F>
+bool doState_FloatingLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '\'' && isDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( c == 'e' || c == 'E' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_FloatingSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_FloatingLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+// After the . of a hexadecimal floating literal, the exponent is mandatory
+template<int F>
+bool doState_HexFloatingLiteral(Context& ctx)
+{
+	char c = ctx.c;
+	if( isHexDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_HexDigit);
+	}
+	else if( c == '\'' && isHexDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( c == 'p' || c == 'P' )
+	{
+		ctx.newState(State_FloatingExponent);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+// After the e or the p
+template<int F>
+bool doState_FloatingExponent(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '+' || c == '-' || isDigit(c) )
+	{
+		ctx.newState(State_FloatingExponentDigits);
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+template<int F>
+bool doState_FloatingExponentDigits(Context& ctx)
+{
+	char c = ctx.c;
+	if( isDigit(c) )
+	{
+		ctx.skipWhileInClass(CC_Digit);
+	}
+	else if( c == '\'' && isDigit(ctx.peekNext()) )
+	{
+		// Digit separator
+	}
+	else if( isIdentifierCharNonDigit(c) )
+	{
+		ctx.newState(State_FloatingSuffix);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_FloatingLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+template<int F>
+bool doState_FloatingSuffix(Context& ctx)
+{
+	char c = ctx.c;
+	if( isIdentifierChar(c) )
+	{
+		ctx.skipWhileInClass(CC_Identifier);
+	}
+	else
+	{
+		ctx.pushToken<F>(TT_FloatingLiteral);
+		return doState_Idle<F>(ctx);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Raw string literals: R"delimiter(characters)delimiter". The characters are
+// not checked, they are skipped up to the next ) at once.
+
+template<int F>
+bool doState_RawStringDelimiter(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == '(' )
+	{
+		ctx.newState(State_RawString);
+		ctx.skipToAnyOf(')', '\\', '\n', '\r');
+	}
+	else if( isRawStringDelimiterChar(c) && ctx.m_rawDelimLen < k_maxRawDelimLen )
+	{
+		ctx.m_rawDelim[ctx.m_rawDelimLen++] = c;
+	}
+	else
+	{
+		ctx.error();
+		return false;
+	}
+	return true;
+}
+
+template<int F>
+bool doState_RawString(Context& ctx)
+{
+	char c = ctx.c;
+	if( c == ')' )
+	{
+		// Maybe the end
+		ctx.newState(State_RawStringClose);
+		ctx.m_rawMatched = 0;
+		return true;
+	}
+	else if( c == '\n' )
+	{
+		ctx.pushTokenMultiline<F>();
+	}
+	ctx.skipToAnyOf(')', '\\', '\n', '\r');
+	return true;
+}
+
+// After a ), compares the next characters with the delimiter
+template<int F>
+bool doState_RawStringClose(Context& ctx)
+{
+	char c = ctx.c;
+	int matched = ctx.m_rawMatched;
+	if( matched == ctx.m_rawDelimLen && c == '"' )
+	{
+		ctx.pushToken<F>(TT_StringLiteral, true);
+		// We can return immediately because this token has a end tag
+		return true;
+	}
+	else if( matched < ctx.m_rawDelimLen && c == ctx.m_rawDelim[matched] )
+	{
+		ctx.m_rawMatched++;
+		return true;
+	}
+	// Not the end, the character is part of the string
+	ctx.newState(State_RawString);
+	return doState_RawString<F>(ctx);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fils the Result error field
+void errorToResult(const char* err, Result& result)
+{
+	result.error = err;
+	result.error_line = 0;
+	clearErrorRecord(result.error_record);
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+	result.tokens = nullptr;
+	result.kinds = nullptr;
+	result.count = 0;
+	result.owns_tokens = true;
+}
+
+// Fills the error fields of a result for which no content was parsed
+void errorToEmptyResult(const char* err, Result& result)
+{
+	result.unix_nl_count = 0;
+	result.dos_nl_count = 0;
+	result.mac_nl_count = 0;
+	result.has_utf8_bom = false;
+	errorToResult(err, result);
+}
+
+// All the Option flags
+const int k_knownOptions = OPT_Kinds | OPT_SkipSpace | OPT_SkipComments
+  | OPT_LineIndex | OPT_MatchBrackets | OPT_Directives;
+
+// [ret] Context::m_skipTypes for the options
+int getSkipTypes(int options)
+{
+	int types = 0;
+	if( options & OPT_SkipSpace )
+	{
+		types |= (1 << TT_Space) | (1 << TT_EmptyLine) | (1 << TT_BackslashNewline);
+	}
+	if( options & OPT_SkipComments )
+	{
+		types |= (1 << TT_CommentLine) | (1 << TT_CommentBlock);
+	}
+	return types;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] false if the tokenize() arguments are not valid, the error is then
+//       reported in the result
+bool checkArgs(const char* content, Pos len, int options, Result& result)
+{
+	result.unix_nl_count = 0;
+	result.dos_nl_count = 0;
+	result.mac_nl_count = 0;
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+
+	if( !content )
+	{
+		errorToResult("bad content address", result);
+		return false;
+	}
+	if( len < 0 )
+	{
+		errorToResult("bad content len", result);
+		return false;
+	}
+	if( (options & ~k_knownOptions) != 0 )
+	{
+		errorToResult("bad options", result);
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// parse() with the features F, see Feature
+template<int F>
+bool parseWith(Context& ctx)
+{
+	bool ret = true;
+
+	State state;
+	while( ctx.next<F>(state) )
+	{
+#if defined(CPPNOM_STATS)
+		ctx.beginState();
+#endif
+		bool ok;
+		switch( state )
+		{
+		case State_Idle:
+			ok = doState_Idle<F>(ctx);
+			break;
+		case State_Space:
+			ok = doState_Space<F>(ctx);
+			break;
+		case State_NewLine:
+			ok = doState_NewLine<F>(ctx);
+			break;
+		case State_Identifier:
+			ok = doState_Identifier<F>(ctx);
+			break;
+		case State_IdentifierOrLiteral:
+			ok = doState_IdentifierOrLiteral<F>(ctx);
+			break;
+		case State_Macro:
+			ok = doState_Macro<F>(ctx);
+			break;
+		case State_CommentOrOperator: 
+			ok = doState_CommentOrOperator<F>(ctx);
+			break;
+		case State_CommentLine:
+			ok = doState_CommentLine<F>(ctx);
+			break;
+		case State_CommentBlock:
+			ok = doState_CommentBlock<F>(ctx);
+			break;
+		case State_CommentBlockEnd:
+			ok = doState_CommentBlockEnd<F>(ctx);
+			break;
+		case State_OperatorOrPunctuator:
+			ok = doState_OperatorOrPunctuator<F>(ctx);
+			break;
+		case State_StringLiteral:
+			ok = doState_StringLiteral<F>(ctx);
+			break;
+		case State_StringLiteralEsc:
+			ok = doState_StringLiteralEsc<F>(ctx);
+			break;
+		case State_CharacterLiteral:
+			ok = doState_CharacterLiteral<F>(ctx);
+			break;
+		case State_CharacterLiteralEsc:
+			ok = doState_CharacterLiteralEsc<F>(ctx);
+			break;
+		case State_OctOrHexLiteral:
+			ok = doState_OctOrHexLiteral<F>(ctx);
+			break;
+		case State_DecLiteral:
+			ok = doState_DecLiteral<F>(ctx);
+			break;
+		case State_OctLiteral:
+			ok = doState_OctLiteral<F>(ctx);
+			break;
+		case State_HexLiteralX:
+			ok = doState_HexLiteralX<F>(ctx);
+			break;
+		case State_HexLiteral:
+			ok = doState_HexLiteral<F>(ctx);
+			break;
+		case State_BinLiteralB:
+			ok = doState_BinLiteralB<F>(ctx);
+			break;
+		case State_BinLiteral:
+			ok = doState_BinLiteral<F>(ctx);
+			break;
+		case State_IntegerSuffix:
+			ok = doState_IntegerSuffix<F>(ctx);
+			break;
+		case State_FloatingLiteral:
+			ok = doState_FloatingLiteral<F>(ctx);
+			break;
+		case State_HexFloatingLiteral:
+			ok = doState_HexFloatingLiteral<F>(ctx);
+			break;
+		case State_FloatingExponent:
+			ok = doState_FloatingExponent<F>(ctx);
+			break;
+		case State_FloatingExponentDigits:
+			ok = doState_FloatingExponentDigits<F>(ctx);
+			break;
+		case State_FloatingSuffix:
+			ok = doState_FloatingSuffix<F>(ctx);
+			break;
+		case State_RawStringDelimiter:
+			ok = doState_RawStringDelimiter<F>(ctx);
+			break;
+		case State_RawString:
+			ok = doState_RawString<F>(ctx);
+			break;
+		case State_RawStringClose:
+			ok = doState_RawStringClose<F>(ctx);
+			break;
+		case State_Error:
+			ok = false;
+			break;
+		}
+#if defined(CPPNOM_STATS)
+		ctx.endState(state);
+#endif
+
+		if( !ok )
+		{
+			ret = false;
+			break;
+		}
+		if( ctx.m_finalCount >= ctx.m_stopCount )
+		{
+			break;
+		}
+	}
+	// The last token may be pushed by next() at the end of the content
+	if( ret && ctx.isTokenTooLong() )
+	{
+		ctx.error("token too long");
+		ret = false;
+	}
+	else if( ret && ctx.isPoolFull() )
+	{
+		ctx.error("token pool alloc failed");
+		ret = false;
+	}
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses the available content, or less if Context::m_stopCount is reached.
+// The token pool must be initialized.
+// [ret] false upon parsing error
+bool parse(Context& ctx)
+{
+	// Selects once the instance without the features the context doesn't use
+	switch( ctx.getFeatures() )
+	{
+	case 0:  return parseWith<0>(ctx);
+	case 1:  return parseWith<1>(ctx);
+	case 2:  return parseWith<2>(ctx);
+	case 3:  return parseWith<3>(ctx);
+	case 4:  return parseWith<4>(ctx);
+	case 5:  return parseWith<5>(ctx);
+	case 6:  return parseWith<6>(ctx);
+	case 7:  return parseWith<7>(ctx);
+	case 8:  return parseWith<8>(ctx);
+	case 9:  return parseWith<9>(ctx);
+	case 10: return parseWith<10>(ctx);
+	case 11: return parseWith<11>(ctx);
+	case 12: return parseWith<12>(ctx);
+	case 13: return parseWith<13>(ctx);
+	case 14: return parseWith<14>(ctx);
+	default: return parseWith<FT_All>(ctx);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses the whole content. The token pool must be initialized.
+// Fills everything in the result except the token array.
+bool run(Context& ctx, Result& result)
+{
+	bool ret = parse(ctx);
+	// Upon error, the tokens left are given too
+	ctx.setAllFinal<FT_All>();
+	if( ctx.m_matchBrackets && ret )
+	{
+		if( ctx.m_brackets.finish() )
+		{
+			result.matches = ctx.m_brackets.detach();
+		}
+		else
+		{
+			ctx.fail("bracket index alloc failed");
+			ret = false;
+		}
+	}
+	if( ctx.m_findDirectives && ret )
+	{
+		if( ctx.m_directives.finish() )
+		{
+			ctx.m_directives.detach(result.directives, result.directive_count);
+		}
+		else
+		{
+			ctx.fail("directive index alloc failed");
+			ret = false;
+		}
+	}
+	result.error = ctx.m_error;
+	result.error_line = ctx.getErrorLine();
+	ctx.getErrorRecord(result.error_record);
+	result.unix_nl_count = ctx.m_unixNlCount;
+	result.dos_nl_count = ctx.m_dosNlCount;
+	result.mac_nl_count = ctx.m_macNlCount;
+	result.has_utf8_bom = ctx.m_hasUtf8Bom;
+
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Gives the initial size of the token pool according to the content length.
+// Measured on the libstdc++ and glibc headers: 7.7 bytes per token for the
+// median file, 3.6 for the 1st percentile, 3.1 for the densest file.
+// Reserving one token every 3 bytes means the pool almost never needs to
+// grow, the surplus is given back when the pool is detached.
+// The reservation stops at 1 GB of tokens, bigger contents grow the pool.
+int estimatePoolSize(Pos len)
+{
+	const Pos maxSize = Pos(0x40000000 / sizeof(Token));
+	Pos size = len / 3 + 16;
+	return size < maxSize ? int(size) : int(maxSize);
+}
+
+// Fills Result::line_starts for OPT_LineIndex, once the parsing succeeded.
+// The newline sequences are the ones the parsing counts, the array has
+// exactly one entry more.
+// [ret] false upon allocation failure, the error is then in the result
+bool fillLineIndex(const char* content, Pos len, Result& result)
+{
+	int nlCount = result.unix_nl_count + result.dos_nl_count
+	  + result.mac_nl_count;
+	size_t* starts = reinterpret_cast<size_t*>(
+	  malloc(sizeof(size_t) * (size_t(nlCount) + 1)));
+	if( !starts )
+	{
+		result.error = "line index alloc failed";
+		return false;
+	}
+	Pos pos = result.has_utf8_bom ? 3 : 0;
+	starts[0] = size_t(pos);
+	int count = 1;
+	while( count <= nlCount )
+	{
+		pos = findAnyOf4(content, pos, len, '\n', '\r', '\n', '\r');
+		if( pos == len )
+		{
+			break;
+		}
+		if( content[pos] == '\r' && pos + 1 < len && content[pos + 1] == '\n' )
+		{
+			pos++;
+		}
+		pos++;
+		starts[count++] = size_t(pos);
+	}
+	result.line_starts = starts;
+	result.line_count = count;
+	return true;
+}
+
+// Fills Result::matches and Result::directives from all the tokens, when
+// they were not made during the parsing
+// [in] options  OPT_MatchBrackets and OPT_Directives are used
+// [ret] false upon allocation failure, the error is then in the result
+bool fillTokenIndexes(Result& result, int options)
+{
+	if( options & OPT_MatchBrackets )
+	{
+		BracketMatcher matcher;
+		matcher.add(result.tokens, 0, result.count);
+		if( !matcher.finish() )
+		{
+			result.error = "bracket index alloc failed";
+			return false;
+		}
+		result.matches = matcher.detach();
+	}
+	if( options & OPT_Directives )
+	{
+		DirectiveList directives;
+		directives.add(result.tokens, 0, result.count);
+		if( !directives.finish() )
+		{
+			result.error = "directive index alloc failed";
+			return false;
+		}
+		directives.detach(result.directives, result.directive_count);
+	}
+	return true;
+}
+
+// tokenize() for any content length
+// [in] ctx  Made with 'content' and 'len'
+bool tokenizeContent(Context& ctx, const char* content, Pos len, int options,
+                     Result& result)
+{
+	if( !checkArgs(content, len, options, result) )
+	{
+		return false;
+	}
+
+	bool withKinds = (options & OPT_Kinds) != 0;
+	if( !ctx.m_tokens.init(estimatePoolSize(len), withKinds) )
+	{
+		errorToResult("token pool alloc failed", result);
+		return false;
+	}
+	ctx.m_skipTypes = getSkipTypes(options);
+	ctx.m_matchBrackets = (options & OPT_MatchBrackets) != 0;
+	ctx.m_findDirectives = (options & OPT_Directives) != 0;
+
+	bool ret = run(ctx, result);
+	ctx.m_tokens.detach(result.tokens, result.kinds, result.count);
+	result.owns_tokens = true;
+	if( ret && (options & OPT_LineIndex) )
+	{
+		ret = fillLineIndex(content, len, result);
+	}
+	return ret;
+}
+
+bool tokenizeContent(const char* content, Pos len, int options,
+                     Result& result)
+{
+	Context ctx(content, len);
+	return tokenizeContent(ctx, content, len, options, result);
+}
+
+// Frees the memory of a context that was not given to a Result
+void freeContextMemory(Context& ctx)
+{
+	const Token* tokens;
+	const unsigned char* kinds;
+	int count;
+	ctx.m_tokens.detach(tokens, kinds, count);
+	free(const_cast<Token*>(tokens));
+	free(const_cast<unsigned char*>(kinds));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// See format_error()
+int formatError(const char* error, const ErrorRecord& record, char* buf,
+                int size)
+{
+	MessageWriter writer(buf, size);
+	if( !error )
+	{
+		return writer.finish();
+	}
+	writer.add(error);
+	writer.add('\n');
+	if( !record.state )
+	{
+		return writer.finish();
+	}
+
+	writer.add("state: ");
+	writer.add(record.state);
+	writer.add('\n');
+
+	char ci = char(record.c);
+	if( !isPrintableChar(ci) )
+	{
+		ci = '?';
+	}
+	char info[32];
+	sprintf(info, "char: '%c' u+%04x\n", ci, record.c & 0x000000ff);
+	writer.add(info);
+
+	// The line and a caret under the character
+	writer.add(record.line, record.line_len);
+	writer.add('\n');
+	for(int i = 0; i < record.column; ++i)
+	{
+		writer.add(record.line[i] == '\t' ? '\t' : '~');
+	}
+	writer.add('^');
+	writer.add('\n');
+	return writer.finish();
+}
+
+// Initial sizes for the Tokenizer, both grow when needed
+const int k_streamPoolSize = 256;    // In number of tokens
+const int k_streamBufferSize = 4096; // In number of characters
+
+#if defined(CPPNOM_NO_MMAP)
+///////////////////////////////////////////////////////////////////////////////
+// Reads a whole file in allocated memory
+// [out] content  Null for an empty file
+// [ret] Error message, null upon success
+const char* readFile(const char* path, const char*& content, size_t& len)
+{
+	FILE* pf = fopen(path, "rb");
+	if( !pf )
+	{
+		return "file open failed";
+	}
+	fseek(pf, 0, SEEK_END);
+	long size = ftell(pf);
+	fseek(pf, 0, SEEK_SET);
+	if( size < 0 )
+	{
+		fclose(pf);
+		return "file stat failed";
+	}
+	if( size_t(size) > size_t(-1) / 2 )
+	{
+		fclose(pf);
+		return "file too big";
+	}
+	char* buf = nullptr;
+	if( size > 0 )
+	{
+		buf = reinterpret_cast<char*>(malloc(size_t(size)));
+		if( !buf || fread(buf, 1, size_t(size), pf) != size_t(size) )
+		{
+			free(buf);
+			fclose(pf);
+			return "file read failed";
+		}
+	}
+	fclose(pf);
+	content = buf;
+	len = size_t(size);
+	return nullptr;
+}
+#endif
+
+// Maps a whole file in memory for reading, see tokenize_file()
+// [out] content  Null for an empty file
+// [ret] Error message, null upon success
+const char* mapFile(const char* path, const char*& content, size_t& len)
+{
+	content = nullptr;
+	len = 0;
+	if( !path )
+	{
+		return "bad file path";
+	}
+#if defined(CPPNOM_WIN32_MMAP)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+	                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if( file == INVALID_HANDLE_VALUE )
+	{
+		return "file open failed";
+	}
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx(file, &size) )
+	{
+		CloseHandle(file);
+		return "file stat failed";
+	}
+	if( size.QuadPart > LONGLONG(size_t(-1) / 2) )
+	{
+		CloseHandle(file);
+		return "file too big";
+	}
+	if( size.QuadPart == 0 )
+	{
+		// Empty files cannot be mapped
+		CloseHandle(file);
+		return nullptr;
+	}
+	// The view keeps the mapping alive once the handles are closed
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0,
+	                                    nullptr);
+	void* p = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if( mapping )
+	{
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+	if( !p )
+	{
+		return "file map failed";
+	}
+	content = reinterpret_cast<const char*>(p);
+	len = size_t(size.QuadPart);
+	return nullptr;
+#elif defined(CPPNOM_POSIX_MMAP)
+	int fd = open(path, O_RDONLY);
+	if( fd < 0 )
+	{
+		return "file open failed";
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 )
+	{
+		close(fd);
+		return "file stat failed";
+	}
+	if( st.st_size > off_t(size_t(-1) / 2) )
+	{
+		close(fd);
+		return "file too big";
+	}
+	if( st.st_size == 0 )
+	{
+		// Empty files cannot be mapped
+		close(fd);
+		return nullptr;
+	}
+	// The mapping stays valid once the file is closed
+	void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if( p == MAP_FAILED )
+	{
+		return "file map failed";
+	}
+	// The parsing reads the content once from the beginning
+	posix_madvise(p, size_t(st.st_size), POSIX_MADV_SEQUENTIAL);
+	content = reinterpret_cast<const char*>(p);
+	len = size_t(st.st_size);
+	return nullptr;
+#else
+	return readFile(path, content, len);
+#endif
+}
+
+// Releases the content given by mapFile()
+void unmapFile(const char* content, size_t len)
+{
+	if( !content )
+	{
+		return;
+	}
+#if defined(CPPNOM_WIN32_MMAP)
+	(void)len;
+	UnmapViewOfFile(content);
+#elif defined(CPPNOM_POSIX_MMAP)
+	munmap(const_cast<char*>(content), len);
+#else
+	(void)len;
+	free(const_cast<char*>(content));
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Value of the counter before the increment, the increment is atomic
+int fetchAndIncrement(volatile long* counter)
+{
+#if defined(CPPNOM_WIN32_THREADS)
+	return int(InterlockedIncrement(counter) - 1);
+#elif defined(CPPNOM_POSIX_THREADS)
+	return int(__sync_fetch_and_add(counter, 1L));
+#else
+	return int((*counter)++);
+#endif
+}
+
+// [ret] Number of processors that can run a thread
+int getProcessorCount()
+{
+#if defined(CPPNOM_WIN32_THREADS)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return int(info.dwNumberOfProcessors);
+#elif defined(CPPNOM_POSIX_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? int(count) : 1;
+#else
+	return 1;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// One input of tokenize_batch() in the processing order
+struct BatchItem
+{
+	int len;
+	int index;
+};
+
+// For qsort(), biggest input first
+int compareBatchItems(const void* a, const void* b)
+{
+	const BatchItem& itemA = *reinterpret_cast<const BatchItem*>(a);
+	const BatchItem& itemB = *reinterpret_cast<const BatchItem*>(b);
+	if( itemA.len != itemB.len )
+	{
+		return itemA.len > itemB.len ? -1 : 1;
+	}
+	return itemA.index - itemB.index;
+}
+
+// tokenize_batch() work shared by the threads
+struct BatchJob
+{
+	const Input*     inputs;
+	Result*          results;
+	const BatchItem* items;
+	int              count;
+	int              options;
+	volatile long    cursor;      // Next item to process
+	volatile long    failedCount;
+};
+
+// Tokenizes in the worker arena then copies the tokens so the result owns them
+bool tokenizeBatchInput(const Input& input, int options, Arena& arena,
+                        Result& result)
+{
+	bool ret = tokenize(input.content, input.len, options, arena, result);
+	if( !result.tokens )
+	{
+		return ret;
+	}
+	const Token* tokens = result.tokens;
+	const unsigned char* kinds = result.kinds;
+	result.tokens = nullptr;
+	result.kinds = nullptr;
+	result.owns_tokens = true;
+
+	int count = result.count > 0 ? result.count : 1;
+	Token* tokensCopy = reinterpret_cast<Token*>(malloc(sizeof(Token) * count));
+	unsigned char* kindsCopy = nullptr;
+	if( kinds )
+	{
+		kindsCopy = reinterpret_cast<unsigned char*>(malloc(count));
+	}
+	if( !tokensCopy || (kinds && !kindsCopy) )
+	{
+		free(tokensCopy);
+		free(kindsCopy);
+		result.count = 0;
+		result.error = "token array alloc failed";
+		clearErrorRecord(result.error_record);
+		return false;
+	}
+	memcpy(tokensCopy, tokens, sizeof(Token) * result.count);
+	if( kinds )
+	{
+		memcpy(kindsCopy, kinds, result.count);
+	}
+	result.tokens = tokensCopy;
+	result.kinds = kindsCopy;
+	return ret;
+}
 
-	Context(const char* content, int len)
+// Thread function, also run by the calling thread
+void runBatchJob(void* param)
+{
+	BatchJob& job = *reinterpret_cast<BatchJob*>(param);
+	Arena arena;
+	for(;;)
 	{
-		c = 0;
-		prevC = 0;
-		m_tokenStartAt = -1;
-
-		m_p = content;
-		m_len = len;
-		
-		// Skip utf-8 bom
-		if( m_len >= 3
-		  && (m_p[0] & 0x00ff) == 0xef
-		  && (m_p[1] & 0x00ff) == 0xbb
-		  && (m_p[2] & 0x00ff) == 0xbf )
+		int pos = fetchAndIncrement(&job.cursor);
+		if( pos >= job.count )
 		{
-			m_len -= 3;
-			m_p += 3;
-			m_hasUtf8Bom = true;
+			break;
 		}
-		else
+		int index = job.items[pos].index;
+		if( !tokenizeBatchInput(job.inputs[index], job.options, arena,
+		                        job.results[index]) )
 		{
-			m_hasUtf8Bom = false;
+			fetchAndIncrement(&job.failedCount);
 		}
+	}
+}
 
-		m_index = -1;
-		m_tokenStartAt = 0;
-		m_tokenLineNum = 0;
-		m_lineStartAt = 0;
-		m_lineCounter = 1;
-		m_multi = ML_Single;
+///////////////////////////////////////////////////////////////////////////////
+// A function run by several threads
+struct ThreadTask
+{
+	void (*func)(void*);
+	void* param;
+};
 
-		m_unixNlCount = 0;
-		m_dosNlCount = 0;
-		m_macNlCount = 0;
+#if defined(CPPNOM_WIN32_THREADS)
+DWORD WINAPI threadProc(LPVOID param)
+{
+	const ThreadTask& task = *reinterpret_cast<const ThreadTask*>(param);
+	task.func(task.param);
+	return 0;
+}
+#elif defined(CPPNOM_POSIX_THREADS)
+void* threadProc(void* param)
+{
+	const ThreadTask& task = *reinterpret_cast<const ThreadTask*>(param);
+	task.func(task.param);
+	return nullptr;
+}
+#endif
 
-		m_state = State_NewLine;
-		m_tokenStartAt = 0;
-		m_tokenLineNum = 1;
-		m_insideMacro = false;
-		m_errorLine = 0;
+// Runs func(param) in 'threads' threads, the calling thread being one of them.
+// Returns when all are done. If threads cannot be created, less are used.
+void runInThreads(void (*func)(void*), void* param, int threads)
+{
+	ThreadTask task;
+	task.func = func;
+	task.param = param;
+#if defined(CPPNOM_WIN32_THREADS)
+	HANDLE* handles = nullptr;
+	int handleCount = 0;
+	if( threads > 1 )
+	{
+		handles = reinterpret_cast<HANDLE*>(malloc(sizeof(HANDLE) * threads));
 	}
-
-	// Fetch next char
-	// Here we also do the work of the preprocessor regarding backslash-newlines
-	bool next(State& state)
+	for(int i = 1; handles && i < threads; ++i)
 	{
-		m_index++;
-		prevC = c;
-		
-		// Loop until we found a satisfying character
-		for(;;)
+		HANDLE handle = CreateThread(nullptr, 0, threadProc, &task, 0, nullptr);
+		if( !handle )
 		{
-			if( m_index >= m_len )
-			{
-				if( m_index > m_len )
-				{
-					return false;
-				}
-				// Use 0 to push the last token
-				c = 0;
-				break;
-			}
-			
-			if( !nextLegitChar() )
-			{
-				break;
-			}
+			break;
 		}
-		
-		state = m_state;
-		return true;
+		handles[handleCount++] = handle;
 	}
-
-	// Declares the context as error and fills internal information about the error
-	void error()
+	func(param);
+	for(int i = 0; i < handleCount; ++i)
 	{
-		int lineNum = m_lineCounter;
-		if( c == '\n' )
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+	}
+	free(handles);
+#elif defined(CPPNOM_POSIX_THREADS)
+	pthread_t* handles = nullptr;
+	int handleCount = 0;
+	if( threads > 1 )
+	{
+		handles = reinterpret_cast<pthread_t*>(malloc(sizeof(pthread_t) * threads));
+	}
+	for(int i = 1; handles && i < threads; ++i)
+	{
+		if( pthread_create(&handles[handleCount], nullptr, threadProc, &task) != 0 )
 		{
-			m_lineCounter--;
+			break;
 		}
-		m_errorLine = lineNum;
-		
-		m_error += "state: ";
-		m_error += StringFromState(m_state);
-		m_error += "\n";
+		handleCount++;
+	}
+	func(param);
+	for(int i = 0; i < handleCount; ++i)
+	{
+		pthread_join(handles[i], nullptr);
+	}
+	free(handles);
+#else
+	(void)task;
+	(void)threads;
+	func(param);
+#endif
+}
+
+// [ret] Number of threads to use according to the user request
+int getThreadCount(int threads, int workCount)
+{
+	if( threads <= 0 )
+	{
+		threads = getProcessorCount();
+	}
+	if( threads > workCount )
+	{
+		threads = workCount;
+	}
+	return threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Minimum length of the parts of a content tokenized in parallel
+const int k_minParallelPartLen = 256 * 1024;
+
+// tokenize_parallel() work shared by the threads, one context per part
+struct PartJob
+{
+	Context**     contexts;
+	bool*         oks;
+	int           count;
+	volatile long cursor; // Next part to parse
+};
 
-		char ci = c;
-		if( !isPrintableChar(ci) )
+// Thread function, also run by the calling thread
+void runPartJob(void* param)
+{
+	PartJob& job = *reinterpret_cast<PartJob*>(param);
+	for(;;)
+	{
+		int index = fetchAndIncrement(&job.cursor);
+		if( index >= job.count )
 		{
-			ci = '?';
+			break;
 		}
-		char buf[200];
-		sprintf(buf, "char: '%c' u+%04x\n", ci, c & 0x000000ff);
-		m_error += buf;
+		job.oks[index] = parse(*job.contexts[index]);
+	}
+}
 
-		// Display current line
-		const char* pLine = m_p + m_lineStartAt;
-		int i = m_index;
-		for(; i < m_len; ++i)
+// Finds where a part can begin: after a newline that is not part of a
+// backslash-newline. Whether the newline is inside a comment, a string or a
+// macro is only known once the previous part is parsed.
+// [ret] Position after the newline, -1 if none in [pos, end). The character
+//       at 'end' must be readable.
+int findPartStart(const char* p, int pos, int end)
+{
+	while( pos < end )
+	{
+		const char* pNl = reinterpret_cast<const char*>(
+		    memchr(p + pos, '\n', end - pos));
+		if( !pNl )
 		{
-			if( m_p[i] == '\n' )
-			{
-				break;
-			}
+			break;
 		}
-		int lineLen = i - m_lineStartAt;
-		m_error.append(pLine, lineLen);
-		m_error += "\n";
-		
-		int infoLen = (m_index - m_lineStartAt)+1;
-		char* pInfo = (char*)malloc(infoLen + 1);
-		for(int i = 0; i < infoLen-1; ++i)
+		pos = int(pNl - p);
+		int prev = pos - 1;
+		if( prev >= 0 && p[prev] == '\r' )
 		{
-			if( pLine[i] == '\t' )
-			{
-				pInfo[i] = '\t';
-			}
-			else
-			{
-				pInfo[i] = '~';
-			}
+			prev--;
+		}
+		// A line that starts with an identifier, a directive or a closing
+		// brace is rarely inside a comment, without indentation it is
+		// rarely inside a macro
+		char next = p[pos + 1];
+		if( (prev < 0 || p[prev] != '\\')
+		  && (isIdentifierCharNonDigit(next) || next == '#' || next == '}') )
+		{
+			return pos + 1;
 		}
-		pInfo[infoLen-1] = '^';
-		pInfo[infoLen] = 0;
-		m_error += pInfo;
-		m_error += "\n";
-		free(pInfo);
+		pos++;
 	}
+	return -1;
+}
 
-	void newState(State newState)
+// Gathers the tokens of the parts that were kept in the result. The tokens
+// are appended to the ones of the first part.
+// [ret] false upon allocation failure
+bool stitchParts(Context** contexts, const int* lineOffsets, int count,
+                 Result& result)
+{
+	Context& first = *contexts[0];
+	int unixNlCount = first.m_unixNlCount;
+	int dosNlCount = first.m_dosNlCount;
+	int macNlCount = first.m_macNlCount;
+	for(int i = 1; i < count; ++i)
 	{
-		if( m_state == State_Idle || m_state == State_NewLine )
+		if( !contexts[i] )
 		{
-			newToken();
+			continue;
 		}
-		if( newState == State_Macro )
+		const Context& ctx = *contexts[i];
+		if( !first.m_tokens.append(ctx.m_tokens, lineOffsets[i]) )
 		{
-			m_insideMacro = true;
+			return false;
 		}
-		m_state = newState;
+		unixNlCount += ctx.m_unixNlCount;
+		dosNlCount += ctx.m_dosNlCount;
+		macNlCount += ctx.m_macNlCount;
 	}
 
-	void convertTokenMacro(TokenType& type)
+	first.m_tokens.detach(result.tokens, result.kinds, result.count);
+	result.error = nullptr;
+	result.error_line = 0;
+	clearErrorRecord(result.error_record);
+	result.unix_nl_count = unixNlCount;
+	result.dos_nl_count = dosNlCount;
+	result.mac_nl_count = macNlCount;
+	result.has_utf8_bom = first.m_hasUtf8Bom;
+	result.owns_tokens = true;
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+	return true;
+}
+
+// Splits the content in parts parsed in parallel. A part begins after a
+// newline that is supposed to end all the C++ tokens. This is checked once
+// the previous part is parsed: if wrong, the previous part continues over
+// the next one as the serial parsing would have done.
+// [ret] false if the result could not be built, upon parsing error too.
+//       The result is then not modified.
+bool tokenizeParts(const char* content, int len, int options, int partCount,
+                   Result& result)
+{
+	// Positions are relative to the content after the BOM, as in Context
+	const char* p = content;
+	int contentLen = len;
+	if( startsWithUtf8Bom(content, len) )
 	{
-		if( m_insideMacro )
+		p += 3;
+		contentLen -= 3;
+	}
+
+	int* starts = reinterpret_cast<int*>(malloc(sizeof(int) * (partCount + 1)));
+	int* lineOffsets = reinterpret_cast<int*>(malloc(sizeof(int) * partCount));
+	bool* oks = reinterpret_cast<bool*>(malloc(sizeof(bool) * partCount));
+	Context** contexts = reinterpret_cast<Context**>(
+	    calloc(partCount, sizeof(Context*)));
+	bool ok = starts && lineOffsets && oks && contexts;
+
+	int count = 0;
+	if( ok )
+	{
+		starts[count++] = 0;
+		int partLen = contentLen / partCount;
+		for(int i = 1; i < partCount; ++i)
 		{
-			// Macros are hard to deal with.
-			// Do not parse macro except comments.
-			// Divide symbol is ambiguous and may lead to the identification
-			// of a symbol inside the macro. Cancel that.
-			if( !(type == TT_CommentLine || type == TT_CommentBlock) )
+			int from = partLen * i;
+			if( from < starts[count - 1] )
 			{
-				if( type == TT_Macro )
-				{
-					// End of macro
-					m_insideMacro = false;
-				}
-				else
-				{
-					// Other type of token, make it a dependent macro token
-					type = TT_Macro;
-				}
+				from = starts[count - 1];
+			}
+			// Keep the lookahead of the previous part inside the content
+			int start = findPartStart(p, from, contentLen - 3);
+			if( start < 0 )
+			{
+				break;
 			}
+			starts[count++] = start;
 		}
+		starts[count] = contentLen;
+		ok = count > 1;
 	}
-	
-	// Called by the parsing function to notify the end of one C++ token
-	// [ret] State to do immediately
-	State pushToken(TokenType type, bool wantsCurrentChar = false)
-	{
-		convertTokenMacro(type);
 
-		// Update types in case previous tokens are linked with the one we are
-		// going to push after parsing
-		if( m_multi != ML_Single )
+	bool withKinds = (options & OPT_Kinds) != 0;
+	for(int i = 0; ok && i < count; ++i)
+	{
+		Context* pCtx = new (std::nothrow) Context(content, len);
+		contexts[i] = pCtx;
+		// The first pool receives all the tokens at the end, it is sized
+		// for the whole content so it does not have to move
+		int poolSize = estimatePoolSize(i == 0 ? len : starts[i + 1] - starts[i]);
+		if( !pCtx || !pCtx->m_tokens.init(poolSize, withKinds) )
 		{
-			fixPrevTokenTypes(type);
+			ok = false;
+			break;
 		}
-		
-		pushTokenNoStateChange(type, wantsCurrentChar);
-		m_tokenStartAt = -1;
-
-		if( !m_insideMacro )
+		pCtx->m_skipTypes = getSkipTypes(options);
+		if( i > 0 )
 		{
-			m_state = State_Idle;
-			m_multi = ML_Single;
-			fixMacroTokenMulti();
+			pCtx->startAfterNewLine(starts[i]);
 		}
-		else
+		pCtx->setParseEnd(starts[i + 1], i + 1 == count);
+	}
+
+	if( ok )
+	{
+		PartJob job;
+		job.contexts = contexts;
+		job.oks = oks;
+		job.count = count;
+		job.cursor = 0;
+		runInThreads(runPartJob, &job, count);
+
+		int owner = 0; // Context that parsed the content before part i
+		lineOffsets[0] = 0;
+		for(int i = 1; ok && i < count; ++i)
 		{
-			if( type == TT_CommentBlock || type == TT_Macro )
+			Context& ctx = *contexts[owner];
+			if( !oks[owner] )
 			{
-				// Continue macro parsing
-				m_state = State_Macro;
-				m_multi = ML_Next;
-				m_tokenStartAt = m_index;
-				m_tokenLineNum = m_lineCounter;
-				
-				// The current char was consumed, next token begins after
-				if( wantsCurrentChar )
-				{
-					m_tokenStartAt++;
-				}
+				ok = false;
 			}
-			else if( type == TT_CommentLine )
+			else if( ctx.isAfterNewLine(starts[i]) )
 			{
-				m_insideMacro = false;
-				m_state = State_Idle;
-				m_multi = ML_Single;
-				fixMacroTokenMulti();
+				lineOffsets[i] = lineOffsets[owner] + ctx.m_unixNlCount
+				  + ctx.m_dosNlCount + ctx.m_macNlCount;
+				owner = i;
 			}
 			else
 			{
-				m_state = State_Idle;
+				freeContextMemory(*contexts[i]);
+				delete contexts[i];
+				contexts[i] = nullptr;
+				ctx.setParseEnd(starts[i + 1], i + 1 == count);
+				oks[owner] = parse(ctx);
 			}
 		}
-		return m_state;
+		ok = ok && oks[owner] && stitchParts(contexts, lineOffsets, count, result);
 	}
 
-	// Initialy done for /* */ comments on multiple lines.
-	// If the token type is none it will be set when the final token is pushed
-	void pushTokenMultiline(TokenType type = TT_None)
+	for(int i = 0; contexts && i < count; ++i)
 	{
-		// Push current token though it is uncomplete
-		if( m_multi == ML_Single )
+		if( contexts[i] )
 		{
-			m_multi = ML_First;
+			freeContextMemory(*contexts[i]);
+			delete contexts[i];
 		}
-		else if( m_multi == ML_First )
+	}
+	free(contexts);
+	free(oks);
+	free(lineOffsets);
+	free(starts);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Index of the first token that begins at or after 'pos'
+int findFirstTokenFrom(const Token* tokens, int count, const char* pos)
+{
+	int low = 0;
+	int high = count;
+	while( low < high )
+	{
+		int mid = low + (high - low) / 2;
+		if( tokens[mid].str < pos )
 		{
-			m_multi = ML_Next;
+			low = mid + 1;
 		}
-		pushTokenNoStateChange(type, false);
+		else
+		{
+			high = mid;
+		}
+	}
+	return low;
+}
 
-		// continue parsing the current C++ token
-		newToken();
+// [ret] true if the newline sequence ending at 'nl' follows a backslash-newline
+bool isAfterBackslashNewLine(const char* content, int nl)
+{
+	if( nl > 0 && content[nl] == '\n' && content[nl - 1] == '\r' )
+	{
+		nl--;
+	}
+	int prev = nl - 1;
+	if( prev > 0 && content[prev] == '\n' && content[prev - 1] == '\r' )
+	{
+		prev--;
+	}
+	return prev > 0 && (content[prev] == '\n' || content[prev] == '\r')
+	  && content[prev - 1] == '\\';
+}
 
-		// New tokens will be linked
-		if( m_multi == ML_First )
+// [ret] true if 'pos' follows a newline sequence of content[0, len): a '\n',
+//       or a '\r' that does not begin a "\r\n"
+bool isAfterNewLineSeq(const char* content, int len, int pos)
+{
+	if( pos < 1 )
+	{
+		return false;
+	}
+	char c = content[pos - 1];
+	return c == '\n' || (c == '\r' && (pos >= len || content[pos] != '\n'));
+}
+
+// [ret] Position after the first newline sequence from 'pos', 'len' if there
+//       is none
+int findLineEnd(const char* content, int len, int pos)
+{
+	for(; pos < len; ++pos)
+	{
+		if( content[pos] == '\n' )
 		{
-			m_multi = ML_Next;
+			return pos + 1;
 		}
+		if( content[pos] == '\r' )
+		{
+			return pos + 1 < len && content[pos + 1] == '\n' ? pos + 2 : pos + 1;
+		}
+	}
+	return len;
+}
+
+// Checks that the parsing that gave the result was after a newline ending
+// all the C++ tokens when it reached 'pos', as startAfterNewLine(pos) gives:
+// the newline is not a backslash-newline and the token beginning the line
+// does not continue a previous one. The beginning of the content, after the
+// BOM, is a clean line start too.
+// [in]  len    Size of the content.
+// [out] index  Index of the token beginning the line. The TT_EmptyLine token
+//              of an empty line points on the newline before.
+bool isCleanLineStart(const char* content, int len, const Result& result,
+                      int pos, int& index)
+{
+	if( pos == (result.has_utf8_bom ? 3 : 0) )
+	{
+		index = 0;
+		return result.count > 0;
+	}
+	if( !isAfterNewLineSeq(content, len, pos) )
+	{
+		return false;
+	}
+	int prev = pos - 2;
+	if( content[pos - 1] == '\n' && prev >= 0 && content[prev] == '\r' )
+	{
+		prev--;
+	}
+	if( prev >= 0 && content[prev] == '\\' )
+	{
+		return false;
+	}
+	index = findFirstTokenFrom(result.tokens, result.count, content + pos - 1);
+	if( index >= result.count )
+	{
+		return false;
 	}
-	
-	// For operators and punctuators
-	const char* getTokenStr() const
+	const Token& tok = result.tokens[index];
+	if( tok.str == content + pos - 1 )
 	{
-		if( m_tokenStartAt < 0 )
-		{
-			return nullptr;
-		}
-		return m_p + m_tokenStartAt;
+		// The one of the first line points on the newline that ends it, and
+		// so does the one of a line after a backslash-newline
+		return tok.type == TT_EmptyLine && tok.multi == ML_Single
+		  && tok.line > 1 && !isAfterBackslashNewLine(content, pos - 1);
 	}
+	return tok.str == content + pos && tok.multi != ML_Next;
+}
 
-	// For operators and punctuators
-	int getTokenLen() const
+// Removes from the result counts the newlines of p[begin, end), as counted
+// by Context::nextLegitChar()
+void uncountNewLines(const char* p, int begin, int end, Result& result)
+{
+	for(int i = begin; i < end; ++i)
 	{
-		if( m_tokenStartAt < 0 )
+		if( p[i] == '\n' )
 		{
-			return 0;
+			result.unix_nl_count--;
+		}
+		else if( p[i] == '\r' )
+		{
+			if( i + 1 < end && p[i + 1] == '\n' )
+			{
+				result.dos_nl_count--;
+				i++;
+			}
+			else
+			{
+				result.mac_nl_count--;
+			}
 		}
-		return (m_index - m_tokenStartAt) + 1;
 	}
-	
-	int getErrorLine() const
+}
+
+// [ret] Options of the tokens of a Patch, the same for the incremental parsing
+//       and for the whole content: the kinds if the old result has them. The
+//       brackets and the directives are found by apply_patch().
+int getPatchOptions(const Result& old)
+{
+	return old.kinds ? OPT_Kinds : 0;
+}
+
+// Tokenizes the new content from 'start', a clean line start of the old
+// content before the edit, until the parsing is at a clean line start of
+// the old content again.
+// [in] first    Index of the old token beginning at 'start'
+// [in] options  See getPatchOptions()
+bool retokenizeFrom(const char* oldContent, const Result& old,
+                    const char* content, int len, const Edit& edit,
+                    int start, int first, int options, Patch& patch)
+{
+	Context ctx(content, len);
+	Result& result = patch.result;
+	result.unix_nl_count = 0;
+	result.dos_nl_count = 0;
+	result.mac_nl_count = 0;
+	if( !ctx.m_tokens.init(k_streamPoolSize, (options & OPT_Kinds) != 0) )
 	{
-		return m_errorLine;
+		result.has_utf8_bom = false;
+		errorToResult("token pool alloc failed", result);
+		return false;
 	}
 
-private:
-	State m_state;
-
-	const char* m_p;         // File content buffer
-	int   m_len;             // File length
-	int   m_index;           // Position of the current char
-	
-	int   m_tokenStartAt;    // Position of the first char of the token
-	int   m_tokenLineNum;    // Line index when the token was started
-	int   m_lineStartAt;     // Position of the current line, for error reporting
-	int   m_lineCounter;     // Current line number, 1-based
-	Multi m_multi;           // C++ token split?
-	bool  m_insideMacro;     // Macro contains tokens too
-	int   m_errorLine;       // Filled on error()
+	// Positions are relative to the contents, the context ones are after
+	// the BOM. The edit being after the BOM, both contents have it or not.
+	int bom = ctx.m_hasUtf8Bom ? 3 : 0;
+	int startLine = old.tokens[first].line;
+	if( start > bom )
+	{
+		ctx.startAfterNewLine(start - bom, startLine);
+	}
 
-private:
-	// Try to merge the new token with the previous token if they are both
-	// of macro type
-	// [ret] true if merge done
-	bool tryToMergeMacro(int tokLen)
+	int shift = edit.inserted_len - edit.removed_len;
+	int oldLen = len - shift;
+	int next = old.count; // First old token kept after the new ones
+	int oldEnd = oldLen;  // Old position where the parsing stopped
+	int pos = edit.offset + edit.inserted_len;
+	bool ok = true;
+	for(;;)
 	{
-		Token* pPrev = m_tokens.getPrev(nullptr);
-		if( !(pPrev && pPrev->type == TT_Macro) )
+		// Stop at each newline after the edit and compare the parsing state
+		// with the old one
+		pos = findLineEnd(content, len, pos);
+		if( pos + 2 > len )
 		{
-			return false;
+			// Keep the lookahead inside the content, parse up to the end
+			ctx.setParseEnd(len - bom, true);
+			ok = parse(ctx);
+			break;
 		}
-
-		if( (pPrev->multi == ML_First || pPrev->multi == ML_Next)
-		        && m_multi == ML_Next )
+		ctx.setParseEnd(pos - bom, false);
+		ok = parse(ctx);
+		if( !ok )
 		{
-			pPrev->len += tokLen;
-			return true;
+			break;
 		}
-		return false;
-	}
-	
-	// Maybe after merging we do not need a multi token anymore
-	// Call this function when the C++ macro ends
-	void fixMacroTokenMulti()
-	{
-		Token* pPrev = m_tokens.getPrev(nullptr);
-		if( !(pPrev && pPrev->type == TT_Macro) )
+		int index;
+		if( ctx.isAfterNewLine(pos - bom)
+		  && isCleanLineStart(oldContent, oldLen, old, pos - shift, index) )
 		{
-			return;
+			next = index;
+			oldEnd = pos - shift;
+			int line = startLine + ctx.m_unixNlCount + ctx.m_dosNlCount
+			  + ctx.m_macNlCount;
+			patch.line_delta = line - old.tokens[index].line;
+			break;
 		}
+	}
 
-		if( pPrev->multi == ML_First )
-		{
-			// Indeed
-			pPrev->multi = ML_Single;
-		}
+	patch.removed_count = next - first;
+	result.unix_nl_count = old.unix_nl_count + ctx.m_unixNlCount;
+	result.dos_nl_count = old.dos_nl_count + ctx.m_dosNlCount;
+	result.mac_nl_count = old.mac_nl_count + ctx.m_macNlCount;
+	uncountNewLines(oldContent, start, oldEnd, result);
+	result.has_utf8_bom = ctx.m_hasUtf8Bom;
+	result.error = ctx.m_error;
+	result.error_line = ctx.getErrorLine();
+	ctx.getErrorRecord(result.error_record);
+	ctx.m_tokens.detach(result.tokens, result.kinds, result.count);
+	result.owns_tokens = true;
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// [ret] Newline sequence the most used in the content, see rebuild()
+const char* getNewLine(const Result& result, int& nlLen)
+{
+	if( result.dos_nl_count > result.unix_nl_count
+	  && result.dos_nl_count >= result.mac_nl_count )
+	{
+		nlLen = 2;
+		return "\r\n";
+	}
+	if( result.mac_nl_count > result.unix_nl_count
+	  && result.mac_nl_count > result.dos_nl_count )
+	{
+		nlLen = 1;
+		return "\r";
 	}
+	nlLen = 1;
+	return "\n";
+}
 
-	void fixPrevTokenTypes(TokenType type)
+// [ret] true if 'p' starts with 'count' times the newline sequence
+bool isNewLineRun(const char* p, int count, const char* nl, int nlLen)
+{
+	for(int i = 0; i < count; ++i)
 	{
-		Token* pTok = nullptr;
-		for(;;)
+		for(int j = 0; j < nlLen; ++j)
 		{
-			pTok = m_tokens.getPrev(pTok);
-			if( !pTok )
-			{
-				break;
-			}
-			if( pTok->multi == ML_Single )
+			if( *p++ != nl[j] )
 			{
-				break;
-			}
-			if( pTok->type == TT_None )
-			{
-				pTok->type = type;
+				return false;
 			}
 		}
 	}
+	return true;
+}
 
-	// Helper function for next()
-	// [ret] true to continue looping
-	bool nextLegitChar()
+// Gives the rebuilt content to a writer, which has a method
+// write(const char* data, size_t len)
+template<typename Writer>
+void rebuildContent(const Result& result, Writer& writer)
+{
+	int nlLen;
+	const char* nl = getNewLine(result, nlLen);
+	if( result.has_utf8_bom )
 	{
-		if( c == '\n' )
-		{
-			m_lineStartAt = m_index;
-		}
-		c = m_p[m_index];
-		
-		// We do not expose \r, only return \n to make things simplier
-		if( c == '\n' )
+		writer.write("\xef\xbb\xbf", 3);
+	}
+
+	// Span of the content not written yet
+	const char* spanStart = nullptr;
+	const char* spanEnd = nullptr;
+	int line = 1;
+	for(int i = 0; i < result.count; ++i)
+	{
+		const Token& tok = result.tokens[i];
+		int nlCount = tok.line - line;
+		line = tok.line;
+		if( spanStart && tok.str >= spanEnd
+		  && tok.str - spanEnd == Pos(nlCount) * nlLen
+		  && isNewLineRun(spanEnd, nlCount, nl, nlLen) )
 		{
-			m_lineCounter++;
-			m_unixNlCount++;
+			// What is between the tokens is what would be written
+			spanEnd = tok.str + tok.len;
+			continue;
 		}
-		else if( c == '\r' )
+		if( spanStart )
 		{
-			if( m_p[m_index+1] == '\n' )
-			{
-				// Yes, DOS newline
-				m_index++;
-				
-				c = '\n';
-				m_lineCounter++;
-				m_dosNlCount++;
-			}
-			else
-			{
-				// Old Mac style newline
-				c = '\n';
-				m_lineCounter++;
-				m_macNlCount++;
-			}
+			writer.write(spanStart, size_t(spanEnd - spanStart));
 		}
-		else if( c == '\\' )
+		for(; nlCount > 0; --nlCount)
 		{
-			// We do not expose backslash+newline neither
-			char nextC = m_p[m_index+1];
-			if( nextC == '\r' || nextC == '\n' )
-			{
-				// If the statement is split across multiple lines, it means
-				// we have several tokens for one statement.
-				// The first token will have its linked member set to false,
-				// and the following ones will have their linked member set to true.
-				
-				// Push current token though it is uncomplete
-				// If the state is Idle, it means no token parsing was occurring
-				if( m_state != State_Idle )
-				{
-					pushTokenMultiline();
-				}
-				else
-				{
-					m_state = State_NewLine;
-				}
-				
-				// Push a new token for the backslash
-				Token* pTok = m_tokens.alloc();
-				pTok->type = TT_BackslashNewline;
-				pTok->line = m_lineCounter;
-				pTok->str = m_p+m_index;
-				pTok->len = 1;
-				pTok->multi = m_multi;
-				
-				char nextNextC = m_p[m_index+2];
-				if( nextC == '\r' )
-				{
-					if( nextNextC == '\n' )
-					{
-						// Skip 3 characters
-						m_dosNlCount++;
-						m_index += 3;
-					}
-					else
-					{
-						// Skip 2 only
-						m_macNlCount++;
-						m_index += 2;
-					}
-				}
-				else
-				{
-					// Skip just 2
-					m_unixNlCount++;
-					m_index += 2;
-				}
-				
-				m_lineStartAt = m_index;
-				m_lineCounter++;
-	
-				// continue parsing
-				newToken();
-				return true;
-			}
+			writer.write(nl, size_t(nlLen));
 		}
-		return false;
+		spanStart = tok.str;
+		spanEnd = tok.str + tok.len;
 	}
-	
-	void newToken()
+	if( spanStart )
 	{
-		m_tokenStartAt = m_index;
-		m_tokenLineNum = m_lineCounter;
+		writer.write(spanStart, size_t(spanEnd - spanStart));
 	}
+}
 
-	// Push current token without changing m_state
-	void pushTokenNoStateChange(TokenType type, bool wantsCurrentChar)
+// rebuild() writer to a memory buffer
+class MemoryWriter
+{
+public:
+	MemoryWriter(char* out, size_t cap) : m_out(out), m_cap(cap), m_size(0) {}
+
+	void write(const char* data, size_t len)
 	{
-		assert(m_tokenStartAt >= 0);
-		const char* tokStr = m_p + m_tokenStartAt;
-		int tokLen = (m_index - m_tokenStartAt) + 1;
-		
-		// Include current character for tokens that have an end tag
-		// TT_CommentBlock
-		// TT_StringLiteral
-		// TT_CharacterLiteral
-		// Unambigous TT_Operator
-		// Unambigous TT_Integer
+		if( m_size < m_cap )
+		{
+			size_t room = m_cap - m_size;
+			memcpy(m_out + m_size, data, len < room ? len : room);
+		}
+		m_size += len;
+	}
 
-		if( !wantsCurrentChar )
+	size_t getSize() const { return m_size; }
+
+private:
+	char*  m_out;
+	size_t m_cap;
+	size_t m_size;
+};
+
+// rebuild_with() writer to a WriteFunc
+class CallbackWriter
+{
+public:
+	CallbackWriter(WriteFunc func, void* param)
+	  : m_func(func), m_param(param), m_used(0), m_ok(true) {}
+
+	void write(const char* data, size_t len)
+	{
+		if( len >= k_directLen )
 		{
-			tokLen--;
-		};
-		
-		trimTokenRight(tokStr, tokLen);
-		trimTokenLeft(tokStr, tokLen);
-		
-		if( type == TT_Macro )
+			// The piece is given without being copied
+			flush();
+			m_ok = m_ok && m_func(m_param, data, len);
+			return;
+		}
+		if( m_used + len > sizeof(m_buf) )
 		{
-			if( tokLen == 0 )
-			{
-				// In case of comment inside a macro and a macro parsing
-				// restart, an empty token may be generated.
-				// We do not want to store that empty token.
-				return;
-			}
-			if( tryToMergeMacro(tokLen) )
+			flush();
+		}
+		memcpy(m_buf + m_used, data, len);
+		m_used += len;
+	}
+
+	// [ret] false if the callback stopped the rebuild
+	bool flush()
+	{
+		if( m_used > 0 )
+		{
+			m_ok = m_ok && m_func(m_param, m_buf, m_used);
+			m_used = 0;
+		}
+		return m_ok;
+	}
+
+private:
+	// Shorter pieces are gathered in the buffer
+	static const size_t k_directLen = 4096;
+
+	WriteFunc m_func;
+	void*     m_param;
+	char      m_buf[4 * k_directLen];
+	size_t    m_used;
+	bool      m_ok;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Skips the newline sequences of a content part
+// [out] nlCount  Number of newline sequences skipped
+// [ret] First character that is not part of a newline, 'end' if none
+const char* skipNewLines(const char* p, const char* end, int& nlCount)
+{
+	nlCount = 0;
+	for(; p < end; ++p)
+	{
+		if( *p == '\r' )
+		{
+			if( p + 1 < end && p[1] == '\n' )
 			{
-				return;
+				++p;
 			}
 		}
-		
-		if( type == TT_Identifier && isKeyword(tokStr, tokLen) )
+		else if( *p != '\n' )
 		{
-			type = TT_Keyword;
+			break;
 		}
-
-		Token* pTok = m_tokens.alloc();
-		pTok->type = type;
-		pTok->str = tokStr;
-		pTok->len = tokLen;
-		pTok->line = m_tokenLineNum;
-		pTok->multi = m_multi;
+		nlCount++;
 	}
-};
+	return p;
+}
 
-///////////////////////////////////////////////////////////////////////////////
-bool isDigit(char c)
+// [ret] true if a token ends in the middle of a U+000D,U+000A sequence
+inline bool isSplitNewLine(const char* content, const char* p,
+                           const char* end)
 {
-	return ('0' <= c && c <= '9');
+	return p > content && p < end && p[-1] == '\r' && *p == '\n';
 }
 
-bool isOctDigit(char c)
+// Fills a Divergence, see verify_roundtrip()
+// [ret] false
+bool diverge(Divergence* divergence, const char* reason, size_t offset,
+             int line, int token)
 {
-	return ('0' <= c && c <= '7');
+	if( divergence )
+	{
+		divergence->reason = reason;
+		divergence->offset = offset;
+		divergence->line = line;
+		divergence->token = token;
+	}
+	return false;
 }
 
-bool isHexDigit(char c)
+///////////////////////////////////////////////////////////////////////////////
+// Identifies a cache, the value read differs with another byte order
+const unsigned int k_cacheMagic = 0x636e7063; // "cpnc"
+
+// Changes when the layout of the caches changes
+const unsigned int k_cacheFormat = 1;
+
+// Flags of CacheHeader::flags
+const unsigned int k_cacheUtf8Bom = 0x01;
+
+// Last value of TokenType, to check the cached types
+const int k_lastTokenType = TT_FloatingLiteral;
+
+// Start of a cache, see save_cache(). Followed by the arrays of the
+// CompactResult: offsets, lens and line_firsts of 4 bytes each, then types,
+// multis and kinds of 1 byte each, so every array is aligned.
+struct CacheHeader
 {
-	return isDigit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
-}
+	unsigned int       magic;
+	unsigned int       format;
+	unsigned int       version; // CPPNOM_VERSION
+	unsigned int       options;
+	unsigned long long hash;    // See content_hash()
+	unsigned long long len;     // Length of the content
+	unsigned int       count;
+	unsigned int       lineCount;
+	unsigned int       unixNlCount;
+	unsigned int       dosNlCount;
+	unsigned int       macNlCount;
+	unsigned int       flags;
+};
 
-bool isIdentifierCharNonDigit(char c)
+// [ret] Size in bytes of a cache
+unsigned long long getCacheSize(unsigned int count, unsigned int lineCount,
+                                bool withKinds)
 {
-	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || (c == '_');
+	unsigned long long n = count;
+	return sizeof(CacheHeader) + n * (4 + 4 + 1 + 1 + (withKinds ? 1 : 0))
+	  + 4ULL * lineCount;
 }
 
-bool isIdentifierChar(char c)
+// [ret] Hash of a content. Reads 8 bytes at a time: hashing has to be much
+//       faster than parsing for a cache to be worth it.
+unsigned long long hashContent(const char* content, size_t len)
 {
-	return isIdentifierCharNonDigit(c) || isDigit(c);
+	const unsigned long long k_mul = 0x9e3779b97f4a7c15ULL;
+	unsigned long long h = len ^ 0x243f6a8885a308d3ULL;
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, content + i, 8);
+		h = (h ^ word) * k_mul;
+		h ^= h >> 32;
+	}
+	unsigned long long word = 0;
+	memcpy(&word, content + i, len - i);
+	h = (h ^ word) * k_mul;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h;
 }
 
-// Check if a string is exactly or only partially equal to another
-enum SERet { SER_NotEqual, SER_Maybe, SER_Equal };
-
-inline SERet strEquals(const char* psz, const char* pRight, int rightLen)
+///////////////////////////////////////////////////////////////////////////////
+// Makes the arrays of 'result' point in the cache
+// [in] hash  Hash of the content, null to compute it once the header is
+//            known to match
+// [ret] Error message, null upon success
+const char* openCache(const void* data, size_t size, const char* content,
+                      size_t len, int options, const unsigned long long* hash,
+                      CompactResult& result)
 {
-	for(int j = 0; j < rightLen; ++j)
+	CacheHeader header;
+	if( !data || size < sizeof(header) || (size_t(data) & 3) != 0 )
 	{
-		if( psz[j] != pRight[j])
-		{
-			return SER_NotEqual;
-		}
+		return "bad cache";
 	}
-	if( psz[rightLen] != 0 )
+	memcpy(&header, data, sizeof(header));
+	if( header.magic != k_cacheMagic || header.format != k_cacheFormat
+	  || header.version != CPPNOM_VERSION )
 	{
-		return SER_Maybe;
+		return "cache of another version";
+	}
+	if( header.options != unsigned(options) )
+	{
+		return "cache of other options";
+	}
+	if( !content || header.len != len
+	  || header.hash != (hash ? *hash : hashContent(content, len)) )
+	{
+		return "cache of another content";
+	}
+	bool withKinds = (options & OPT_Kinds) != 0;
+	if( header.count > unsigned(k_maxPoolSize)
+	  || header.lineCount > 0x7fffffffu
+	  || getCacheSize(header.count, header.lineCount, withKinds) != size )
+	{
+		return "bad cache";
 	}
-	return SER_Equal;
-}
 
-// Checks if a string appears in an array of strings.
-// SER_Equal:    If the string appears exactly once
-// SER_Maybe:    The string appears several times
-// SER_NotEqual: The string cannot be one of the strings in the array
-SERet isOneOfThose(const char* pCandidate, int candidateLen,
-                   const char*const* those, int count)
-{
-	int maybeCount = 0;
-	int equalCount = 0;
+	int count = int(header.count);
+	int lineCount = int(header.lineCount);
+	const char* p = reinterpret_cast<const char*>(data) + sizeof(header);
+	const unsigned int* offsets = reinterpret_cast<const unsigned int*>(p);
+	const unsigned int* lens = offsets + count;
+	const int* lineFirsts = reinterpret_cast<const int*>(lens + count);
+	const unsigned char* types =
+	  reinterpret_cast<const unsigned char*>(lineFirsts + lineCount);
+	const unsigned char* multis = types + count;
+
+	// The tokens follow each other inside the content
+	unsigned long long end = 0;
 	for(int i = 0; i < count; ++i)
 	{
-		SERet eq = strEquals(those[i], pCandidate, candidateLen);
-		if( eq == SER_Maybe )
-		{
-			maybeCount++;
-		}
-		else if( eq == SER_Equal )
+		if( offsets[i] < end || lens[i] > 0x7fffffffu
+		  || types[i] == TT_None || types[i] > k_lastTokenType
+		  || multis[i] > ML_Next )
 		{
-			equalCount++;
+			return "bad cache";
 		}
+		end = (unsigned long long)offsets[i] + lens[i];
 	}
-	if( maybeCount == 0 && equalCount == 0 )
+	if( end > len )
 	{
-		return SER_NotEqual;
+		return "bad cache";
 	}
-	if( maybeCount > 0 || equalCount > 1 )
+	int prevFirst = 0;
+	for(int i = 0; i < lineCount; ++i)
 	{
-		return SER_Maybe; // Multiple possibilities
+		if( lineFirsts[i] < prevFirst || lineFirsts[i] > count )
+		{
+			return "bad cache";
+		}
+		prevFirst = lineFirsts[i];
 	}
-	return SER_Equal;
-}
 
-static const char* const k_ops[] = {
-	"{", "}", "[", "]", "#", "##", "(", ")",
-	"<:", ":>", "<%", "%>", "%:", "%:%:", ";", ":", "...",
-	"?", "::", ".", ".*",
-	"+", "-", "*", "/", "%", "^", "&", "|", "~",
-	"!", "=", "<", ">", "+=", "-=", "*=", "/=", "%=",
-	"ˆ=", "&=", "|=", "<<", ">>", ">>=", "<<=", "==", "!=",
-	"<=", ">=", "&&", "||", "++", "--", ",", "->*", "->"
-};
-
-SERet checkOperatorOrPunctuator(const char* pCandidate, int candidateLen)
-{
-	return isOneOfThose(pCandidate, candidateLen, k_ops, ARRAY_COUNT(k_ops));
+	result.types = types;
+	result.multis = multis;
+	result.offsets = offsets;
+	result.lens = lens;
+	result.kinds = withKinds ? multis + count : nullptr;
+	result.count = count;
+	result.line_firsts = lineFirsts;
+	result.line_count = lineCount;
+	result.unix_nl_count = int(header.unixNlCount);
+	result.dos_nl_count = int(header.dosNlCount);
+	result.mac_nl_count = int(header.macNlCount);
+	result.has_utf8_bom = (header.flags & k_cacheUtf8Bom) != 0;
+	return nullptr;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_NoSpace(Context& ctx)
+// Fills a Result from a cache, as tokenize() would have done
+// [in] hash  See openCache()
+bool loadCache(const void* data, size_t size, const char* content, size_t len,
+               int options, const unsigned long long* hash, Result& result)
 {
-	char c = ctx.c;
-	if( c == 'L' || c == 'u' || c == 'U' )
-	{
-		ctx.newState(State_IdentifierOrLiteral);
-	}
-	else if( isIdentifierCharNonDigit(c) )
+	CompactResult cache;
+	const char* err = openCache(data, size, content, len, options, hash,
+	                            cache);
+	if( err )
 	{
-		ctx.newState(State_Identifier);
+		errorToEmptyResult(err, result);
+		return false;
 	}
-	else if( c == '"' )
+	int count = cache.count;
+	Token* tokens = reinterpret_cast<Token*>(
+	  malloc(sizeof(Token) * (count > 0 ? count : 1)));
+	unsigned char* kinds = nullptr;
+	if( cache.kinds )
 	{
-		ctx.newState(State_StringLiteral);
+		kinds = reinterpret_cast<unsigned char*>(malloc(count > 0 ? count : 1));
 	}
-	else if( c == '#' )
+	if( !tokens || (cache.kinds && !kinds) )
 	{
-		ctx.newState(State_Macro);
+		free(tokens);
+		free(kinds);
+		errorToEmptyResult("token pool alloc failed", result);
+		return false;
 	}
-	else if( c == '/' )
+
+	int line = 0; // Lines whose first token is not after the token
+	for(int i = 0; i < count; ++i)
 	{
-		ctx.newState(State_CommentOrOperator);
+		while( line < cache.line_count && cache.line_firsts[line] <= i )
+		{
+			line++;
+		}
+		Token& tok = tokens[i];
+		tok.type = TokenType(cache.types[i]);
+		tok.line = line;
+		tok.str = content + cache.offsets[i];
+		tok.len = int(cache.lens[i]);
+		tok.multi = Multi(cache.multis[i]);
 	}
-	else if( c == '\'' )
+	if( kinds )
 	{
-		ctx.newState(State_CharacterLiteral);
+		memcpy(kinds, cache.kinds, size_t(count));
 	}
-	else if( c == '0' )
+
+	result.tokens = tokens;
+	result.count = count;
+	result.kinds = kinds;
+	result.error = nullptr;
+	result.error_line = 0;
+	clearErrorRecord(result.error_record);
+	result.unix_nl_count = cache.unix_nl_count;
+	result.dos_nl_count = cache.dos_nl_count;
+	result.mac_nl_count = cache.mac_nl_count;
+	result.has_utf8_bom = cache.has_utf8_bom;
+	result.owns_tokens = true;
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+	if( !fillTokenIndexes(result, options) )
 	{
-		ctx.newState(State_OctOrHexLiteral);
+		return false;
 	}
-	else if( isDigit(c) )
+	if( options & OPT_LineIndex )
 	{
-		ctx.newState(State_DecLiteral);
+		return fillLineIndex(content, Pos(len), result);
 	}
-	else if( c == '\n' )
+	return true;
+}
+
+// [ret] Path of a file of the cache directory, to be freed with free()
+// [in]  suffix  Appended to the name, before the extension
+char* makeCachePath(const char* dir, unsigned long long hash, int options,
+                    const char* suffix)
+{
+	size_t size = strlen(dir) + strlen(suffix) + 40;
+	char* path = reinterpret_cast<char*>(malloc(size));
+	if( path )
 	{
-		ctx.newState(State_NewLine);
+		snprintf(path, size, "%s/%08x%08x-%x%s.cnc", dir,
+		         unsigned(hash >> 32), unsigned(hash), unsigned(options),
+		         suffix);
 	}
-	else if( c == 0 )
+	return path;
+}
+
+// Writes a cache file for tokenize_cached(). The file is written under a
+// temporary name then renamed, so a reader never sees a partial cache.
+void writeCacheFile(const char* dir, unsigned long long hash, int options,
+                    const Result& result, const char* content, size_t len)
+{
+	size_t size = save_cache(result, content, len, options, nullptr, 0);
+	if( size == 0 )
 	{
-		// End of file
+		return;
 	}
-	else
+	void* buf = malloc(size);
+	static volatile long s_tempCounter = 0;
+	char suffix[32];
+#if defined(_WIN32)
+	int pid = int(GetCurrentProcessId());
+#else
+	int pid = int(getpid());
+#endif
+	snprintf(suffix, sizeof(suffix), ".%d-%d.tmp", pid,
+	         fetchAndIncrement(&s_tempCounter));
+	char* path = makeCachePath(dir, hash, options, "");
+	char* tempPath = makeCachePath(dir, hash, options, suffix);
+	if( buf && path && tempPath )
 	{
-		// Special case for operators because they can be one char long only
-		SERet ser = checkOperatorOrPunctuator(&c, 1);
-		if( ser == SER_Maybe )
-		{
-			ctx.newState(State_OperatorOrPunctuator);
-		}
-		else if( ser == SER_Equal )
-		{
-			ctx.newState(State_OperatorOrPunctuator);
-			ctx.pushToken(TT_OperatorOrPunctuator, true);
-		}
-		else
+		save_cache(result, content, len, options, buf, size);
+		FILE* pf = fopen(tempPath, "wb");
+		if( pf )
 		{
-			ctx.error();
-			return false;
+			bool ok = fwrite(buf, 1, size, pf) == size;
+			ok = (fclose(pf) == 0) && ok;
+			// Another writer may have renamed the same cache first
+			if( !ok || rename(tempPath, path) != 0 )
+			{
+				remove(tempPath);
+			}
 		}
 	}
-	return true;
+	free(tempPath);
+	free(path);
+	free(buf);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_Idle(Context& ctx)
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////
+bool tokenize(const char* content, int len, int options, Result& result)
 {
-	char c = ctx.c;
-	if( c == ' ' || c == '\t' || c == '\f' )
+	return tokenizeContent(content, len, options, result);
+}
+
+#if defined(CPPNOM_STATS)
+///////////////////////////////////////////////////////////////////////////////
+bool tokenize_with_stats(const char* content, int len, int options,
+                         Result& result, Stats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.state_count = State_NewLine + 1;
+	for(int i = 0; i < stats.state_count; ++i)
 	{
-		ctx.newState(State_Space);
+		stats.state_names[i] = StringFromState(State(i));
 	}
-	else
+
+	Context ctx(content, len);
+	ctx.m_stats = &stats;
+	bool ret = tokenizeContent(ctx, content, len, options, result);
+	ctx.m_tokens.getStats(stats);
+	for(int i = 0; i < result.count; ++i)
 	{
-		// A new token begins
-		return doState_NoSpace(ctx);
+		const Token& tok = result.tokens[i];
+		stats.type_counts[tok.type]++;
+		if( tok.multi == ML_First )
+		{
+			stats.first_count++;
+		}
 	}
-	return true;
+	return ret;
 }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_Space(Context& ctx)
+bool tokenize_large(const char* content, size_t len, int options,
+                    Result& result)
 {
-	char c = ctx.c;
-	if( c == ' ' || c == '\t' || c == '\f' )
+	if( len > size_t(-1) / 2 )
 	{
-		// Continue
+		// Would be negative as a Pos
+		errorToEmptyResult("bad content len", result);
+		return false;
 	}
-	else
+	return tokenizeContent(content, Pos(len), options, result);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool tokenize_file(const char* path, int options, Result& result)
+{
+	const char* content;
+	size_t len;
+	const char* err = mapFile(path, content, len);
+	if( err )
 	{
-		// Push token
-		ctx.pushToken(TT_Space);
-		return doState_NoSpace(ctx);
+		errorToEmptyResult(err, result);
+		return false;
 	}
-	return true;
+
+	// Even upon error some tokens point on the content
+	bool ret = tokenizeContent(content ? content : "", Pos(len), options,
+	                           result);
+	result.file_content = content;
+	result.file_len = len;
+	return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_NewLine(Context& ctx)
+bool tokenize(const char* content, int len, int options, Arena& arena,
+              Result& result)
 {
-	char c = ctx.c;
-	if( c == '\n' || c == 0 )
+	Context ctx(content, len);
+	if( !checkArgs(content, len, options, result) )
+	{
+		return false;
+	}
+
+	// The pool may move when growing, the arena gets it back in any case
+	bool withKinds = (options & OPT_Kinds) != 0;
+	if( !ctx.m_tokens.init(arena.m_pool, arena.m_kinds, arena.m_size,
+	                       estimatePoolSize(len), withKinds) )
+	{
+		ctx.m_tokens.lend(result.tokens, result.kinds, result.count,
+		                  arena.m_pool, arena.m_kinds, arena.m_size);
+		errorToResult("token pool alloc failed", result);
+		return false;
+	}
+	ctx.m_skipTypes = getSkipTypes(options);
+	ctx.m_matchBrackets = (options & OPT_MatchBrackets) != 0;
+	ctx.m_findDirectives = (options & OPT_Directives) != 0;
+
+	bool ret = run(ctx, result);
+	ctx.m_tokens.lend(result.tokens, result.kinds, result.count,
+	                  arena.m_pool, arena.m_kinds, arena.m_size);
+	result.owns_tokens = false;
+	if( ret && (options & OPT_LineIndex) )
 	{
-		ctx.pushToken(TT_EmptyLine);
+		ret = fillLineIndex(content, len, result);
 	}
-	return doState_Idle(ctx);
+	return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_Identifier(Context& ctx)
+Arena::Arena()
 {
-	char c = ctx.c;
-	if( isIdentifierChar(c) )
+	m_pool = nullptr;
+	m_kinds = nullptr;
+	m_size = 0;
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void Arena::release()
+{
+	free(m_pool);
+	free(m_kinds);
+	m_pool = nullptr;
+	m_kinds = nullptr;
+	m_size = 0;
+}
+
+int Arena::capacity() const
+{
+	return m_size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The content is copied in a buffer. Before appending a chunk, the tokens
+// already given by next() are dropped, as well as the characters that are
+// not referenced anymore, so the memory stays proportional to the longest
+// C++ token rather than to the content.
+// With attach(), there is no copy and next() parses only up to the token it
+// gives, the tokens already given are dropped the same way.
+struct Tokenizer::Impl
+{
+	Context m_ctx;
+	char*   m_buf;       // Content, followed by two 0 characters
+	int     m_used;      // Number of content characters in m_buf
+	int     m_size;      // Capacity of m_buf, without the two 0 characters
+	int     m_readIndex; // Next token given by next()
+	int     m_kind;      // Kind of the token last given by next()
+	bool    m_started;   // The UTF-8 BOM detection is done
+	bool    m_finished;  // finish() was called
+	bool    m_failed;
+	bool    m_lazy;      // attach() was called
+	char*   m_errorText; // Built by error() upon failure
+
+	explicit Impl(int options) : m_ctx(nullptr, 0)
 	{
-		// Continue
+		m_buf = nullptr;
+		m_used = 0;
+		m_size = 0;
+		m_readIndex = 0;
+		m_kind = KD_None;
+		m_started = false;
+		m_finished = false;
+		m_failed = false;
+		m_lazy = false;
+		m_errorText = nullptr;
+		m_ctx.m_final = false;
+
+		if( (options & ~k_knownOptions) != 0 )
+		{
+			fail("bad options");
+			return;
+		}
+		bool withKinds = (options & OPT_Kinds) != 0;
+		if( !m_ctx.m_tokens.init(k_streamPoolSize, withKinds) )
+		{
+			fail("token pool alloc failed");
+			return;
+		}
+		m_ctx.m_skipTypes = getSkipTypes(options);
 	}
-	else
+
+	~Impl()
 	{
-		ctx.pushToken(TT_Identifier);
-		return doState_Idle(ctx);
+		freeContextMemory(m_ctx);
+		free(m_buf);
+		free(m_errorText);
+	}
+
+	void fail(const char* err)
+	{
+		m_ctx.fail(err);
+		m_failed = true;
+	}
+
+	// [ret] Detailed message of the failure, the short one if it cannot be
+	//       allocated
+	const char* getErrorText()
+	{
+		const char* err = m_ctx.m_error ? m_ctx.m_error : "";
+		if( m_errorText )
+		{
+			return m_errorText;
+		}
+		ErrorRecord record;
+		m_ctx.getErrorRecord(record);
+		int len = formatError(err, record, nullptr, 0);
+		m_errorText = reinterpret_cast<char*>(malloc(len + 1));
+		if( !m_errorText )
+		{
+			return err;
+		}
+		formatError(err, record, m_errorText, len + 1);
+		return m_errorText;
+	}
+
+	// Frees the tokens already given by next()
+	void discardGivenTokens()
+	{
+		m_ctx.m_tokens.discard(m_readIndex);
+		m_ctx.m_finalCount -= m_readIndex;
+		m_readIndex = 0;
 	}
-	return true;
-}
+
+	// Drops what is not needed anymore and appends the chunk
+	// [ret] false upon allocation failure
+	bool append(const char* chunk, int len)
+	{
+		discardGivenTokens();
+
+		// The buffer is smaller than 2 GB
+		int keep = m_started ? int(m_ctx.getFirstNeededPos()) : 0;
+		int rest = m_used - keep;
+		if( len > 0x7ffffffd - rest )
+		{
+			return false;
+		}
+		int needed = rest + len;
+
+		char* buf = m_buf;
+		if( needed > m_size || !buf )
+		{
+			int newSize = m_size < 0x3ffffffe - m_size ? m_size * 2 : needed;
+			if( newSize < k_streamBufferSize )
+			{
+				newSize = k_streamBufferSize;
+			}
+			if( newSize < needed )
+			{
+				newSize = needed;
+			}
+			buf = reinterpret_cast<char*>(malloc(newSize + 2));
+			if( !buf )
+			{
+				return false;
+			}
+			if( rest > 0 )
+			{
+				memcpy(buf, m_buf + keep, rest);
+			}
+			m_size = newSize;
+		}
+		else if( keep > 0 )
+		{
+			memmove(buf, m_buf + keep, rest);
+		}
+		if( len > 0 )
+		{
+			memcpy(buf + rest, chunk, len);
+		}
+		m_used = needed;
+		buf[m_used] = 0;
+		buf[m_used + 1] = 0;
+
+		// The old buffer is still allocated so the tokens can be moved
+		if( m_started )
+		{
+			m_ctx.rebase(buf, m_used, keep);
+		}
+		if( buf != m_buf )
+		{
+			free(m_buf);
+			m_buf = buf;
+		}
+		return true;
+	}
+
+	// Parses what can be parsed with the content available
+	// [ret] false upon parsing error
+	bool parseContent()
+	{
+		if( !m_started )
+		{
+			if( m_used < 3 && !m_finished )
+			{
+				// Not enough to detect the UTF-8 BOM
+				return true;
+			}
+			if( !m_buf && !append("", 0) )
+			{
+				fail("content alloc failed");
+				return false;
+			}
+			if( startsWithUtf8Bom(m_buf, m_used) )
+			{
+				m_used -= 3;
+				memmove(m_buf, m_buf + 3, m_used + 2);
+				m_ctx.m_hasUtf8Bom = true;
+			}
+			m_ctx.rebase(m_buf, m_used, 0);
+			m_started = true;
+		}
+		bool ok = parse(m_ctx);
+		if( !ok || m_ctx.isAtEnd() )
+		{
+			// Like tokenize(), give all the tokens even upon error
+			m_ctx.setAllFinal<FT_All>();
+		}
+		if( !ok )
+		{
+			m_failed = true;
+		}
+		return ok;
+	}
+
+	// For attach(), parses until one more token can be given
+	void parseNextToken()
+	{
+		discardGivenTokens();
+		if( m_failed || m_ctx.isAtEnd() )
+		{
+			return;
+		}
+		m_ctx.m_stopCount = m_ctx.m_finalCount + 1;
+		parseContent();
+	}
+};
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_IdentifierOrLiteral(Context& ctx)
+Tokenizer::Tokenizer(int options)
 {
-	char c = ctx.c;
-	if( c == '"' )
+	m_impl = new (std::nothrow) Impl(options);
+}
+
+Tokenizer::~Tokenizer()
+{
+	delete m_impl;
+}
+
+bool Tokenizer::feed(const char* chunk, int len)
+{
+	if( !m_impl || m_impl->m_failed )
+	{
+		return false;
+	}
+	if( len < 0 || (!chunk && len > 0) )
 	{
-		// Actually a string literal
-		ctx.newState(State_StringLiteral);
-		return true;
+		m_impl->fail("bad chunk");
+		return false;
 	}
-	else if( c == '\'' )
+	if( m_impl->m_finished )
 	{
-		// Actually a character literal
-		ctx.newState(State_CharacterLiteral);
-		return true;
+		m_impl->fail("feed after finish or attach");
+		return false;
 	}
-	else
+	if( !m_impl->append(chunk, len) )
 	{
-		// It was an identifier
-		ctx.newState(State_Identifier);
-		return doState_Identifier(ctx);
+		m_impl->fail("content alloc failed");
+		return false;
 	}
-	return true;
+	return m_impl->parseContent();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_Macro(Context& ctx)
+bool Tokenizer::finish()
 {
-	char c = ctx.c;
-	if( c == '\n' || c == 0 )
+	if( !m_impl || m_impl->m_failed )
 	{
-		ctx.pushToken(TT_Macro);
-		return doState_Idle(ctx);
+		return false;
 	}
-	else
+	if( m_impl->m_finished )
 	{
-		// Check comment block that can act like a backslah-newline
-		if( c == '/' )
-		{
-			ctx.pushTokenMultiline(TT_Macro);
-			ctx.newState(State_CommentOrOperator);
-		}
+		return true;
 	}
-	return true;
+	m_impl->m_finished = true;
+	m_impl->m_ctx.m_final = true;
+	return m_impl->parseContent();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_CommentLine(Context& ctx)
+bool Tokenizer::attach(const char* content, int len)
 {
-	char c = ctx.c;
-	if( c == '\n' || c == 0 )
+	if( !m_impl || m_impl->m_failed )
+	{
+		return false;
+	}
+	if( !content || len < 0 )
+	{
+		m_impl->fail(!content ? "bad content address" : "bad content len");
+		return false;
+	}
+	if( m_impl->m_started || m_impl->m_used > 0 || m_impl->m_finished )
 	{
-		ctx.pushToken(TT_CommentLine);
-		return doState_Idle(ctx);
+		m_impl->fail("attach after feed, finish or attach");
+		return false;
+	}
+	Impl& impl = *m_impl;
+	impl.m_lazy = true;
+	impl.m_finished = true;
+	impl.m_started = true;
+	impl.m_ctx.m_final = true;
+	if( startsWithUtf8Bom(content, len) )
+	{
+		content += 3;
+		len -= 3;
+		impl.m_ctx.m_hasUtf8Bom = true;
 	}
+	impl.m_ctx.rebase(content, len, 0);
 	return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_CommentOrOperator(Context& ctx)
+bool Tokenizer::next(Token& token)
 {
-	char c = ctx.c;
-	if( c == '/' )
+	if( !m_impl )
 	{
-		// Actually a comment line
-		ctx.newState(State_CommentLine);
+		return false;
 	}
-	else if( c == '*' )
+	Impl& impl = *m_impl;
+	if( impl.m_readIndex >= impl.m_ctx.m_finalCount && impl.m_lazy )
 	{
-		// Actually a comment block
-		ctx.newState(State_CommentBlock);
+		impl.parseNextToken();
 	}
-	else
+	if( impl.m_readIndex >= impl.m_ctx.m_finalCount )
 	{
-		// It was actually an operator
-		State doNow = ctx.pushToken(TT_OperatorOrPunctuator);
-		if( doNow == State_Idle )
-		{
-			return doState_Idle(ctx);
-		}
-		else if( doNow == State_Macro )
-		{
-			return doState_Macro(ctx);
-		}
-		else
-		{
-			ctx.error();
-		}
+		return false;
 	}
+	token = *impl.m_ctx.m_tokens.get(impl.m_readIndex);
+	impl.m_kind = impl.m_ctx.m_tokens.getKind(impl.m_readIndex);
+	impl.m_readIndex++;
 	return true;
 }
 
+int Tokenizer::kind() const
+{
+	return m_impl ? m_impl->m_kind : KD_None;
+}
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_CommentBlock(Context& ctx)
+const char* Tokenizer::error() const
 {
-	char c = ctx.c;
-	if( c == '*' )
+	if( !m_impl )
 	{
-		ctx.newState(State_CommentBlockEnd);
+		return "tokenizer alloc failed";
 	}
-	else if( c == '\n' )
+	if( !m_impl->m_failed )
 	{
-		ctx.pushTokenMultiline();
+		return nullptr;
 	}
-	return true;
+	return m_impl->getErrorText();
+}
+
+int Tokenizer::error_line() const
+{
+	return m_impl ? m_impl->m_ctx.getErrorLine() : 0;
+}
+
+int Tokenizer::unix_nl_count() const
+{
+	return m_impl ? m_impl->m_ctx.m_unixNlCount : 0;
+}
+
+int Tokenizer::dos_nl_count() const
+{
+	return m_impl ? m_impl->m_ctx.m_dosNlCount : 0;
+}
+
+int Tokenizer::mac_nl_count() const
+{
+	return m_impl ? m_impl->m_ctx.m_macNlCount : 0;
+}
+
+bool Tokenizer::has_utf8_bom() const
+{
+	return m_impl ? m_impl->m_ctx.m_hasUtf8Bom : false;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_CommentBlockEnd(Context& ctx)
+bool tokenize_parallel(const char* content, int len, int options,
+                       Result& result, int threads)
 {
-	char c = ctx.c;
-	if( c == '*' )
-	{
-		// Continue
-	}
-	else if( c == '\n' )
-	{
-		ctx.pushTokenMultiline();
-	}
-	else if( c == '/' )
+	int partCount = 0;
+	if( content && len > 0 && (options & ~k_knownOptions) == 0 )
 	{
-		ctx.pushToken(TT_CommentBlock, true);
-		// We can return immediately because this token has a end tag
-		return true;
+		partCount = getThreadCount(threads, len / k_minParallelPartLen);
 	}
-	else
+	if( partCount > 1 && tokenizeParts(content, len, options, partCount, result) )
 	{
-		ctx.newState(State_CommentBlock); // Back to previous state
+		if( !fillTokenIndexes(result, options) )
+		{
+			return false;
+		}
+		return !(options & OPT_LineIndex) || fillLineIndex(content, len, result);
 	}
-	return true;
+	// Small content or parsing error: the serial path gives the same result
+	return tokenize(content, len, options, result);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_OperatorOrPunctuator(Context& ctx)
+bool tokenize_batch(const Input* inputs, int count, int options,
+                    BatchResult& batch, int threads)
 {
-	SERet ser = checkOperatorOrPunctuator(ctx.getTokenStr(), ctx.getTokenLen());
-	if( ser == SER_Maybe )
+	batch.results = nullptr;
+	batch.count = 0;
+	batch.failed_count = 0;
+	if( count < 0 || (!inputs && count > 0) )
 	{
-		// Continue
+		return false;
 	}
-	else if( ser == SER_Equal )
+	if( count == 0 )
 	{
-		// Done with end tag
-		// We can return immediately because this token has a end tag
-		ctx.pushToken(TT_OperatorOrPunctuator, true);
 		return true;
 	}
-	else
+
+	Result* results = reinterpret_cast<Result*>(malloc(sizeof(Result) * count));
+	BatchItem* items = reinterpret_cast<BatchItem*>(
+	    malloc(sizeof(BatchItem) * count));
+	if( !results || !items )
 	{
-		// Operator end reached
-		ctx.pushToken(TT_OperatorOrPunctuator);
-		return doState_Idle(ctx);
+		free(results);
+		free(items);
+		return false;
 	}
-	return true;
-}
+	memset(results, 0, sizeof(Result) * count);
 
-///////////////////////////////////////////////////////////////////////////////
-bool isOneOf(char c, const char* psz)
-{
-	for(;;)
+	// Each thread takes the next input when done with the previous one.
+	// Biggest inputs first, so the small ones fill the gaps at the end
+	// instead of one thread finishing a big input alone.
+	for(int i = 0; i < count; ++i)
 	{
-		char c2 = psz[0];
-		if( c2 == 0 )
-		{
-			return false;
-		}
-		if( c == c2 )
-		{
-			return true;
-		}
-		psz++;
+		items[i].len = inputs[i].len;
+		items[i].index = i;
 	}
+	qsort(items, count, sizeof(BatchItem), compareBatchItems);
+
+	BatchJob job;
+	job.inputs = inputs;
+	job.results = results;
+	job.items = items;
+	job.count = count;
+	job.options = options;
+	job.cursor = 0;
+	job.failedCount = 0;
+
+	runInThreads(runBatchJob, &job, getThreadCount(threads, count));
+	free(items);
+
+	batch.results = results;
+	batch.count = count;
+	batch.failed_count = int(job.failedCount);
+	return batch.failed_count == 0;
 }
 
-bool isSimpleEscapeSequence(char c)
+///////////////////////////////////////////////////////////////////////////////
+void free_batch_result(BatchResult& batch)
 {
-	return isOneOf(c, "'\"?\\abfnrtve"); // \e is GCC specific
+	for(int i = 0; i < batch.count; ++i)
+	{
+		free_result(batch.results[i]);
+	}
+	free(batch.results);
+	batch.results = nullptr;
+	batch.count = 0;
+	batch.failed_count = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_StringLiteral(Context& ctx)
+bool retokenize(const char* old_content, const Result& old_result,
+                const char* content, int len, const Edit& edit, Patch& patch)
 {
-	char c = ctx.c;
-	if( c == '\\' )
+	patch.first = 0;
+	patch.removed_count = 0;
+	patch.line_delta = 0;
+	int oldLen = len - edit.inserted_len + edit.removed_len;
+	if( !old_content || !content || len < 0 )
 	{
-		ctx.newState(State_StringLiteralEsc);
+		errorToEmptyResult("bad content address", patch.result);
+		return false;
 	}
-	else if( c == '\n' )
+	if( edit.offset < 0 || edit.removed_len < 0 || edit.inserted_len < 0
+	  || edit.offset + edit.removed_len > oldLen )
 	{
-		ctx.pushTokenMultiline();
+		errorToEmptyResult("bad edit", patch.result);
+		return false;
 	}
-	else if( c == '"' )
+
+	// Find the last line before the edit where the old parsing was between
+	// C++ tokens. The edit must not be in the BOM, nor add or remove one.
+	// The line must also begin the new content, where the edit may put a
+	// '\n' after the '\r' that ends the line before.
+	int bom = old_result.has_utf8_bom ? 3 : 0;
+	int start = edit.offset + 1;
+	int first = 0;
+	bool isClean = false;
+	bool isValid = old_result.tokens && !old_result.error
+	  && startsWithUtf8Bom(content, len) == old_result.has_utf8_bom;
+	while( isValid && !isClean && start > bom )
 	{
-		ctx.pushToken(TT_StringLiteral, true);
-		// We can return immediately because this token has a end tag
-		return true;
+		start--;
+		while( start > bom && !isAfterNewLineSeq(old_content, oldLen, start) )
+		{
+			start--;
+		}
+		isClean = (start == bom || isAfterNewLineSeq(content, len, start))
+		  && isCleanLineStart(old_content, oldLen, old_result, start, first);
 	}
-	return true;
+	int options = getPatchOptions(old_result);
+	if( !isClean )
+	{
+		// Tokenize everything
+		patch.removed_count = old_result.tokens ? old_result.count : 0;
+		return tokenize(content, len, options, patch.result);
+	}
+	patch.first = first;
+	return retokenizeFrom(old_content, old_result, content, len, edit, start,
+	                      first, options, patch);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_StringLiteralEsc(Context& ctx)
+bool apply_patch(const char* old_content, const Result& old_result,
+                 const char* content, const Edit& edit, const Patch& patch,
+                 Result& result)
 {
-	char c = ctx.c;
-	
-	if( isSimpleEscapeSequence(c) )
+	const Result& added = patch.result;
+	int kept = old_result.count - patch.first - patch.removed_count;
+	int count = patch.first + added.count + kept;
+	bool withKinds = added.kinds != nullptr;
+
+	Context ctx(content, 0);
+	result.unix_nl_count = added.unix_nl_count;
+	result.dos_nl_count = added.dos_nl_count;
+	result.mac_nl_count = added.mac_nl_count;
+	result.has_utf8_bom = added.has_utf8_bom;
+	if( !ctx.m_tokens.init(count + 1, withKinds) )
 	{
-		ctx.newState(State_StringLiteral);
+		errorToResult("token pool alloc failed", result);
+		return false;
 	}
-	else if( c == 'x' )
+
+	// The content before the edit did not move
+	TokenAllocator& tokens = ctx.m_tokens;
+	for(int i = 0; i < patch.first; ++i)
 	{
-		ctx.newState(State_StringLiteral);
+		Token* pTok = tokens.alloc();
+		*pTok = old_result.tokens[i];
+		pTok->str = content + (pTok->str - old_content);
+		tokens.setKind(pTok, withKinds ? old_result.kinds[i] : 0);
 	}
-	else if( isOctDigit(c) )
+	for(int i = 0; i < added.count; ++i)
 	{
-		// The test should be c == '0' but some compilers accepts
-		// expressions like \4
-		ctx.newState(State_StringLiteral);
+		Token* pTok = tokens.alloc();
+		*pTok = added.tokens[i];
+		tokens.setKind(pTok, withKinds ? added.kinds[i] : 0);
 	}
-	else if( c == '\n' )
+	int shift = edit.inserted_len - edit.removed_len;
+	for(int i = old_result.count - kept; i < old_result.count; ++i)
 	{
-		// Not an escape sequence, but a backslash
-		// Keep it in the string
-		ctx.newState(State_StringLiteral);
+		Token* pTok = tokens.alloc();
+		*pTok = old_result.tokens[i];
+		pTok->str = content + (pTok->str - old_content) + shift;
+		pTok->line += patch.line_delta;
+		tokens.setKind(pTok, withKinds ? old_result.kinds[i] : 0);
 	}
-	else
+
+	bool ret = !added.error;
+	result.error = added.error;
+	result.error_line = added.error_line;
+	result.error_record = added.error_record;
+	tokens.detach(result.tokens, result.kinds, result.count);
+	result.owns_tokens = true;
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
+	// A bracket added may pair brackets far away, all are paired again
+	int options = (old_result.matches ? OPT_MatchBrackets : 0)
+	  | (old_result.directives ? OPT_Directives : 0);
+	if( ret && options != 0 )
 	{
-		ctx.error();
-		return false;
+		ret = fillTokenIndexes(result, options);
 	}
-	return true;
+	return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_CharacterLiteral(Context& ctx)
+void free_result(Result& result)
 {
-	char c = ctx.c;
-	if( c == '\\' )
-	{
-		ctx.newState(State_CharacterLiteralEsc);
-	}
-	else if( c == '\n' )
-	{
-		ctx.error();
-		return false;
-	}
-	else if( c == '\'' )
+	if( result.owns_tokens )
 	{
-		ctx.pushToken(TT_CharacterLiteral, true);
-		// We can return immediately because this token has a end tag
-		return true;
+		free(const_cast<Token*>(result.tokens));
+		free(const_cast<unsigned char*>(result.kinds));
 	}
-	return true;
+	free(const_cast<size_t*>(result.line_starts));
+	free(const_cast<int*>(result.matches));
+	free(const_cast<Directive*>(result.directives));
+	result.tokens = nullptr;
+	result.kinds = nullptr;
+	result.count = 0;
+	result.error = nullptr;
+	result.unix_nl_count = 0;
+	result.dos_nl_count = 0;
+	result.mac_nl_count = 0;
+	result.has_utf8_bom = false;
+	result.owns_tokens = false;
+	unmapFile(result.file_content, result.file_len);
+	result.file_content = nullptr;
+	result.file_len = 0;
+	result.line_starts = nullptr;
+	result.line_count = 0;
+	result.matches = nullptr;
+	result.directives = nullptr;
+	result.directive_count = 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-bool doState_CharacterLiteralEsc(Context& ctx)
+int format_error(const Result& result, char* buf, int size)
 {
-	char c = ctx.c;
-	
-	if( isSimpleEscapeSequence(c) )
-	{
-		ctx.newState(State_CharacterLiteral);
-	}
-	else if( c == 'x' )
+	return formatError(result.error, result.error_record, buf, size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void find_line_column(const Result& result, size_t offset, int& line,
+                      size_t& column)
+{
+	// Last line that starts before or at the offset
+	int low = 0;
+	int high = result.line_count;
+	while( low < high )
 	{
-		ctx.newState(State_CharacterLiteral);
+		int mid = low + (high - low) / 2;
+		if( result.line_starts[mid] <= offset )
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
 	}
-	else if( isOctDigit(c) )
+	if( low == 0 )
 	{
-		// The test should be c=='0' but some compilers accepts
-		// expressions like \4
-		ctx.newState(State_CharacterLiteral);
+		// No index, or inside the UTF-8 BOM
+		line = result.line_count > 0 ? 1 : 0;
+		column = result.line_count > 0 ? 0 : offset;
+		return;
 	}
-	else
+	line = low;
+	column = offset - result.line_starts[low - 1];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int first_token_of_line(const Result& result, int line)
+{
+	int low = 0;
+	int high = result.count;
+	while( low < high )
 	{
-		ctx.error();
-		return false;
+		int mid = low + (high - low) / 2;
+		if( result.tokens[mid].line < line )
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
 	}
-	return true;
+	return low;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-SERet checkIntegerSuffix(const char* p, int len)
+size_t rebuild(const Result& result, char* out, size_t cap)
 {
-	static const char* const suf[] = {
-	    "l", "ll", "u", "ul", "ull",
-	    "L", "LL", "U", "UL", "ULL",
-	    "Ul", "Ull"
-	};
-	return isOneOfThose(p, len, suf, ARRAY_COUNT(suf));
+	MemoryWriter writer(out, out ? cap : 0);
+	rebuildContent(result, writer);
+	return writer.getSize();
 }
 
-bool isIntegerSuffixBegin(char c)
+///////////////////////////////////////////////////////////////////////////////
+bool rebuild_with(const Result& result, WriteFunc write, void* param)
 {
-	return checkIntegerSuffix(&c, 1) >= SER_Maybe;
+	if( !write )
+	{
+		return false;
+	}
+	CallbackWriter writer(write, param);
+	rebuildContent(result, writer);
+	return writer.flush();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-bool doState_OctOrHexLiteral(Context& ctx)
-{
-	char c = ctx.c;
-	if( c == 'x' )
+///////////////////////////////////////////////////////////////////////////////
+bool verify_roundtrip(const char* content, size_t len, const Result& result,
+                      Divergence* divergence)
+{
+	if( (!content && len > 0) || !result.tokens || result.error )
+	{
+		return diverge(divergence, "no valid tokens", 0, 1, 0);
+	}
+	const char* end = content + len;
+	const char* p = content;
+	if( result.has_utf8_bom )
+	{
+		if( !startsWithUtf8Bom(content, Pos(len)) )
+		{
+			return diverge(divergence, "no utf-8 bom", 0, 1, 0);
+		}
+		p += 3;
+	}
+
+	// The empty tokens may point before the newline of their line, only
+	// their line number is checked
+	int line = 1;     // Line of 'p'
+	int lastLine = 1; // Line of the last token
+	int nlCount;
+	for(int i = 0; i < result.count; ++i)
+	{
+		const Token& tok = result.tokens[i];
+		if( tok.line < lastLine )
+		{
+			return diverge(divergence, "line number decreasing",
+			               size_t(p - content), line, i);
+		}
+		lastLine = tok.line;
+		if( tok.len == 0 )
+		{
+			continue;
+		}
+		if( tok.str != p )
+		{
+			if( isSplitNewLine(content, p, end) )
+			{
+				return diverge(divergence, "newline split by a token",
+				               size_t(p - content), line, i);
+			}
+			if( tok.str < p || tok.str > end )
+			{
+				return diverge(divergence, "token out of place",
+				               size_t(p - content), line, i);
+			}
+			const char* next = skipNewLines(p, tok.str, nlCount);
+			if( next != tok.str )
+			{
+				return diverge(divergence, "character not in a token",
+				               size_t(next - content), line + nlCount, i);
+			}
+		}
+		else
+		{
+			nlCount = 0;
+		}
+		if( line + nlCount != tok.line )
+		{
+			return diverge(divergence, "wrong line number",
+			               size_t(p - content), line, i);
+		}
+		if( tok.len < 0 || tok.len > end - tok.str )
+		{
+			return diverge(divergence, "token out of place",
+			               size_t(p - content), line, i);
+		}
+		p = tok.str + tok.len;
+		line = tok.line;
+	}
+
+	// Only the newlines of the last empty tokens may remain
+	if( isSplitNewLine(content, p, end) )
 	{
-		ctx.newState(State_HexLiteralX);
+		return diverge(divergence, "newline split by a token",
+		               size_t(p - content), line, result.count);
 	}
-	else if( isOctDigit(c) )
+	const char* next = skipNewLines(p, end, nlCount);
+	if( next != end )
 	{
-		ctx.newState(State_OctLiteral);
+		return diverge(divergence, "character not in a token",
+		               size_t(next - content), line + nlCount, result.count);
 	}
-	else if( isIntegerSuffixBegin(c) )
+	if( line + nlCount != lastLine )
 	{
-		ctx.newState(State_IntegerSuffix);
+		return diverge(divergence, "wrong line number", size_t(p - content), line,
+		               result.count);
 	}
-	else
+	if( divergence )
 	{
-		// A decimal 0
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		divergence->reason = nullptr;
+		divergence->offset = len;
+		divergence->line = line;
+		divergence->token = result.count;
 	}
 	return true;
 }
 
-bool doState_HexLiteralX(Context& ctx)
+///////////////////////////////////////////////////////////////////////////////
+bool build_type_index(const Result& result, TypeIndex& index)
 {
-	char c = ctx.c;
-	if( isHexDigit(c) )
+	index.positions = nullptr;
+	for(int t = 0; t <= TypeIndex::k_maxTypes; ++t)
 	{
-		ctx.newState(State_HexLiteral);
+		index.firsts[t] = 0;
 	}
-	else
+	if( result.count == 0 )
+	{
+		return true;
+	}
+	int* positions = reinterpret_cast<int*>(
+	  malloc(sizeof(int) * size_t(result.count)));
+	if( !positions )
 	{
-		ctx.error();
 		return false;
 	}
-	return true;
-}
 
-bool doState_HexLiteral(Context& ctx)
-{
-	char c = ctx.c;
-	if( isHexDigit(c) )
+	// Tokens of each type, then where the next token of each type goes
+	int cursors[TypeIndex::k_maxTypes];
+	for(int t = 0; t < TypeIndex::k_maxTypes; ++t)
 	{
-		// Continue
+		cursors[t] = 0;
 	}
-	else if( isIntegerSuffixBegin(c) )
+	for(int i = 0; i < result.count; ++i)
 	{
-		ctx.newState(State_IntegerSuffix);
+		cursors[result.tokens[i].type]++;
 	}
-	else
+	int total = 0;
+	for(int t = 0; t < TypeIndex::k_maxTypes; ++t)
 	{
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		index.firsts[t] = total;
+		total += cursors[t];
+		cursors[t] = index.firsts[t];
 	}
+	index.firsts[TypeIndex::k_maxTypes] = total;
+
+	for(int i = 0; i < result.count; ++i)
+	{
+		positions[cursors[result.tokens[i].type]++] = i;
+	}
+	index.positions = positions;
 	return true;
 }
 
-bool doState_OctLiteral(Context& ctx)
+///////////////////////////////////////////////////////////////////////////////
+void free_type_index(TypeIndex& index)
 {
-	char c = ctx.c;
-	if( isOctDigit(c) )
-	{
-		// Continue
-	}
-	else if( isIntegerSuffixBegin(c) )
-	{
-		ctx.newState(State_IntegerSuffix);
-	}
-	else
+	free(const_cast<int*>(index.positions));
+	index.positions = nullptr;
+	for(int t = 0; t <= TypeIndex::k_maxTypes; ++t)
 	{
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		index.firsts[t] = 0;
 	}
-	return true;
 }
 
-bool doState_DecLiteral(Context& ctx)
+///////////////////////////////////////////////////////////////////////////////
+void visit_tokens(const Result& result, const Rule* rules, int count)
 {
-	char c = ctx.c;
-	if( isDigit(c) )
+	const int typeCount = k_lastTokenType + 1;
+
+	// The rules of each type, one type after the other
+	int firsts[typeCount + 1];
+	int total = 0;
+	for(int t = 0; t < typeCount; ++t)
 	{
-		// Continue
+		firsts[t] = total;
+		for(int r = 0; r < count; ++r)
+		{
+			if( rules[r].types & type_bit(TokenType(t)) )
+			{
+				total++;
+			}
+		}
 	}
-	else if( isIntegerSuffixBegin(c) )
+	firsts[typeCount] = total;
+
+	const Rule** byType = reinterpret_cast<const Rule**>(
+	  malloc(sizeof(const Rule*) * size_t(total > 0 ? total : 1)));
+	if( !byType )
 	{
-		ctx.newState(State_IntegerSuffix);
+		// Same calls, the types are checked for each token
+		for(int i = 0; i < result.count; ++i)
+		{
+			unsigned int bit = type_bit(result.tokens[i].type);
+			for(int r = 0; r < count; ++r)
+			{
+				if( rules[r].types & bit )
+				{
+					rules[r].func(rules[r].param, result, i);
+				}
+			}
+		}
+		return;
 	}
-	else
+	int pos = 0;
+	for(int t = 0; t < typeCount; ++t)
 	{
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		for(int r = 0; r < count; ++r)
+		{
+			if( rules[r].types & type_bit(TokenType(t)) )
+			{
+				byType[pos++] = &rules[r];
+			}
+		}
 	}
-	return true;
-}
 
-bool doState_IntegerSuffix(Context& ctx)
-{
-	// Handling a suffix is a bit tricky
-	const int backLen = 2;
-	const char* p = ctx.getTokenStr() + ctx.getTokenLen()-backLen;
-	SERet ser = checkIntegerSuffix(p, backLen);
-	if( ser == SER_Maybe )
+	for(int i = 0; i < result.count; ++i)
 	{
-		ctx.newState(State_IntegerSuffix2);
+		int type = result.tokens[i].type;
+		for(int r = firsts[type]; r < firsts[type + 1]; ++r)
+		{
+			byType[r]->func(byType[r]->param, result, i);
+		}
 	}
-	else if( ser == SER_Equal )
+	free(byType);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool tokenize_compact(const char* content, int len, int options,
+                      CompactResult& result)
+{
+	result.types = nullptr;
+	result.multis = nullptr;
+	result.offsets = nullptr;
+	result.lens = nullptr;
+	result.kinds = nullptr;
+	result.count = 0;
+	result.line_firsts = nullptr;
+	result.line_count = 0;
+	result.owns_arrays = true;
+
+	Context ctx(content, len);
+	Result info;
+	bool ret = checkArgs(content, len, options, info);
+
+	// The tokens are converted each time enough of them cannot change
+	// anymore, the token pool stays small. The arrays start at the median
+	// density, see estimatePoolSize().
+	CompactBuilder builder;
+	bool withKinds = (options & OPT_Kinds) != 0;
+	if( ret && (!ctx.m_tokens.init(k_streamPoolSize, withKinds)
+	  || !builder.init(len / 8 + 16, len / 32 + 16, withKinds)) )
 	{
-		// Done with end tag
-		ctx.pushToken(TT_IntegerLiteral, true);
-		return true;
+		errorToResult("token pool alloc failed", info);
+		ret = false;
 	}
-	else
+	else if( ret )
 	{
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		ctx.m_skipTypes = getSkipTypes(options);
+		for(;;)
+		{
+			ctx.m_stopCount = ctx.m_finalCount + k_streamPoolSize;
+			ret = parse(ctx);
+			bool isDone = !ret || ctx.isAtEnd();
+			if( isDone )
+			{
+				// Like tokenize(), give all the tokens even upon error
+				ctx.setAllFinal<FT_All>();
+			}
+			if( !builder.add(ctx.m_tokens, ctx.m_finalCount, content) )
+			{
+				ctx.fail("token pool alloc failed");
+				ret = false;
+				break;
+			}
+			ctx.m_tokens.discard(ctx.m_finalCount);
+			ctx.m_finalCount = 0;
+			if( isDone )
+			{
+				break;
+			}
+		}
+		builder.detach(result);
+		info.error = ctx.m_error;
+		info.error_line = ctx.getErrorLine();
+		ctx.getErrorRecord(info.error_record);
+		info.unix_nl_count = ctx.m_unixNlCount;
+		info.dos_nl_count = ctx.m_dosNlCount;
+		info.mac_nl_count = ctx.m_macNlCount;
 	}
-	return true;
+	freeContextMemory(ctx);
+
+	result.error = info.error;
+	result.error_line = info.error_line;
+	result.error_record = info.error_record;
+	result.unix_nl_count = info.unix_nl_count;
+	result.dos_nl_count = info.dos_nl_count;
+	result.mac_nl_count = info.mac_nl_count;
+	result.has_utf8_bom = ctx.m_hasUtf8Bom;
+	return ret;
 }
 
-bool doState_IntegerSuffix2(Context& ctx)
+///////////////////////////////////////////////////////////////////////////////
+void free_compact_result(CompactResult& result)
 {
-	// Handling a suffix is a bit tricky
-	const int backLen = 3;
-	const char* p = ctx.getTokenStr() + ctx.getTokenLen()-backLen;
-	SERet ser = checkIntegerSuffix(p, backLen);
-	if( ser == SER_Maybe )
-	{
-		ctx.newState(State_IntegerSuffix2);
-	}
-	else if( ser == SER_Equal )
+	if( result.owns_arrays )
 	{
-		// Done with end tag
-		ctx.pushToken(TT_IntegerLiteral, true);
-		return true;
+		free(const_cast<unsigned char*>(result.types));
+		free(const_cast<unsigned char*>(result.multis));
+		free(const_cast<unsigned int*>(result.offsets));
+		free(const_cast<unsigned int*>(result.lens));
+		free(const_cast<unsigned char*>(result.kinds));
+		free(const_cast<int*>(result.line_firsts));
 	}
-	else
+	result.types = nullptr;
+	result.multis = nullptr;
+	result.offsets = nullptr;
+	result.lens = nullptr;
+	result.kinds = nullptr;
+	result.count = 0;
+	result.line_firsts = nullptr;
+	result.line_count = 0;
+	result.error = nullptr;
+	result.unix_nl_count = 0;
+	result.dos_nl_count = 0;
+	result.mac_nl_count = 0;
+	result.has_utf8_bom = false;
+	result.owns_arrays = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int format_error(const CompactResult& result, char* buf, int size)
+{
+	return formatError(result.error, result.error_record, buf, size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int token_line(const CompactResult& result, int index)
+{
+	// Last line whose first token is not after the token
+	int low = 0;
+	int high = result.line_count;
+	while( low < high )
 	{
-		ctx.pushToken(TT_IntegerLiteral);
-		return doState_Idle(ctx);
+		int mid = low + (high - low) / 2;
+		if( result.line_firsts[mid] <= index )
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
 	}
-	return true;
+	return low;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Fils the Result error field
-void errorToResult(Context& ctx, const char* err, Result& result)
+void get_token(const CompactResult& result, const char* content, int index,
+               Token& token)
 {
-	ctx.m_error += err;
-	result.error_line = 0;
-	result.tokens = nullptr;
-	result.count = 0;
-	ctx.m_error.detach(result.error);
+	token.type = token_type(result, index);
+	token.line = token_line(result, index);
+	token.str = token_str(result, content, index);
+	token.len = token_len(result, index);
+	token.multi = token_multi(result, index);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-} // namespace
+unsigned long long content_hash(const char* content, size_t len)
+{
+	return hashContent(content, len);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-bool tokenize(const char* content, int len, int options, Result& result)
+size_t save_cache(const Result& result, const char* content, size_t len,
+                  int options, void* buf, size_t size)
 {
-	result.unix_nl_count = 0;
-	result.dos_nl_count = 0;
-	result.mac_nl_count = 0;
-
-	Context ctx(content, len);
-	
-	if( !content )
+	bool withKinds = (options & OPT_Kinds) != 0;
+	if( !result.tokens || result.error || !content || len > 0xffffffffu
+	  || (options & ~k_knownOptions) != 0 || withKinds != (result.kinds != nullptr) )
 	{
-		errorToResult(ctx, "bad content address", result);
-		return false;
+		return 0;
 	}
-	if( len < 0 )
+
+	// The tokens must be the ones of the content, in order, of the types
+	// openCache() accepts. An unterminated token at the end keeps TT_None.
+	int count = result.count;
+	const Token* tokens = result.tokens;
+	const char* prevEnd = content;
+	int prevLine = 1;
+	for(int i = 0; i < count; ++i)
 	{
-		errorToResult(ctx, "bad content len", result);
-		return false;
+		const Token& tok = tokens[i];
+		if( tok.str < prevEnd || tok.len < 0 || size_t(tok.len) > len
+		  || size_t(tok.str - content) > len - size_t(tok.len)
+		  || tok.line < prevLine
+		  || tok.type == TT_None || tok.type > k_lastTokenType )
+		{
+			return 0;
+		}
+		prevEnd = tok.str + tok.len;
+		prevLine = tok.line;
 	}
-	if( options != 0 )
+	unsigned int lineCount = count > 0 ? unsigned(tokens[count - 1].line) : 0;
+	unsigned long long cacheSize = getCacheSize(unsigned(count), lineCount,
+	                                            withKinds);
+	if( cacheSize > (unsigned long long)(size_t(-1)) )
 	{
-		errorToResult(ctx, "bad options", result);
-		return false;
+		return 0;
 	}
-
-	if( !ctx.m_tokens.init(200000) )
+	if( !buf || size < size_t(cacheSize) )
 	{
-		errorToResult(ctx, "token pool alloc failed", result);
-		return false;
+		return size_t(cacheSize);
 	}
-	
-	bool ret = true;
 
-	State state;
-	while( ctx.next(state) )
-	{
-		bool ok;
-		switch( state )
-		{
-		case State_Idle:
-			ok = doState_Idle(ctx);
-			break;
-		case State_Space:
-			ok = doState_Space(ctx);
-			break;
-		case State_NewLine:
-			ok = doState_NewLine(ctx);
-			break;
-		case State_Identifier:
-			ok = doState_Identifier(ctx);
-			break;
-		case State_IdentifierOrLiteral:
-			ok = doState_IdentifierOrLiteral(ctx);
-			break;
-		case State_Macro:
-			ok = doState_Macro(ctx);
-			break;
-		case State_CommentOrOperator: 
-			ok = doState_CommentOrOperator(ctx);
-			break;
-		case State_CommentLine:
-			ok = doState_CommentLine(ctx);
-			break;
-		case State_CommentBlock:
-			ok = doState_CommentBlock(ctx);
-			break;
-		case State_CommentBlockEnd:
-			ok = doState_CommentBlockEnd(ctx);
-			break;
-		case State_OperatorOrPunctuator:
-			ok = doState_OperatorOrPunctuator(ctx);
-			break;
-		case State_StringLiteral:
-			ok = doState_StringLiteral(ctx);
-			break;
-		case State_StringLiteralEsc:
-			ok = doState_StringLiteralEsc(ctx);
-			break;
-		case State_CharacterLiteral:
-			ok = doState_CharacterLiteral(ctx);
-			break;
-		case State_CharacterLiteralEsc:
-			ok = doState_CharacterLiteralEsc(ctx);
-			break;
-		case State_OctOrHexLiteral:
-			ok = doState_OctOrHexLiteral(ctx);
-			break;
-		case State_DecLiteral:
-			ok = doState_DecLiteral(ctx);
-			break;
-		case State_OctLiteral:
-			ok = doState_OctLiteral(ctx);
-			break;
-		case State_HexLiteralX:
-			ok = doState_HexLiteralX(ctx);
-			break;
-		case State_HexLiteral:
-			ok = doState_HexLiteral(ctx);
-			break;
-		case State_IntegerSuffix:
-			ok = doState_IntegerSuffix(ctx);
-			break;
-		case State_IntegerSuffix2:
-			ok = doState_IntegerSuffix2(ctx);
-			break;
-		case State_Error:
-			ok = false;
-			break;
-		}
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = k_cacheMagic;
+	header.format = k_cacheFormat;
+	header.version = CPPNOM_VERSION;
+	header.options = unsigned(options);
+	header.hash = hashContent(content, len);
+	header.len = len;
+	header.count = unsigned(count);
+	header.lineCount = lineCount;
+	header.unixNlCount = unsigned(result.unix_nl_count);
+	header.dosNlCount = unsigned(result.dos_nl_count);
+	header.macNlCount = unsigned(result.mac_nl_count);
+	header.flags = result.has_utf8_bom ? k_cacheUtf8Bom : 0;
+	memcpy(buf, &header, sizeof(header));
 
-		if( !ok )
+	char* p = reinterpret_cast<char*>(buf) + sizeof(header);
+	unsigned int* offsets = reinterpret_cast<unsigned int*>(p);
+	unsigned int* lens = offsets + count;
+	int* lineFirsts = reinterpret_cast<int*>(lens + count);
+	unsigned char* types = reinterpret_cast<unsigned char*>(lineFirsts + lineCount);
+	unsigned char* multis = types + count;
+	int line = 0;
+	for(int i = 0; i < count; ++i)
+	{
+		const Token& tok = tokens[i];
+		while( line < tok.line )
 		{
-			ret = false;
-			break;
+			lineFirsts[line++] = i;
 		}
+		offsets[i] = unsigned(tok.str - content);
+		lens[i] = unsigned(tok.len);
+		types[i] = (unsigned char)tok.type;
+		multis[i] = (unsigned char)tok.multi;
+	}
+	if( withKinds )
+	{
+		memcpy(multis + count, result.kinds, size_t(count));
 	}
+	return size_t(cacheSize);
+}
 
-	ctx.m_tokens.detach(result.tokens, result.count);
-	ctx.m_error.detach(result.error);
-	result.error_line = ctx.getErrorLine();
-	result.unix_nl_count = ctx.m_unixNlCount;
-	result.dos_nl_count = ctx.m_dosNlCount;
-	result.mac_nl_count = ctx.m_macNlCount;
-	result.has_utf8_bom = ctx.m_hasUtf8Bom;
+///////////////////////////////////////////////////////////////////////////////
+bool open_cache(const void* data, size_t size, const char* content,
+                size_t len, int options, CompactResult& result)
+{
+	result.error = openCache(data, size, content, len, options, nullptr,
+	                         result);
+	result.error_line = 0;
+	clearErrorRecord(result.error_record);
+	result.owns_arrays = false;
+	if( result.error )
+	{
+		result.types = nullptr;
+		result.multis = nullptr;
+		result.offsets = nullptr;
+		result.lens = nullptr;
+		result.kinds = nullptr;
+		result.count = 0;
+		result.line_firsts = nullptr;
+		result.line_count = 0;
+		result.unix_nl_count = 0;
+		result.dos_nl_count = 0;
+		result.mac_nl_count = 0;
+		result.has_utf8_bom = false;
+		return false;
+	}
+	return true;
+}
 
-	return ret;
+///////////////////////////////////////////////////////////////////////////////
+bool load_cache(const void* data, size_t size, const char* content,
+                size_t len, int options, Result& result)
+{
+	return loadCache(data, size, content, len, options, nullptr, result);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void free_result(Result& result)
+bool tokenize_cached(const char* content, size_t len, int options,
+                     const char* dir, Result& result)
 {
-	free(const_cast<Token*>(result.tokens));
-	result.tokens = nullptr;
-	result.count = 0;
-	free(const_cast<char*>(result.error));
-	result.error = nullptr;
-	result.unix_nl_count = 0;
-	result.dos_nl_count = 0;
-	result.mac_nl_count = 0;
-	result.has_utf8_bom = false;
+	if( !content || !dir )
+	{
+		return tokenize_large(content, len, options, result);
+	}
+	unsigned long long hash = hashContent(content, len);
+	char* path = makeCachePath(dir, hash, options, "");
+	const char* data = nullptr;
+	size_t size = 0;
+	if( path && !mapFile(path, data, size) && data )
+	{
+		bool ok = loadCache(data, size, content, len, options, &hash, result);
+		unmapFile(data, size);
+		if( ok )
+		{
+			free(path);
+			return true;
+		}
+		// Not a cache of this content, it is written again below
+		free_result(result);
+	}
+	free(path);
+
+	if( !tokenize_large(content, len, options, result) )
+	{
+		return false;
+	}
+	writeCacheFile(dir, hash, options, result, content, len);
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
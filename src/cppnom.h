@@ -33,7 +33,10 @@ SOFTWARE.
 // Does not use C++ exceptions. Does not use the C++ Standard Library.
 // https://github.com/hadrien-psydk/cppnom
 
-#define CPPNOM_VERSION 1
+// Changes when the tokens of a content change, see save_cache()
+#define CPPNOM_VERSION 2
+
+#include <stddef.h>
 
 namespace cppnom {
 
@@ -49,9 +52,10 @@ enum TokenType
 	TT_OperatorOrPunctuator, // Symbol-based only (thus no new and delete)
 	TT_Macro,                // The most probable cause of multiline token
 	TT_BackslashNewline,     // Backslash at the end of a line is tokenized
-	TT_StringLiteral,        // "some string"
+	TT_StringLiteral,        // "some string", R"(raw string)"
 	TT_CharacterLiteral,     // 'c'
-	TT_IntegerLiteral        // 123ULL
+	TT_IntegerLiteral,       // 123ULL
+	TT_FloatingLiteral       // 1.5f
 };
 
 // A C++ token may be split into several cppnom tokens.
@@ -78,17 +82,277 @@ struct Token
 	Multi         multi;  // 1:1 or n:1 mapping between cppnom and C++ tokens
 };
 
+// Identifies keywords and operators so they can be dispatched without comparing
+// strings. The values are stable: new keywords go before OP_LeftBrace and
+// new operators at the end.
+enum Kind
+{
+	KD_None, // Neither a keyword nor an operator
+	KW_alignof,
+	KW_asm,
+	KW_auto,
+	KW_bool,
+	KW_break,
+	KW_case,
+	KW_catch,
+	KW_char,
+	KW_char16_t,
+	KW_char32_t,
+	KW_class,
+	KW_const,
+	KW_constexpr,
+	KW_const_cast,
+	KW_continue,
+	KW_decltype,
+	KW_default,
+	KW_delete,
+	KW_do,
+	KW_double,
+	KW_dynamic_cast,
+	KW_else,
+	KW_enum,
+	KW_explicit,
+	KW_export,
+	KW_extern,
+	KW_false,
+	KW_float,
+	KW_for,
+	KW_friend,
+	KW_goto,
+	KW_if,
+	KW_inline,
+	KW_int,
+	KW_long,
+	KW_mutable,
+	KW_namespace,
+	KW_new,
+	KW_noexcept,
+	KW_nullptr,
+	KW_operator,
+	KW_private,
+	KW_protected,
+	KW_public,
+	KW_register,
+	KW_reinterpret_cast,
+	KW_return,
+	KW_short,
+	KW_signed,
+	KW_sizeof,
+	KW_static,
+	KW_static_assert,
+	KW_static_cast,
+	KW_struct,
+	KW_switch,
+	KW_template,
+	KW_this,
+	KW_thread_local,
+	KW_throw,
+	KW_true,
+	KW_try,
+	KW_typedef,
+	KW_typeid,
+	KW_typename,
+	KW_union,
+	KW_unsigned,
+	KW_using,
+	KW_virtual,
+	KW_void,
+	KW_volatile,
+	KW_wchar_t,
+	KW_while,
+
+	OP_LeftBrace = 128,        // {
+	OP_RightBrace,             // }
+	OP_LeftBracket,            // [
+	OP_RightBracket,           // ]
+	OP_Hash,                   // #
+	OP_HashHash,               // ##
+	OP_LeftParen,              // (
+	OP_RightParen,             // )
+	OP_DigraphLeftBracket,     // <:
+	OP_DigraphRightBracket,    // :>
+	OP_DigraphLeftBrace,       // <%
+	OP_DigraphRightBrace,      // %>
+	OP_DigraphHash,            // %:
+	OP_DigraphHashHash,        // %:%:
+	OP_Semicolon,              // ;
+	OP_Colon,                  // :
+	OP_Ellipsis,               // ...
+	OP_Question,               // ?
+	OP_ColonColon,             // ::
+	OP_Dot,                    // .
+	OP_DotStar,                // .*
+	OP_Plus,                   // +
+	OP_Minus,                  // -
+	OP_Star,                   // *
+	OP_Slash,                  // /
+	OP_Percent,                // %
+	OP_Caret,                  // ^
+	OP_Amp,                    // &
+	OP_Pipe,                   // |
+	OP_Tilde,                  // ~
+	OP_Exclaim,                // !
+	OP_Equal,                  // =
+	OP_Less,                   // <
+	OP_Greater,                // >
+	OP_PlusEqual,              // +=
+	OP_MinusEqual,             // -=
+	OP_StarEqual,              // *=
+	OP_SlashEqual,             // /=
+	OP_PercentEqual,           // %=
+	OP_CaretEqual,             // ^=
+	OP_AmpEqual,               // &=
+	OP_PipeEqual,              // |=
+	OP_LessLess,               // <<
+	OP_GreaterGreater,         // >>
+	OP_GreaterGreaterEqual,    // >>=
+	OP_LessLessEqual,          // <<=
+	OP_EqualEqual,             // ==
+	OP_ExclaimEqual,           // !=
+	OP_LessEqual,              // <=
+	OP_GreaterEqual,           // >=
+	OP_AmpAmp,                 // &&
+	OP_PipePipe,               // ||
+	OP_PlusPlus,               // ++
+	OP_MinusMinus,             // --
+	OP_Comma,                  // ,
+	OP_ArrowStar,              // ->*
+	OP_Arrow                   // ->
+};
+
+// Flags for the tokenize() options
+enum Option
+{
+	OPT_Kinds         = 0x01, // Fill Result::kinds
+	OPT_SkipSpace     = 0x02, // No TT_Space, TT_EmptyLine, TT_BackslashNewline
+	OPT_SkipComments  = 0x04, // No TT_CommentLine, TT_CommentBlock
+	OPT_LineIndex     = 0x08, // Fill Result::line_starts, ignored without
+	                          // a Result
+	OPT_MatchBrackets = 0x10, // Fill Result::matches, ignored without a
+	                          // Result
+	OPT_Directives    = 0x20  // Fill Result::directives, ignored without a
+	                          // Result
+};
+
+// With the skip options, the skipped characters are the ones between the
+// end of a token and the beginning of the next one. The other tokens are
+// the same as without the options, a C++ token split by a backslash-newline
+// keeps its ML_First and ML_Next parts.
+
+// Where the parsing failed, format_error() turns it in a detailed message.
+// Filled without allocating anything.
+struct ErrorRecord
+{
+	const char* state;    // Name of the parser state, null if the parsing
+	                      // did not fail on a character
+	int         c;        // Character the parsing stopped at, 0 at the end
+	const char* line;     // Line of that character, points on the content
+	int         line_len; // Length of 'line', at most 1 MB
+	int         column;   // Position of the character in 'line'
+};
+
+// Kinds of preprocessor directives, see Directive
+enum DirectiveKind
+{
+	DK_Null,    // Only the #
+	DK_Include, // #include, #include_next or #import
+	DK_Define,
+	DK_Undef,
+	DK_If,
+	DK_Ifdef,
+	DK_Ifndef,
+	DK_Elif,    // #elif, #elifdef or #elifndef
+	DK_Else,
+	DK_Endif,
+	DK_Pragma,
+	DK_Error,   // #error or #warning
+	DK_Line,
+	DK_Other    // Unknown name, or a GNU line marker like # 12 "file.h"
+};
+
+// A preprocessor directive found with OPT_Directives. Its TT_Macro tokens
+// start at 'token' and go on with the ML_Next tokens. The spans point on
+// the content as is: they may contain comments and backslash-newlines, and a
+// directive name split by a backslash-newline is not recognized
+// (DK_Other). A missing span has a length of 0.
+struct Directive
+{
+	DirectiveKind kind;
+	int           token;      // Index of the first token of the directive
+	const char*   name;       // Name after the #, like "include"
+	int           name_len;
+	const char*   arg;        // DK_Include: header path with its <> or "",
+	                          // or the macro that gives it. DK_Define,
+	                          // DK_Undef, DK_Ifdef, DK_Ifndef: macro name.
+	                          // Others: the rest of the directive
+	int           arg_len;
+	const char*   params;     // DK_Define of a function-like macro: the
+	                          // parameters with their parentheses
+	int           params_len;
+};
+
 // tokenize() output structure
 struct Result
 {
-	const Token* tokens;        // Non-null when tokenize() is successful
-	int          count;         // Number of tokens
-	const char*  error;         // Non-null when tokenize() fails. 0 terminated.
-	int          error_line;    // Line number when the error was detected
-	int          unix_nl_count; // Number of lines ending with U+000A
-	int          dos_nl_count;  // Number of lines ending with U+000D,U+000A
-	int          mac_nl_count;  // Number of lines ending with U+000D
-	bool         has_utf8_bom;  // true if the UTF-8 BOM sequence is found
+	const Token*         tokens;        // Non-null when tokenize() is successful
+	int                  count;         // Number of tokens
+	const unsigned char* kinds;         // With OPT_Kinds, the Kind of each token
+	const char*          error;         // Non-null when tokenize() fails. Static
+	                                    // 0 terminated string, see format_error()
+	int                  error_line;    // Line number when the error was detected
+	ErrorRecord          error_record;  // Details of the error
+	int                  unix_nl_count; // Number of lines ending with U+000A
+	int                  dos_nl_count;  // Number of lines ending with U+000D,U+000A
+	int                  mac_nl_count;  // Number of lines ending with U+000D
+	bool                 has_utf8_bom;  // true if the UTF-8 BOM sequence is found
+	bool                 owns_tokens;   // false if 'tokens' belongs to an Arena
+	const char*          file_content;  // With tokenize_file(), the file content
+	size_t               file_len;      // Size in bytes of 'file_content'
+	const size_t*        line_starts;   // With OPT_LineIndex, position in the
+	                                    // content of each line, the first one
+	                                    // after the UTF-8 BOM
+	int                  line_count;    // Number of entries of 'line_starts'
+	const int*           matches;       // With OPT_MatchBrackets, for each
+	                                    // token the index of the matching
+	                                    // bracket, -1 if none, see below
+	const Directive*     directives;    // With OPT_Directives, the directives
+	                                    // in the order of the tokens
+	int                  directive_count; // Number of 'directives'
+};
+
+// The brackets are the (), [] and {} operators and the digraphs <: :> and
+// <% %>. A closing bracket is paired with the last opening one not paired
+// yet if they are of the same kind, otherwise it has no match. The brackets
+// inside directives are part of the TT_Macro tokens, so they are not paired.
+
+// Reusable token storage for tokenize().
+// Passing the same arena to successive tokenize() calls avoids allocating and
+// freeing a token pool for each file: the memory stays warm and only grows
+// when a file needs more tokens than the previous ones.
+// The tokens of a Result filled with an arena belong to the arena. They remain
+// valid until the arena is passed to tokenize() again, released or destroyed.
+// An arena must not be used by several threads at the same time.
+class Arena
+{
+public:
+	Arena();
+	~Arena();
+
+	// Gives the memory back to the heap. The arena can still be used after.
+	void release();
+
+	// Number of tokens the arena can hold without growing
+	int capacity() const;
+
+private:
+	Arena(const Arena&);            // Not copyable
+	Arena& operator=(const Arena&); // Not copyable
+
+	friend bool tokenize(const char*, int, int, Arena&, Result&);
+
+	Token*         m_pool;
+	unsigned char* m_kinds;
+	int            m_size;
 };
 
 // Tokenizes a C++ file.
@@ -97,9 +361,10 @@ struct Result
 // - the C++ code must be valid;
 // - macro usage must be parsable without being expanded.
 //
-// [in]  content     The C++ file to tokenize.
+// [in]  content     The C++ file to tokenize. No character after 'len' is
+//                   read, it needs no terminating 0 or padding.
 // [in]  len         Size in bytes of the C++ file.
-// [in]  options     Use 0 (reserved for future use).
+// [in]  options     Combination of Option flags, 0 for none.
 // [out] result      Structure filled with the tokenization result.
 //                   Must always be freed with free_result() after usage.
 // [ret] true upon success. When false, result.tokens contains as much
@@ -107,8 +372,462 @@ struct Result
 //       error information.
 
 bool tokenize(const char* content, int len, int options, Result& result);
+
+// Same as above for contents of 2 GB and more. The number of tokens and the
+// length of each token are still limited to 2^31 - 1.
+bool tokenize_large(const char* content, size_t len, int options,
+                    Result& result);
+
+// Same as tokenize() but the content is the file at 'path'. Files of 2 GB
+// and more are supported, as with tokenize_large(). The file is mapped in
+// memory instead of being copied, the tokens point on 'file_content'
+// which remains valid until free_result() is called.
+bool tokenize_file(const char* path, int options, Result& result);
+
+// Same as tokenize() but the tokens are stored in the arena memory.
+// free_result() must still be called, it does not free the arena memory.
+bool tokenize(const char* content, int len, int options, Arena& arena,
+              Result& result);
+
+// Same as tokenize() but a big content is split in parts that are tokenized
+// by several threads. The result is exactly the one of tokenize(). Mostly
+// useful for generated or amalgamated files of several MB.
+// [in]  threads  Maximum number of threads, including the calling one.
+//                0 for one per processor.
+bool tokenize_parallel(const char* content, int len, int options,
+                       Result& result, int threads);
+
 void free_result(Result&);
 
+// Builds the detailed message of a failed tokenization: the error, the parser
+// state, the character and its line with a caret under it. The content given
+// to tokenize() must still be valid.
+// [out] buf   Receives the message, truncated to 'size' - 1 characters and 0
+//             terminated. May be null if 'size' is 0.
+// [ret] Length of the whole message without the 0, 0 if there is no error.
+int format_error(const Result& result, char* buf, int size);
+
+// Finds the line of a position of the content in Result::line_starts, by
+// binary search. Needs OPT_LineIndex.
+// [out] line    Line number, starting at 1, 0 without the index
+// [out] column  Position in the line, starting at 0
+void find_line_column(const Result& result, size_t offset, int& line,
+                      size_t& column);
+
+// Index of the first token of a line, by binary search on the token lines,
+// without OPT_LineIndex. The tokens of the line N are the ones from
+// first_token_of_line(N) to first_token_of_line(N + 1) excluded.
+// [ret] Index of the first token whose line is 'line' or after, 'count'
+//       if none
+int first_token_of_line(const Result& result, int line);
+
+// Receives the pieces of a rebuilt content, see rebuild_with()
+// [ret] false to stop the rebuild
+typedef bool (*WriteFunc)(void* param, const char* data, size_t len);
+
+// Rebuilds the content from the tokens of a result: the UTF-8 BOM, the
+// tokens and the newlines between them, all in the style the most used in
+// the content. Gives back the whole content if its newlines have only one
+// style, without the skipped characters with the skip options.
+// The consecutive tokens that are also consecutive in the content are
+// copied at once, along with the newlines between them.
+// [out] out  Receives the content, truncated to 'cap' characters, without
+//            terminating 0. May be null if 'cap' is 0.
+// [ret] Length of the whole rebuilt content.
+size_t rebuild(const Result& result, char* out, size_t cap);
+
+// Same as above but the content is given to 'write' in pieces. The small
+// pieces are gathered in a buffer, the long ones point on the content.
+// [ret] false if 'write' returned false.
+bool rebuild_with(const Result& result, WriteFunc write, void* param);
+
+// First difference between a content and its tokens, see verify_roundtrip()
+struct Divergence
+{
+	const char* reason; // Static string, null if there is no difference
+	size_t      offset; // Position of the difference in the content
+	int         line;   // Line number of the difference
+	int         token;  // Index of the first token that does not match,
+	                    // the token count if the difference is after them
+};
+
+// Checks that the tokens give back the content: the UTF-8 BOM, then the
+// tokens one after the other with only newline sequences between them, as
+// many as the line numbers tell. With the skip options the check fails. The
+// newline style is not checked, see the newline counts of the result.
+// One pass over the tokens, nothing is allocated.
+// [in]  content     The content given to tokenize(), may be null if 'len'
+//                   is 0.
+// [out] divergence  Receives the first difference. May be null.
+// [ret] true if rebuild() gives back the content, but for the newline style:
+//       the newlines of a content with mixed styles get the most used one.
+bool verify_roundtrip(const char* content, size_t len, const Result& result,
+                      Divergence* divergence = 0);
+
+// Positions of the tokens of each type of a result, to go through the tokens
+// of some types without scanning the others, for example the identifiers
+// for a naming rule.
+struct TypeIndex
+{
+	enum { k_maxTypes = 32 };
+
+	const int* positions;              // Indexes of the tokens, grouped by
+	                                   // type, in the token order in a type
+	int        firsts[k_maxTypes + 1]; // The tokens of the type T are the
+	                                   // positions from firsts[T] to
+	                                   // firsts[T + 1] excluded
+};
+
+// Builds the index in two passes over the token types.
+// [out] index  Must always be freed with free_type_index() after usage.
+// [ret] false if the memory could not be allocated, the index is then empty
+bool build_type_index(const Result& result, TypeIndex& index);
+
+void free_type_index(TypeIndex&);
+
+// Accessors of the tokens of a type in a TypeIndex
+inline const int* type_positions(const TypeIndex& index, TokenType type)
+{
+	return index.positions + index.firsts[type];
+}
+
+inline int type_count(const TypeIndex& index, TokenType type)
+{
+	return index.firsts[type + 1] - index.firsts[type];
+}
+
+// Receives a token of a type the rule looks at, see visit_tokens()
+// [in] index  Index of the token in the result
+typedef void (*RuleFunc)(void* param, const Result& result, int index);
+
+// A check of the tokens, such as a naming or a comment rule
+struct Rule
+{
+	unsigned int types; // TokenType bits of the tokens to check, see
+	                    // type_bit(), ~0u for all
+	RuleFunc     func;
+	void*        param;
+};
+
+inline unsigned int type_bit(TokenType type)
+{
+	return 1u << type;
+}
+
+// Runs several rules in one pass over the tokens: each token is given to the
+// rules that take its type, in the order of 'rules'. The rules are grouped by
+// type first, so a token costs nothing to the rules that do not take it.
+void visit_tokens(const Result& result, const Rule* rules, int count);
+
+#if defined(CPPNOM_STATS)
+// Instrumentation of the parsing, to see which constructs dominate the cost
+// and to tune the token pool. Only available when cppnom.cpp is built with
+// CPPNOM_STATS defined, which slows the parsing down.
+struct Stats
+{
+	enum { k_maxStates = 32, k_maxTypes = 32 };
+
+	int         state_count;              // Number of parser states
+	const char* state_names[k_maxStates]; // Same names as in error messages
+	long long   state_calls[k_maxStates]; // Times each state was run
+	long long   state_bytes[k_maxStates]; // Characters consumed, skips included
+	long long   state_ticks[k_maxStates]; // CPU cycles on x86, see below
+	int         type_counts[k_maxTypes];  // Tokens of each TokenType
+	int         first_count;              // Tokens with ML_First
+	int         pool_initial_size;        // In number of tokens
+	int         pool_peak_size;           // Largest size of the token pool
+	int         pool_grow_count;          // Reallocations to grow the pool
+};
+
+// Same as tokenize() but also fills 'stats'. The token counts are the ones
+// of the result. Outside x86, the ticks are nanoseconds, or performance
+// counter ticks on Windows: only compare them to each other.
+bool tokenize_with_stats(const char* content, int len, int options,
+                         Result& result, Stats& stats);
+#endif
+
+// tokenize_compact() output structure. The token members are stored in
+// separate arrays, with offsets instead of pointers and one entry per line
+// instead of one line number per token: a token takes 10 bytes instead of
+// sizeof(Token), and a scan of the types touches only the type array.
+// Prefer the accessors below to reading the arrays.
+struct CompactResult
+{
+	const unsigned char* types;       // TokenType of each token
+	const unsigned char* multis;      // Multi of each token
+	const unsigned int*  offsets;     // Position of each token in the content
+	const unsigned int*  lens;        // Length of each token
+	const unsigned char* kinds;       // With OPT_Kinds, the Kind of each token
+	int                  count;       // Number of tokens
+	const int*           line_firsts; // For each line, index of its first
+	                                  // token, or of the next token if none
+	int                  line_count;  // Number of entries of 'line_firsts'
+	const char*          error;       // Same as in Result
+	int                  error_line;
+	ErrorRecord          error_record;
+	int                  unix_nl_count;
+	int                  dos_nl_count;
+	int                  mac_nl_count;
+	bool                 has_utf8_bom;
+	bool                 owns_arrays; // false if the arrays are in a cache,
+	                                  // see open_cache()
+};
+
+// Same as tokenize() but the tokens are stored in a CompactResult. The
+// tokens are converted while parsing, the Token array is never allocated.
+// OPT_LineIndex is ignored, see 'line_firsts'.
+// [out] result  Must always be freed with free_compact_result() after usage.
+bool tokenize_compact(const char* content, int len, int options,
+                      CompactResult& result);
+
+void free_compact_result(CompactResult&);
+
+// Same as format_error() for a CompactResult
+int format_error(const CompactResult& result, char* buf, int size);
+
+// Accessors of the token 'index' of a CompactResult.
+// 'content' is the one given to tokenize_compact().
+inline TokenType token_type(const CompactResult& result, int index)
+{
+	return TokenType(result.types[index]);
+}
+
+inline Multi token_multi(const CompactResult& result, int index)
+{
+	return Multi(result.multis[index]);
+}
+
+inline const char* token_str(const CompactResult& result, const char* content,
+                             int index)
+{
+	return content + result.offsets[index];
+}
+
+inline int token_len(const CompactResult& result, int index)
+{
+	return int(result.lens[index]);
+}
+
+// KD_None without OPT_Kinds
+inline int token_kind(const CompactResult& result, int index)
+{
+	if( !result.kinds )
+	{
+		return KD_None;
+	}
+	return result.kinds[index];
+}
+
+// Line number, starting at 1. Binary search in 'line_firsts'.
+int token_line(const CompactResult& result, int index);
+
+// Fills a Token, as tokenize() would have given it
+void get_token(const CompactResult& result, const char* content, int index,
+               Token& token);
+
+// Serialized tokens of a content, to skip the parsing when the same content
+// is tokenized again, for example by a server that gets the same headers for
+// each request. A cache holds the arrays of a CompactResult, with offsets
+// instead of pointers, after a header with the hash and the length of the
+// content, the options, the newline counts and CPPNOM_VERSION. It is only
+// valid for the same content and options, and a cpu of the same byte order.
+// Contents of 4 GB and more cannot be cached.
+
+// Hash of a content, the one a cache is keyed by. 64-bit, not cryptographic.
+unsigned long long content_hash(const char* content, size_t len);
+
+// Serializes a successful tokenize() result.
+// [in]  content  The content given to tokenize().
+// [in]  options  The options given to tokenize().
+// [out] buf      Receives the cache when 'size' is big enough, nothing is
+//                written otherwise. 4 bytes aligned, as malloc() gives.
+// [ret] Size in bytes of the cache, 0 if the result cannot be cached, for
+//       example when the content ends inside a literal.
+size_t save_cache(const Result& result, const char* content, size_t len,
+                  int options, void* buf, size_t size);
+
+// Uses a cache without copying it, for example a mapped cache file: the
+// arrays of the result point in 'data', which must remain valid while the
+// result is used. The tokens are checked against 'len', even a damaged cache
+// never gives tokens out of the content.
+// [in]  data     Cache given by save_cache(), 4 bytes aligned.
+// [in]  content  The content to tokenize, it has to be the cached one.
+// [out] result   Must always be freed with free_compact_result() after usage,
+//                which frees nothing of 'data'.
+// [ret] false if the cache is not the one of the content and the options,
+//       see result.error, the result then has no token.
+bool open_cache(const void* data, size_t size, const char* content,
+                size_t len, int options, CompactResult& result);
+
+// Same as open_cache() but fills a Result, the same as tokenize() gives.
+// The tokens point on 'content', 'data' is not needed anymore after.
+// [out] result  Must always be freed with free_result() after usage.
+bool load_cache(const void* data, size_t size, const char* content,
+                size_t len, int options, Result& result);
+
+// Same as tokenize_large() but the tokens are loaded from the cache
+// directory 'dir' when the same content was already tokenized with the same
+// options. Otherwise the content is tokenized and its cache is written in
+// 'dir', in a file named after the content hash. Several threads and
+// processes may use the same directory. Failing to write the cache is not
+// an error, and a failed tokenization is not cached.
+bool tokenize_cached(const char* content, size_t len, int options,
+                     const char* dir, Result& result);
+
+// One content to tokenize with tokenize_batch()
+struct Input
+{
+	const char* content;
+	int         len;
+};
+
+// tokenize_batch() output structure
+struct BatchResult
+{
+	Result* results;      // One per input, in the input order
+	int     count;        // Number of results
+	int     failed_count; // Number of inputs for which tokenization failed
+};
+
+// Tokenizes several C++ files using several threads. Each thread reuses its
+// own token memory from one file to the next, and takes the biggest file not
+// yet tokenized, so the threads stay busy until the end.
+// The results are the same as the ones of tokenize().
+//
+// [in]  inputs   The files to tokenize.
+// [in]  count    Number of inputs.
+// [in]  options  Combination of Option flags, 0 for none.
+// [out] batch    Structure filled with the results.
+//                Must always be freed with free_batch_result() after usage.
+// [in]  threads  Maximum number of threads, including the calling one.
+//                0 for one per processor.
+// [ret] true if all the inputs were tokenized successfully.
+bool tokenize_batch(const Input* inputs, int count, int options,
+                    BatchResult& batch, int threads);
+
+void free_batch_result(BatchResult&);
+
+// A change of a content: 'removed_len' characters at 'offset' are replaced
+// by 'inserted_len' characters
+struct Edit
+{
+	int offset;       // Position of the change, the same in both contents
+	int removed_len;  // Number of characters of the old content removed
+	int inserted_len; // Number of characters of the new content inserted
+};
+
+// retokenize() output structure: the tokens [first, first + removed_count)
+// of the old result are replaced by the tokens of 'result'. The old tokens
+// kept after get their 'str' moved by inserted_len - removed_len and their
+// 'line' by 'line_delta'. See apply_patch().
+struct Patch
+{
+	int    first;         // Index of the first old token replaced
+	int    removed_count; // Number of old tokens replaced
+	int    line_delta;    // Line change of the old tokens kept after
+	Result result;        // New tokens, pointing on the new content. The
+	                      // newline counts and the error are the ones of
+	                      // the whole new content. Has kinds if the old
+	                      // result has them, but neither matches nor
+	                      // directives, even when the whole content is
+	                      // tokenized again.
+};
+
+// Tokenizes a content after an edit, knowing the tokens before the edit.
+// The parsing restarts at the beginning of the line of the edit, or of a
+// previous line if a C++ token continues over the newline, and stops at the
+// first newline after the edit where the tokens become the old ones again.
+// The cost depends on the size of the edit, not on the size of the content.
+//
+// [in]  old_content  The content given to tokenize() for 'old_result'.
+// [in]  old_result   The successful tokenize() result of 'old_content',
+//                    without the skip options. OPT_Kinds is deduced from
+//                    'kinds'.
+// [in]  content      The new content.
+// [in]  len          Size in bytes of the new content.
+// [in]  edit         Change between 'old_content' and 'content'.
+// [out] patch        Structure filled with the token changes.
+//                    patch.result must always be freed with free_result().
+// [ret] true upon success. When false, the patch replaces all the old tokens
+//       after 'first' by the ones created before the error.
+bool retokenize(const char* old_content, const Result& old_result,
+                const char* content, int len, const Edit& edit, Patch& patch);
+
+// Builds the result of the new content, the same as tokenize() gives, from
+// the arguments given to retokenize() and the patch it gave.
+// [out] result  Must always be freed with free_result() after usage. Has no
+//               line index, even if 'old_result' has one. Has 'matches'
+//               and 'directives' if 'old_result' has them.
+// [ret] false upon error, see result.error
+bool apply_patch(const char* old_content, const Result& old_result,
+                 const char* content, const Edit& edit, const Patch& patch,
+                 Result& result);
+
+// Incremental version of tokenize() for content that comes in chunks, for
+// example from a socket or a decompressor. The tokens are given one by one as
+// soon as they cannot change anymore, so neither the whole content nor all the
+// tokens have to be kept in memory. The tokens are the same as the ones of
+// tokenize(), including the ML_First and ML_Next splitting.
+//
+// Usage:
+//   Tokenizer t(options);
+//   while( read chunk ) { t.feed(chunk, n); while( t.next(token) ) {...} }
+//   t.finish(); while( t.next(token) ) {...}
+//
+// The 'str' member of a token given by next() points on a copy of the content
+// owned by the tokenizer. It remains valid until the next call to feed() or
+// finish(). See also attach() to read only the beginning of a content.
+// The total length fed is not limited, only the buffered part is.
+class Tokenizer
+{
+public:
+	// [in] options  Combination of Option flags, 0 for none.
+	explicit Tokenizer(int options = 0);
+	~Tokenizer();
+
+	// Appends content to tokenize. A chunk may end anywhere, even in the
+	// middle of a token or of a newline sequence.
+	// [ret] false upon error, see error()
+	bool feed(const char* chunk, int len);
+
+	// Tells that all the content was given, the last tokens become available.
+	// [ret] false upon error, see error()
+	bool finish();
+
+	// Instead of feed() and finish(), tokenizes a whole content lazily: each
+	// call to next() parses only up to the token it gives and the tokens
+	// already given are not stored, so stopping early costs nothing more.
+	// The content is not copied, it must remain valid while tokens are used.
+	// [ret] false upon error, see error()
+	bool attach(const char* content, int len);
+
+	// Gets the next token.
+	// [ret] false if no token is available, either because more content is
+	//       needed or because all the tokens were given
+	bool next(Token& token);
+
+	// With OPT_Kinds, the Kind of the token last given by next()
+	int kind() const;
+
+	// Null if no error happened, otherwise the detailed message, as
+	// format_error() gives it. 0 terminated.
+	const char* error() const;
+	int error_line() const; // Line number when the error was detected
+
+	// Same as in Result, complete once finish() is called
+	int  unix_nl_count() const;
+	int  dos_nl_count() const;
+	int  mac_nl_count() const;
+	bool has_utf8_bom() const;
+
+private:
+	Tokenizer(const Tokenizer&);            // Not copyable
+	Tokenizer& operator=(const Tokenizer&); // Not copyable
+
+	struct Impl;
+	Impl* m_impl;
+};
+
 }
 
 #endif